@@ -7,22 +7,220 @@ that they have matching state variables at each barrier.
 """
 
 import argparse
+import array
+import ctypes
 import json
+import mmap
 import os
+import re
 import signal
 import socket
+import struct
 import subprocess
 import sys
 import threading
 import time
-from dataclasses import dataclass
-from typing import Any, Dict, List, Optional, Set, Tuple
+from dataclasses import dataclass, field, replace
+from typing import Any, Callable, Dict, List, Optional, Set, Tuple
 
 # Socket path for communication
 SOCKET_PATH = "/tmp/codetango.sock"
 
+# Per-segment counters below these values are too small to compare
+ACCOUNTING_FLOORS = {"rchar": 65536, "wchar": 65536, "read_bytes": 65536, "write_bytes": 65536}
+ACCOUNTING_FLOOR = 16
+
+# Layout of a libm call recorded by libcodetango_mathtrace: function, arguments, result
+MATH_RECORD_FORMAT = "=I4xddd"
+
+# Bytes of a stream one program may send ahead of the other
+STREAM_BUFFER_LIMIT = 16 * 1024 * 1024
+
+# Layout of a write to a watched variable: occurrence, instruction pointer, value
+WATCH_RECORD_FORMAT = "=QQQ"
+WATCH_RECORD_SIZE = struct.calcsize(WATCH_RECORD_FORMAT)
+
+# Events shown on each side of a call path split
+CALLTRACE_CONTEXT = 4
+
+# Differences of wide checkpoints reported per kind, the rest are counted
+SCALAR_REPORT_LIMIT = 10
+
+# Lanes compared as one block of memory before they are compared one by one
+LANE_BLOCK = 4096
+
+# prctl() option that makes orphaned descendants children of the caller
+PR_SET_CHILD_SUBREAPER = 36
+
 # Import the Barrier class from codetango.py
-from .codetango import Barrier
+from .codetango import Barrier, DTYPE_FORMATS
+from .cgroup import CgroupError, CgroupSession, ProgramCgroup, format_report, parse_size
+from .align import report_alignment
+from .arrow import ArrowExporter
+from .control import FILTER_KEYS, ControlServer, format_filters
+from .grid import describe_grid_difference
+from .profile import Profiler, StageTimer, format_metrics
+from .shm import SharedMemoryPublisher
+from .store import TraceStore
+from .schema import Schema
+from .stall import ProcessSample, SegmentTimes, describe_activity, sample_process
+
+# Seconds between two checks for stalled programs
+STALL_POLL_SECONDS = 0.5
+
+class MessageReader:
+    """Reads messages from a program connection.
+    
+    Each message is a line of JSON. If the message has a "binary" field, that
+    many bytes of raw payload follow the newline.
+    """
+    
+    def __init__(self, conn: socket.socket):
+        """Initialize the reader.
+        
+        Args:
+            conn: The socket connection to the program
+        """
+        self.conn = conn
+        self.buffer = bytearray()
+        self.message: Optional[Dict[str, Any]] = None
+        self.payload: Optional[bytearray] = None
+        self.received = 0
+        # When the first bytes of the message arrived, and how long the last one took to arrive
+        self.started: Optional[int] = None
+        self.receive_ns = 0
+    
+    def read_message(self) -> Optional[Tuple[Dict[str, Any], memoryview]]:
+        """Read the next message.
+        
+        A socket timeout may interrupt the read; the partial message is kept
+        and reading resumes on the next call.
+        
+        Returns:
+            The message and its binary payload, or None if the connection was closed
+            
+        Raises:
+            json.JSONDecodeError: If the message is not valid JSON
+        """
+        # Read the JSON header
+        if self.started is None and self.buffer:
+            self.started = time.perf_counter_ns()
+        while self.message is None:
+            end = self.buffer.find(b"\n")
+            if end >= 0:
+                line = bytes(self.buffer[:end])
+                del self.buffer[:end + 1]
+                message = json.loads(line.decode('utf-8'))
+                self.payload = bytearray(message.get("binary", 0))
+                self.received = min(len(self.buffer), len(self.payload))
+                self.payload[:self.received] = self.buffer[:self.received]
+                del self.buffer[:self.received]
+                self.message = message
+                break
+            data = self.conn.recv(65536)
+            if not data:
+                return None
+            if self.started is None:
+                self.started = time.perf_counter_ns()
+            self.buffer += data
+        
+        # Read the payload straight into its final buffer
+        view = memoryview(self.payload)
+        while self.received < len(self.payload):
+            n = self.conn.recv_into(view[self.received:])
+            if n == 0:
+                return None
+            self.received += n
+        
+        self.receive_ns = time.perf_counter_ns() - self.started
+        self.started = None
+        message, self.message, self.payload = self.message, None, None
+        return message, view
+
+@dataclass
+class Checkpoint:
+    """State registered by one program at one barrier."""
+    variables: Dict[str, Any]
+    # Raw memory regions: name -> (description, bytes)
+    regions: Dict[str, Tuple[Dict[str, Any], memoryview]] = field(default_factory=dict)
+    # File regions by reference: name -> (path, offset, length, dtype)
+    files: Dict[str, Dict[str, Any]] = field(default_factory=dict)
+    # I/O and syscall counters of the segment ending at this barrier
+    accounting: Dict[str, int] = field(default_factory=dict)
+    # Call sequence digests of the segment: thread -> (digest, events)
+    calltrace: Dict[int, Tuple[str, int]] = field(default_factory=dict)
+    # Writes to watched variables in the segment: name -> (description, records)
+    watches: Dict[str, Tuple[Dict[str, Any], memoryview]] = field(default_factory=dict)
+    # Source location of the wait() call: file:line
+    site: Optional[str] = None
+    # Scalars in registration order: (description, packed doubles)
+    scalars: Optional[Tuple[Dict[str, Any], memoryview]] = None
+    # Variables with one value per lane: name -> (description, values)
+    lanes: Dict[str, Tuple[Dict[str, Any], memoryview]] = field(default_factory=dict)
+    
+    @classmethod
+    def from_message(cls, message: Dict[str, Any], payload: memoryview) -> "Checkpoint":
+        """Build a checkpoint from a barrier message and its binary payload."""
+        checkpoint = cls(variables=message["variables"], files=message.get("files", {}),
+                         accounting=message.get("accounting", {}),
+                         calltrace={thread: (digest, events) for thread, digest, events in message.get("calltrace", [])},
+                         site=message.get("site"))
+        for name, region in message.get("regions", {}).items():
+            offset = region["offset"]
+            checkpoint.regions[name] = (region, payload[offset:offset + region["length"]])
+        for name, watch in message.get("watches", {}).items():
+            offset = watch["offset"]
+            size = watch["count"] * WATCH_RECORD_SIZE
+            checkpoint.watches[name] = (watch, payload[offset:offset + size])
+        scalars = message.get("scalars")
+        if scalars:
+            offset = scalars["offset"] + scalars.get("names", 0)
+            checkpoint.scalars = (scalars, payload[offset:offset + scalars["count"] * 8])
+        for name, lanes in message.get("lanes", {}).items():
+            offset = lanes["offset"]
+            size = lanes["count"] * struct.calcsize(DTYPE_FORMATS[lanes["dtype"]])
+            checkpoint.lanes[name] = (lanes, payload[offset:offset + size].cast(DTYPE_FORMATS[lanes["dtype"]]))
+        return checkpoint
+
+@dataclass
+class ScalarJoin:
+    """How the scalars of two name tables line up, computed once per pair of tables."""
+    # Positions of the common names in each table, in the order of program1;
+    # None if both tables list the same names in the same order
+    index1: Optional[List[int]]
+    index2: Optional[List[int]]
+    # Names registered by one program only
+    only1: List[str]
+    only2: List[str]
+    
+    @classmethod
+    def merge(cls, names1: List[str], names2: List[str]) -> "ScalarJoin":
+        """Match two name tables with a merge join of their sorted names."""
+        if names1 == names2:
+            return cls(None, None, [], [])
+        order1 = sorted(range(len(names1)), key=names1.__getitem__)
+        order2 = sorted(range(len(names2)), key=names2.__getitem__)
+        pairs = []
+        only1 = []
+        only2 = []
+        i = j = 0
+        while i < len(order1) and j < len(order2):
+            name1 = names1[order1[i]]
+            name2 = names2[order2[j]]
+            if name1 == name2:
+                pairs.append((order1[i], order2[j]))
+                i += 1
+                j += 1
+            elif name1 < name2:
+                only1.append(name1)
+                i += 1
+            else:
+                only2.append(name2)
+                j += 1
+        only1.extend(names1[k] for k in order1[i:])
+        only2.extend(names2[k] for k in order2[j:])
+        pairs.sort()
+        return cls([pair[0] for pair in pairs], [pair[1] for pair in pairs], only1, only2)
 
 @dataclass
 class ProgramInfo:
@@ -30,34 +228,417 @@ class ProgramInfo:
     process: subprocess.Popen
     program_id: str
     connection: Optional[socket.socket] = None
+    reader: Optional[MessageReader] = None
     barrier_data: Dict[str, Dict[str, Any]] = None
+    cgroup: Optional[ProgramCgroup] = None
+    # CPU time used up to the last barrier, in microseconds
+    cpu_usec: int = 0
+    # Function table of libcodetango_mathtrace: [name, arity]
+    math_functions: List[Tuple[str, int]] = field(default_factory=list)
+    # Source location of the previous barrier: (file, line)
+    last_site: Optional[Tuple[str, int]] = None
+    # The barrier the program was last released from, and when
+    last_barrier: Optional[str] = None
+    segment_start: float = field(default_factory=time.monotonic)
+    # Since when the program waits at a barrier, or None while it runs a segment
+    waiting_since: Optional[float] = None
+    # Whether the current segment was reported as stalled
+    stalled: bool = False
+    # The latest sample of /proc/<pid>/stat, taken by the stall check
+    sample: Optional[ProcessSample] = None
+    # Whether the connection of the program ended
+    disconnected: bool = False
     
     def __post_init__(self):
         self.barrier_data = {}
 
+@dataclass
+class Snapshot:
+    """A frozen copy of a program, forked at a matching barrier."""
+    program_id: str
+    barrier_id: str
+    pid: int
+    # The snapshot waits on its connection until it is resumed or the connection is closed
+    connection: socket.socket
+    reader: MessageReader
+
+class SnapshotProcess:
+    """A resumed snapshot, in place of the subprocess.Popen of the program it was forked from.
+    
+    The utility is the child subreaper of the programs, so once a program is
+    gone its snapshots are children of the utility and can be waited for.
+    """
+    
+    def __init__(self, pid: int):
+        self.pid = pid
+        self.returncode: Optional[int] = None
+    
+    def poll(self) -> Optional[int]:
+        if self.returncode is None:
+            try:
+                pid, status = os.waitpid(self.pid, os.WNOHANG)
+            except ChildProcessError:
+                # Reaped elsewhere, e.g. by init if the utility could not adopt it
+                self.returncode = -1
+                return self.returncode
+            if pid:
+                self.returncode = os.waitstatus_to_exitcode(status)
+        return self.returncode
+    
+    def wait(self) -> int:
+        # Polled, since the barrier handler polls the same process
+        while self.poll() is None:
+            time.sleep(0.05)
+        return self.returncode
+    
+    def send_signal(self, sig: int) -> None:
+        try:
+            os.kill(self.pid, sig)
+        except ProcessLookupError:
+            pass
+    
+    def terminate(self) -> None:
+        self.send_signal(signal.SIGTERM)
+    
+    def kill(self) -> None:
+        self.send_signal(signal.SIGKILL)
+
+def snapshot_memory(pid: int) -> int:
+    """Get the memory a snapshot holds on its own, in bytes.
+    
+    Right after the fork, a snapshot shares all its pages with the program;
+    each page the program writes afterwards becomes private to the snapshot.
+    """
+    total = 0
+    try:
+        with open(f"/proc/{pid}/smaps_rollup") as f:
+            for line in f:
+                if line.startswith(("Private_Clean:", "Private_Dirty:")):
+                    total += int(line.split()[1]) * 1024
+    except OSError:
+        pass
+    return total
+
+class StreamComparison:
+    """Compares a stream between the two programs while it is being received.
+    
+    Chunk boundaries may differ between the programs: the common prefix of
+    the received data is compared and dropped as soon as both programs have
+    sent it. A program that gets more than `limit` bytes ahead waits for the
+    other one, which bounds the memory held per stream.
+    """
+    
+    def __init__(self, name: str, limit: int, timeout: float, fmt: Optional[str] = None):
+        """Initialize the comparison.
+        
+        Args:
+            name: The name of the stream
+            limit: Bytes one program may send ahead of the other
+            timeout: Seconds to wait for the other program to catch up
+            fmt: struct format of the elements, overriding the declared dtype
+        """
+        self.name = name
+        self.limit = limit
+        self.timeout = timeout
+        self.fmt = fmt
+        self.cond = threading.Condition()
+        # "pending" until declared, then "open", "closed" or "absent"
+        self.state = {"program1": "pending", "program2": "pending"}
+        self.dtype: Dict[str, str] = {}
+        self.buffer = {"program1": bytearray(), "program2": bytearray()}
+        self.length = {"program1": 0, "program2": 0}
+        self.compared = 0
+        self.difference: Optional[Tuple[int, Any, Any]] = None
+        self.timed_out = False
+        self.stopped = False
+    
+    def open(self, program_id: str, dtype: str) -> None:
+        """Record that a program declared this stream."""
+        with self.cond:
+            self.state[program_id] = "open"
+            self.dtype[program_id] = dtype
+    
+    def close(self, program_id: str, state: str = "closed") -> None:
+        """Record that a program sent the end of this stream, or does not have it."""
+        with self.cond:
+            self.state[program_id] = state
+            self.cond.notify_all()
+    
+    def feed(self, program_id: str, data: memoryview) -> None:
+        """Add a chunk received from a program, waiting if it is too far ahead."""
+        other = "program2" if program_id == "program1" else "program1"
+        with self.cond:
+            self.length[program_id] += len(data)
+            
+            # Data that cannot be compared anymore is not kept
+            if (self.difference is not None or self.timed_out or self.stopped or self.state[other] == "absent"
+                    or (self.state[other] == "closed" and not self.buffer[other])):
+                return
+            
+            self.buffer[program_id] += data
+            self.compare()
+            
+            deadline = time.monotonic() + self.timeout
+            while (len(self.buffer[program_id]) > self.limit and self.difference is None
+                   and self.state[other] in ("pending", "open")):
+                remaining = deadline - time.monotonic()
+                if remaining <= 0:
+                    self.timed_out = True
+                    self.buffer[program_id] = bytearray()
+                    break
+                self.cond.wait(remaining)
+    
+    def element_format(self) -> str:
+        """Get the struct format of the elements of the stream."""
+        return self.fmt or DTYPE_FORMATS.get(self.dtype.get("program1"), "B")
+    
+    def stop(self) -> None:
+        """Stop comparing, e.g. because the streams got out of step."""
+        with self.cond:
+            self.stopped = True
+            self.buffer = {"program1": bytearray(), "program2": bytearray()}
+            self.cond.notify_all()
+    
+    def compare(self) -> None:
+        """Compare and drop the common prefix of the data received so far."""
+        fmt = self.element_format()
+        itemsize = struct.calcsize(fmt)
+        buffer1, buffer2 = self.buffer["program1"], self.buffer["program2"]
+        n = min(len(buffer1), len(buffer2))
+        n -= n % itemsize
+        if n == 0:
+            return
+        
+        if buffer1[:n] != buffer2[:n]:
+            offset = find_first_difference(memoryview(buffer1)[:n], memoryview(buffer2)[:n])
+            start = offset - offset % itemsize
+            value1 = struct.unpack_from(fmt, buffer1, start)
+            value2 = struct.unpack_from(fmt, buffer2, start)
+            self.difference = (
+                (self.compared + start) // itemsize,
+                value1 if len(value1) > 1 else value1[0],
+                value2 if len(value2) > 1 else value2[0],
+            )
+            self.buffer = {"program1": bytearray(), "program2": bytearray()}
+        else:
+            del buffer1[:n]
+            del buffer2[:n]
+            self.compared += n
+        self.cond.notify_all()
+    
+    def result(self) -> Optional[str]:
+        """Describe how the streams differ once both programs are done with them.
+        
+        Returns:
+            A description of the difference, or None if the streams match
+        """
+        if self.state["program1"] == "absent":
+            return f"Stream '{self.name}' exists in program2 but not in program1"
+        if self.state["program2"] == "absent":
+            return f"Stream '{self.name}' exists in program1 but not in program2"
+        if self.dtype["program1"] != self.dtype["program2"]:
+            return (
+                f"Stream '{self.name}' differs in type:\n"
+                f"  program1: {self.dtype['program1']}\n"
+                f"  program2: {self.dtype['program2']}"
+            )
+        if self.difference is not None:
+            index, value1, value2 = self.difference
+            return (
+                f"Stream '{self.name}' differs at element {index}:\n"
+                f"  program1: {value1}\n"
+                f"  program2: {value2}"
+            )
+        if self.timed_out:
+            return f"Stream '{self.name}' timed out waiting for the other program"
+        if self.length["program1"] != self.length["program2"]:
+            itemsize = struct.calcsize(DTYPE_FORMATS.get(self.dtype["program1"], "B"))
+            return (
+                f"Stream '{self.name}' differs in length:\n"
+                f"  program1: {self.length['program1'] // itemsize} elements\n"
+                f"  program2: {self.length['program2'] // itemsize} elements"
+            )
+        return None
+
+def encode_message(message: Dict[str, Any]) -> bytes:
+    """Encode a message to a program as a line of compact JSON."""
+    return json.dumps(message, separators=(',', ':')).encode('utf-8') + b"\n"
+
+def difference_subject(difference: str) -> str:
+    """Get what a difference is about, e.g. "Variable 'x'", without its details.
+    
+    Details such as indices and values change as an input is reduced, while
+    the subject stays the same.
+    """
+    line = difference.split("\n", 1)[0]
+    match = re.match(r"[A-Za-z ]*?'[^']*'", line)
+    if match:
+        return match.group(0)
+    return re.sub(r"\d+", "#", line).rstrip(":")
+
+def describe_layout(region: Dict[str, Any]) -> str:
+    """Describe the layout of a region, e.g. "64x64 float64" for a grid."""
+    if "shape" not in region:
+        return f"{region['length']} bytes, no shape"
+    return f"{'x'.join(str(extent) for extent in region['shape'])} {region['dtype']}"
+
+def differing_lanes(values1: memoryview, values2: memoryview) -> List[int]:
+    """Find the lanes where two lane variables with the same number of lanes differ.
+    
+    Values of the same type are compared bit for bit a block of lanes at a
+    time, so only the blocks that differ are visited lane by lane. Values of
+    different types, e.g. int32 and float64, are compared as numbers.
+    """
+    if values1.format != values2.format:
+        return [lane for lane, (value1, value2) in enumerate(zip(values1, values2))
+                if value1 != value2 and not (value1 != value1 and value2 != value2)]
+    bytes1, bytes2 = values1.cast('B'), values2.cast('B')
+    size = values1.itemsize
+    lanes = []
+    for start in range(0, len(values1), LANE_BLOCK):
+        end = min(start + LANE_BLOCK, len(values1))
+        if bytes1[start * size:end * size] != bytes2[start * size:end * size]:
+            lanes.extend(lane for lane in range(start, end)
+                         if bytes1[lane * size:(lane + 1) * size] != bytes2[lane * size:(lane + 1) * size])
+    return lanes
+
+def format_lanes(lanes: List[int], limit: int = SCALAR_REPORT_LIMIT) -> str:
+    """Format sorted lane numbers as ranges, e.g. "3, 17..20, 99"."""
+    ranges: List[List[int]] = []
+    for lane in lanes:
+        if ranges and lane == ranges[-1][1] + 1:
+            ranges[-1][1] = lane
+        else:
+            ranges.append([lane, lane])
+    text = ", ".join(f"{first}..{last}" if first != last else f"{first}" for first, last in ranges[:limit])
+    if len(ranges) > limit:
+        text += f", ... {len(ranges) - limit} more ranges"
+    return text
+
+def find_first_difference(data1: memoryview, data2: memoryview) -> int:
+    """Find the offset of the first differing byte of two equally sized buffers.
+    
+    Blocks are compared with memcmp first, so only one block is scanned byte by byte.
+    
+    Returns:
+        The offset of the first difference, or -1 if the buffers are equal
+    """
+    block = 65536
+    for start in range(0, len(data1), block):
+        end = min(start + block, len(data1))
+        if data1[start:end] != data2[start:end]:
+            for i in range(start, end):
+                if data1[i] != data2[i]:
+                    return i
+    return -1
+
 class CodeTango:
     """Main control utility for synchronizing programs at barrier points."""
     
     def __init__(self, program1_cmd: List[str], program2_cmd: List[str],
-                 timeout: int = 60, verbose: bool = False):
+                 timeout: int = 60, verbose: bool = False, cgroups: bool = False,
+                 cpu_limit: Optional[float] = None, memory_limit: Optional[int] = None,
+                 accounting: bool = False, accounting_ratio: float = 2.0,
+                 mathtrace: Optional[str] = None, socket_path: str = SOCKET_PATH,
+                 stdin: Optional[str] = None, fail_fast: bool = False,
+                 snapshot_interval: int = 0, snapshot_limit: int = 2,
+                 snapshot_memory_limit: Optional[int] = None,
+                 rewind_env: Optional[Dict[str, str]] = None, schema: Optional[str] = None,
+                 stall_factor: float = 10.0, arrow: Optional[str] = None,
+                 shm: Optional[str] = None, shm_size: int = 64 << 20,
+                 store: Optional[str] = None, profile: bool = False,
+                 control: Optional[str] = None, filters: Optional[Dict[str, List[str]]] = None):
         """Initialize the CodeTango utility.
         
         Args:
             program1_cmd: Command to launch the first program
             program2_cmd: Command to launch the second program
-            timeout: Timeout in seconds for waiting at barriers
+            timeout: Timeout in seconds for connections, and for the segments
+                between barriers until their usual duration is learned
             verbose: Whether to print verbose output
+            cgroups: Whether to run each program in its own cgroup and report its resource usage
+            cpu_limit: CPU bandwidth limit per program, in cores (implies cgroups)
+            memory_limit: Memory limit per program, in bytes (implies cgroups)
+            accounting: Whether the programs send I/O and syscall counters with each barrier
+            accounting_ratio: Report segments where a counter differs by more than this factor
+            mathtrace: Path of libcodetango_mathtrace to preload into the programs
+            socket_path: Path of the socket the programs connect to; pairs run
+                concurrently need one each
+            stdin: Path of a file to feed to the standard input of both programs
+            fail_fast: Whether to stop both programs at the first barrier where they differ
+            snapshot_interval: Fork a snapshot of both programs at every this many
+                matching barriers, and rewind to the last one at the first difference
+            snapshot_limit: Number of snapshots of each program kept at a time
+            snapshot_memory_limit: Memory of the kept snapshots, in bytes, beyond
+                which older snapshots are dropped
+            rewind_env: Environment variables to set in the programs when they are
+                rewound, e.g. to check more often
+            schema: Path of the schema of the checkpoint records the programs send
+            stall_factor: Report a program as stalled when a segment takes this many
+                times its usual duration; 0 disables stall detection
+            arrow: Directory to export the checkpoints to as Arrow IPC files
+            shm: Name of a shared-memory ring to publish the checkpoints to, /dev/shm/<name>
+            shm_size: Size of the ring in bytes; slow readers lose records older than that
+            store: Path of a columnar trace store to record the numeric values to, see store.py
+            profile: Whether to print the time of the utility per stage and barrier at the end
+            control: Path of a socket to serve control requests on while running, e.g. metrics
+            filters: Shell-style patterns of the barriers and variables the programs check, by
+                kind: include_barriers, exclude_barriers, include_variables, exclude_variables
         """
         self.program1_cmd = program1_cmd
         self.program2_cmd = program2_cmd
         self.timeout = timeout
         self.verbose = verbose
+        self.cgroups = cgroups or cpu_limit is not None or memory_limit is not None
+        self.cpu_limit = cpu_limit
+        self.memory_limit = memory_limit
+        self.socket_path = socket_path
+        self.stdin = stdin
+        
+        # The first barrier where the programs differed, and what differed there
+        self.fail_fast = fail_fast
+        self.divergence: Optional[Tuple[str, List[str]]] = None
+        
+        # Snapshots of the programs by number, taken at every snapshot_interval
+        # matching barriers; the first difference rewinds both programs once
+        self.snapshot_interval = snapshot_interval
+        self.snapshot_limit = max(snapshot_limit, 1)
+        self.snapshot_memory_limit = snapshot_memory_limit
+        self.rewind_env = rewind_env or {}
+        self.snapshots: Dict[int, Dict[str, Snapshot]] = {}
+        self.snapshot_pids: List[int] = []
+        self.matched_barriers = 0
+        self.rewound = False
+        
+        # Usual durations of the segments of both programs, checked by a watchdog thread
+        self.stall_factor = stall_factor
+        self.segment_times = SegmentTimes(stall_factor, timeout)
+        self.stalls = 0
+        self.finished = threading.Event()
+        
+        # Transient cgroups of the programs, and their CPU time per segment
+        self.cgroup_session: Optional[CgroupSession] = None
+        self.segment_usage: Dict[str, Dict[str, int]] = {}
+        
+        # I/O and syscall counters of the programs, summed over all segments
+        self.accounting = accounting
+        self.accounting_ratio = accounting_ratio
+        self.accounting_totals: Dict[str, Dict[str, int]] = {}
+        
+        # libm calls of each thread, compared while they are received
+        self.mathtrace = mathtrace
+        self.math_traces: Dict[int, StreamComparison] = {}
+        
+        # A barrier held back until both programs sent their recent calls:
+        # barrier_id, result, threads and the rings received so far
+        self.calltrace_request: Optional[Dict[str, Any]] = None
         
         # Programs keyed by their ID
         self.programs: Dict[str, ProgramInfo] = {}
         
-        # Barriers that have been reached by each program
-        self.barriers: Dict[str, Dict[str, Dict[str, Any]]] = {}
+        # Checkpoints of the barriers currently being reached, by program;
+        # a barrier is removed once both programs are released from it
+        self.barriers: Dict[str, Dict[str, Checkpoint]] = {}
         
         # Lock for thread safety
         self.lock = threading.Lock()
@@ -65,51 +646,211 @@ class CodeTango:
         # Barrier order for validation
         self.barrier_sequence = []
         
+        # The barriers each program reached, in order, as indices into barrier_names;
+        # aligned at the end when the control flow of the programs diverged
+        self.barrier_names: List[str] = []
+        self.barrier_codes: Dict[str, int] = {}
+        self.barrier_streams: Dict[str, List[int]] = {"program1": [], "program2": []}
+        # Stream lengths at each snapshot, to which a rewind truncates them
+        self.snapshot_streams: Dict[int, Dict[str, int]] = {}
+        
+        # Set when the programs waited at different barriers; they run on uncompared
+        self.desynchronized = False
+        
+        # Source segments the programs ran through: (program ID, file, first line, last line)
+        self.coverage: Set[Tuple[str, str, int, int]] = set()
+        
+        # Name tables of scalars by program and table, and how pairs of tables line up
+        self.scalar_tables: Dict[Tuple[str, str], List[str]] = {}
+        self.scalar_joins: Dict[Tuple[str, str], ScalarJoin] = {}
+        
+        # Verdicts of the lanes of batched checkpoints: the number of lanes, and the
+        # first barrier each failing lane differed at, with the variables that differed
+        self.lane_count = 0
+        self.lane_failures: Dict[int, Tuple[str, List[str]]] = {}
+        
+        # Streams being compared at each barrier, and the streams each program declared there
+        self.streams: Dict[str, Dict[str, StreamComparison]] = {}
+        self.stream_declarations: Dict[str, Dict[str, Set[str]]] = {}
+        
+        # Layout of the fixed-layout checkpoint records, see schema.py
+        self.schema = Schema.load(schema) if schema else None
+        
+        # Receivers of the checkpoints of both programs at each barrier, e.g. exporters:
+        # add(barrier_id, matched, values by program) and close() at the end of the run
+        self.checkpoint_sinks: List[Any] = []
+        if arrow:
+            self.checkpoint_sinks.append(ArrowExporter(arrow))
+        if shm:
+            self.checkpoint_sinks.append(SharedMemoryPublisher(shm, shm_size))
+        if store:
+            self.checkpoint_sinks.append(TraceStore(store))
+        
+        # Patterns of the barriers and variables the programs check, by kind; given to the
+        # programs at launch, and sent with the next result when changed while they run
+        self.filters = {key: list((filters or {}).get(key, [])) for key in FILTER_KEYS}
+        self.push_filters = False
+        
+        # Time of the utility per stage, printed at the end with profile, and served
+        # with the other requests of the control channel, see profile.py and control.py
+        self.profile = profile
+        self.profiler = Profiler()
+        self.control = ControlServer(control, {
+            "metrics": lambda request: self.profiler.metrics(),
+            "filters": self.update_filters,
+        }) if control else None
+        
         # Set up socket server
         self.server = None
         self.setup_socket()
         
     def setup_socket(self) -> None:
         """Set up the Unix domain socket for communication."""
-        if os.path.exists(SOCKET_PATH):
-            os.unlink(SOCKET_PATH)
+        if os.path.exists(self.socket_path):
+            os.unlink(self.socket_path)
             
         self.server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
-        self.server.bind(SOCKET_PATH)
+        self.server.bind(self.socket_path)
         self.server.listen(2)  # Accept up to 2 connections
         
         if self.verbose:
-            print(f"Socket server listening at {SOCKET_PATH}")
+            print(f"Socket server listening at {self.socket_path}")
         
     def launch_programs(self) -> None:
         """Launch both programs with the necessary environment."""
         env = os.environ.copy()
-        env["CODETANGO_SOCKET"] = SOCKET_PATH
+        env["CODETANGO_SOCKET"] = self.socket_path
+        if self.accounting:
+            env["CODETANGO_ACCOUNTING"] = "1"
+        if any(self.filters.values()):
+            env["CODETANGO_FILTERS"] = json.dumps(self.encode_filters())
+        if self.snapshot_interval:
+            # Snapshots outlive the programs they are forked from when they are resumed
+            libc = ctypes.CDLL(None, use_errno=True)
+            if libc.prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0) != 0:
+                print(f"Warning: Cannot adopt resumed snapshots: {os.strerror(ctypes.get_errno())}")
+        if self.mathtrace:
+            preload = os.path.abspath(self.mathtrace)
+            env["LD_PRELOAD"] = f"{preload} {env['LD_PRELOAD']}" if env.get("LD_PRELOAD") else preload
         
-        # Start first program
+        if self.cgroups:
+            try:
+                self.cgroup_session = CgroupSession(self.cpu_limit, self.memory_limit)
+            except CgroupError as e:
+                print(f"Warning: Running without cgroup isolation: {e}")
+        
+        # Start first program; each program reads the input file from its own offset
+        cgroup1 = self.create_cgroup("program1")
+        stdin1 = open(self.stdin, "rb") if self.stdin else None
         program1 = subprocess.Popen(
             self.program1_cmd,
             env=env,
-            stdout=subprocess.PIPE if not self.verbose else None,
-            stderr=subprocess.PIPE if not self.verbose else None,
-            text=True
+            stdin=stdin1,
+            stdout=subprocess.DEVNULL if not self.verbose else None,
+            stderr=subprocess.DEVNULL if not self.verbose else None,
+            text=True,
+            preexec_fn=self.cgroup_attacher(cgroup1)
         )
+        if stdin1:
+            stdin1.close()
         self.programs["program1"] = ProgramInfo(process=program1, program_id="program1")
         
         # Start second program
+        cgroup2 = self.create_cgroup("program2")
+        stdin2 = open(self.stdin, "rb") if self.stdin else None
         program2 = subprocess.Popen(
             self.program2_cmd,
             env=env,
-            stdout=subprocess.PIPE if not self.verbose else None,
-            stderr=subprocess.PIPE if not self.verbose else None,
-            text=True
+            stdin=stdin2,
+            stdout=subprocess.DEVNULL if not self.verbose else None,
+            stderr=subprocess.DEVNULL if not self.verbose else None,
+            text=True,
+            preexec_fn=self.cgroup_attacher(cgroup2)
         )
+        if stdin2:
+            stdin2.close()
         self.programs["program2"] = ProgramInfo(process=program2, program_id="program2")
         
+        # The programs attach themselves; check that it worked
+        for program, cgroup in ((self.programs["program1"], cgroup1), (self.programs["program2"], cgroup2)):
+            if cgroup and cgroup.contains(program.process.pid):
+                program.cgroup = cgroup
+            elif cgroup:
+                print(f"Warning: Could not move {program.program_id} into {cgroup.path}")
+        
         if self.verbose:
             print(f"Launched program 1: {' '.join(self.program1_cmd)}")
             print(f"Launched program 2: {' '.join(self.program2_cmd)}")
     
+    def create_cgroup(self, program_id: str) -> Optional[ProgramCgroup]:
+        """Create the cgroup of a program, if cgroup isolation is available.
+        
+        Args:
+            program_id: The ID of the program
+            
+        Returns:
+            The cgroup, or None
+        """
+        if not self.cgroup_session:
+            return None
+        try:
+            return self.cgroup_session.create_group(program_id)
+        except CgroupError as e:
+            print(f"Warning: Running {program_id} without cgroup isolation: {e}")
+            return None
+    
+    @staticmethod
+    def cgroup_attacher(cgroup: Optional[ProgramCgroup]) -> Optional[Callable[[], None]]:
+        """Get a function moving a forked program into its cgroup before exec."""
+        if not cgroup:
+            return None
+        
+        def attach() -> None:
+            try:
+                cgroup.attach_self()
+            except OSError:
+                # Reported by the parent, which checks the membership
+                pass
+        return attach
+    
+    def sample_usage(self, barrier_id: str) -> None:
+        """Read the resource usage of the programs at a barrier release.
+        
+        The CPU time since the previous barrier is accounted to the segment
+        ending at this barrier.
+        
+        Args:
+            barrier_id: The ID of the barrier
+        """
+        segment = self.segment_usage.setdefault(barrier_id, {})
+        for program_id, program in self.programs.items():
+            if not program.cgroup:
+                continue
+            stats = program.cgroup.read_stats()
+            cpu_usec = stats.get("cpu_user_usec", 0) + stats.get("cpu_system_usec", 0)
+            segment[program_id] = segment.get(program_id, 0) + cpu_usec - program.cpu_usec
+            program.cpu_usec = cpu_usec
+            if self.verbose:
+                print(f"{program_id} used {cpu_usec / 1e6:.3f} s CPU, "
+                      f"{stats.get('memory_peak', 0) / 2**20:.1f} MiB peak memory up to barrier '{barrier_id}'")
+    
+    def report_usage(self) -> None:
+        """Print the resource usage of both programs side by side."""
+        stats = {program_id: program.cgroup.read_stats()
+                 for program_id, program in self.programs.items() if program.cgroup}
+        if stats:
+            print()
+            for line in format_report(stats, self.segment_usage):
+                print(line)
+        
+        if self.accounting_totals:
+            programs = sorted(self.accounting_totals)
+            keys = sorted(set().union(*(self.accounting_totals[p] for p in programs)))
+            print(f"\n{'I/O and syscalls at barriers:':<30}" + "".join(f"{p:>16}" for p in programs))
+            for key in keys:
+                print(f"  {key:<28}" + "".join(
+                    f"{self.accounting_totals[p].get(key, '-'):>16}" for p in programs))
+    
     def accept_connections(self) -> None:
         """Accept connections from the launched programs."""
         self.server.settimeout(self.timeout)
@@ -120,17 +861,30 @@ class CodeTango:
                 conn, addr = self.server.accept()
                 
                 # Get the program ID
-                data = conn.recv(1024)
-                if not data:
+                reader = MessageReader(conn)
+                received = reader.read_message()
+                if not received:
                     print("Error: Empty connection data")
                     continue
                     
-                init_msg = json.loads(data.decode('utf-8'))
+                init_msg, _ = received
                 program_id = init_msg["program_id"]
                 
+                # Records are decoded with the schema the program was generated from
+                schema_hash = init_msg.get("schema")
+                if schema_hash is not None and (not self.schema or schema_hash != self.schema.hash):
+                    if self.schema:
+                        print(f"Error: {program_id} was generated from schema {schema_hash}, "
+                              f"but the given schema is {self.schema.hash}")
+                    else:
+                        print(f"Error: {program_id} sends records of schema {schema_hash}; pass the schema with --schema")
+                    self.cleanup()
+                    sys.exit(1)
+                
                 # Store the connection with the program info
                 if program_id in self.programs:
                     self.programs[program_id].connection = conn
+                    self.programs[program_id].reader = reader
                     if self.verbose:
                         print(f"Connection established with {program_id}")
                 else:
@@ -149,54 +903,109 @@ class CodeTango:
             program_id: The ID of the program sending the barrier message
             conn: The socket connection to the program
         """
+        # A rewind replaces the program, and this handler ends with it
+        program = self.programs[program_id]
         while True:
             try:
                 # Set a timeout to check if process is still alive
                 conn.settimeout(1.0)
                 
                 # Check if process is still running
-                if self.programs[program_id].process.poll() is not None:
+                if program.process.poll() is not None:
                     if self.verbose:
                         print(f"{program_id} has terminated")
                     break
                 
                 # Receive barrier message
-                data = conn.recv(4096)
-                if not data:
+                received = program.reader.read_message()
+                if not received:
                     # Connection closed
                     break
                 
+                # Recorded libm calls arrive in between barrier messages
+                message, payload = received
+                if "mathtrace" in message:
+                    self.receive_math(program_id, message, payload)
+                    continue
+                
+                # Recent calls, sent on request after a call sequence mismatch
+                if "calltrace_ring" in message:
+                    self.receive_calltrace_ring(program_id, message["calltrace_ring"])
+                    continue
+                
+                # The program is blocked from here until it is released from the barrier
+                timer = self.profiler.start(program_id, program.reader.receive_ns)
+                
+                # A record carries the index of its barrier and no names
+                if "record" in message:
+                    if not self.schema:
+                        raise ValueError("received a schema record without a schema")
+                    barrier_id, variables = self.schema.decode(message["record"], payload)
+                    message = {"barrier_id": barrier_id, "variables": variables}
+                
                 # Parse the barrier message
-                message = json.loads(data.decode('utf-8'))
                 barrier_id = message["barrier_id"]
-                variables = message["variables"]
+                checkpoint = Checkpoint.from_message(message, payload)
+                
+                # A name table of scalars is sent once, before the first values that use it
+                scalars = message.get("scalars")
+                if scalars and "names" in scalars:
+                    names = bytes(payload[scalars["offset"]:scalars["offset"] + scalars["names"]])
+                    self.scalar_tables[(program_id, scalars["table"])] = names.decode('utf-8').split("\0")[:-1]
+                timer.lap("decode")
+                
+                # Streams are compared while they are received, before the barrier is
+                # complete; a program without streams still declares it has none
+                self.receive_streams(program_id, barrier_id, message.get("streams", {}))
+                timer.lap("streams" if message.get("streams") else None)
                 
                 with self.lock:
+                    timer.lap("lock")
                     if self.verbose:
                         print(f"{program_id} reached barrier '{barrier_id}'")
                     
+                    if checkpoint.site:
+                        self.record_segment(program_id, checkpoint.site)
+                    
                     # Add to barrier sequence (for first program only)
                     if program_id == "program1" and barrier_id not in self.barrier_sequence:
                         self.barrier_sequence.append(barrier_id)
                     
+                    if barrier_id not in self.barrier_codes:
+                        self.barrier_codes[barrier_id] = len(self.barrier_names)
+                        self.barrier_names.append(barrier_id)
+                    self.barrier_streams[program_id].append(self.barrier_codes[barrier_id])
+                    
+                    if self.desynchronized:
+                        self.end_segment(program, barrier_id)
+                        self.run_freely(program, barrier_id)
+                        continue
+                    
                     # Create barrier entry if it doesn't exist
                     if barrier_id not in self.barriers:
                         self.barriers[barrier_id] = {}
                     
                     # Store variables for this program at this barrier
-                    self.barriers[barrier_id][program_id] = variables
+                    self.barriers[barrier_id][program_id] = checkpoint
+                    self.end_segment(program, barrier_id)
+                    self.profiler.arrive(timer)
                     
                     # Check if both programs have reached this barrier
                     if len(self.barriers[barrier_id]) == 2:
-                        # Both programs have reached this barrier
-                        self.compare_variables(barrier_id)
-                        
-                        # Allow both programs to continue
+                        # Both programs have reached this barrier: compare
+                        # and allow both programs to continue
                         self.release_programs(barrier_id)
+                    else:
+                        self.check_desynchronized()
                     
             except socket.timeout:
                 # This is just a timeout for the socket recv, continue
                 continue
+            except OSError as e:
+                # The connection is broken, e.g. the program was stopped
+                if self.verbose:
+                    print(f"Connection to {program_id} lost: {e}")
+                break
             except json.JSONDecodeError as e:
                 print(f"Error decoding message from {program_id}: {e}")
                 # Send error and allow continue
@@ -204,18 +1013,344 @@ class CodeTango:
             except Exception as e:
                 print(f"Error handling barrier for {program_id}: {e}")
                 self.send_result(program_id, False, f"Internal error: {e}")
+        
+        # The other program must not wait for this one at a barrier
+        with self.lock:
+            program.disconnected = True
+            if self.programs[program_id] is program:
+                self.check_desynchronized()
+    
+    def check_desynchronized(self) -> None:
+        """Let the programs run on if they would wait for each other forever.
+        
+        That is when they wait at different barriers, or one waits for a
+        program that ended. The checkpoints are not compared from then on,
+        and the barrier streams of the programs are aligned at the end of
+        the run instead.
+        """
+        if self.desynchronized or self.finished.is_set():
+            return
+        waiting = {program_id: barrier_id for barrier_id, checkpoints in self.barriers.items()
+                   for program_id in checkpoints}
+        if not waiting or any(program_id not in waiting and not program.disconnected
+                              for program_id, program in self.programs.items()):
+            return
+        
+        self.desynchronized = True
+        states = [f"{program_id} waits at barrier '{waiting[program_id]}'" if program_id in waiting
+                  else f"{program_id} has ended" for program_id in sorted(self.programs)]
+        print(f"\nThe programs desynchronized: {', '.join(states)}")
+        if self.fail_fast:
+            print("Stopping the programs (fail-fast)")
+            self.stop_programs()
+            return
+        print("Running them on without comparing their checkpoints")
+        self.barriers.clear()
+        for program_id, barrier_id in waiting.items():
+            self.run_freely(self.programs[program_id], barrier_id)
+    
+    def run_freely(self, program: ProgramInfo, barrier_id: str) -> None:
+        """Release a program from a barrier without comparison, after the programs desynchronized."""
+        self.send_result(program.program_id, False, "Not compared: the programs desynchronized")
+        program.last_barrier = barrier_id
+        program.segment_start = time.monotonic()
+        program.waiting_since = None
+    
+    def record_segment(self, program_id: str, site: str) -> None:
+        """Record the source segment a program ran through to reach a barrier.
+        
+        The segment spans the lines from the previous barrier of the program
+        to this one, when both are in the same file; otherwise it spans the
+        start of the file to this barrier.
+        
+        Args:
+            program_id: The ID of the program
+            site: The source location of the barrier as file:line
+        """
+        path, _, line = site.rpartition(":")
+        line = int(line)
+        program = self.programs[program_id]
+        if program.last_site and program.last_site[0] == path:
+            first, last = sorted((program.last_site[1], line))
+        else:
+            first, last = 1, line
+        self.coverage.add((program_id, path, first, last))
+        program.last_site = (path, line)
+    
+    def receive_streams(self, program_id: str, barrier_id: str, streams: Dict[str, Dict[str, Any]]) -> None:
+        """Receive the chunks of the streams a program declared at a barrier.
+        
+        Args:
+            program_id: The ID of the program sending the streams
+            barrier_id: The ID of the barrier
+            streams: The declared streams: name -> {"dtype": ...}
+        """
+        other = "program2" if program_id == "program1" else "program1"
+        with self.lock:
+            registry = self.streams.setdefault(barrier_id, {})
+            declarations = self.stream_declarations.setdefault(barrier_id, {})
+            declarations[program_id] = set(streams)
+            for name, stream in streams.items():
+                if name not in registry:
+                    registry[name] = StreamComparison(name, STREAM_BUFFER_LIMIT, self.timeout)
+                registry[name].open(program_id, stream["dtype"])
+                if other in declarations and name not in declarations[other]:
+                    registry[name].close(other, "absent")
+            for name, comparison in registry.items():
+                if name not in streams:
+                    comparison.close(program_id, "absent")
+            comparisons = {name: registry[name] for name in streams}
+        
+        reader = self.programs[program_id].reader
+        remaining = set(streams)
+        try:
+            while remaining:
+                try:
+                    received = reader.read_message()
+                except socket.timeout:
+                    if self.programs[program_id].process.poll() is not None:
+                        raise ConnectionError(f"{program_id} terminated while sending streams")
+                    continue
+                if not received:
+                    raise ConnectionError(f"{program_id} closed the connection while sending streams")
+                
+                chunk, payload = received
+                if "mathtrace" in chunk:
+                    self.receive_math(program_id, chunk, payload)
+                    continue
+                name = chunk["stream"]
+                if chunk.get("end"):
+                    comparisons[name].close(program_id)
+                    remaining.discard(name)
+                else:
+                    comparisons[name].feed(program_id, payload)
+        finally:
+            # Never leave the other program waiting for a stream that will not come
+            for name in remaining:
+                comparisons[name].close(program_id)
+    
+    def receive_math(self, program_id: str, message: Dict[str, Any], payload: memoryview) -> None:
+        """Compare a batch of libm calls recorded by a thread of a program.
+        
+        Args:
+            program_id: The ID of the program
+            message: The batch message
+            payload: The recorded calls
+        """
+        thread = message["mathtrace"]
+        if "functions" in message:
+            self.programs[program_id].math_functions = message["functions"]
+        
+        with self.lock:
+            comparison = self.math_traces.get(thread)
+            if comparison is None:
+                comparison = StreamComparison(f"libm calls of thread {thread}", STREAM_BUFFER_LIMIT,
+                                              self.timeout, fmt=MATH_RECORD_FORMAT)
+                comparison.open("program1", "math")
+                comparison.open("program2", "math")
+                self.math_traces[thread] = comparison
+        comparison.feed(program_id, payload)
+    
+    def describe_math_call(self, program_id: str, record: Tuple[int, float, float, float]) -> str:
+        """Format a recorded libm call, e.g. "pow(2.0, 0.5) = 1.4142135623730951"."""
+        function, arg0, arg1, result = record
+        functions = self.programs[program_id].math_functions
+        name, arity = functions[function] if function < len(functions) else (f"function{function}", 2)
+        args = f"{arg0!r}, {arg1!r}" if arity == 2 else f"{arg0!r}"
+        return f"{name}({args}) = {result!r}"
+    
+    def compare_math(self, barrier_id: str) -> List[str]:
+        """Check the libm calls made by the programs before a barrier.
+        
+        All calls made before the barrier have been received from both
+        programs, so calls left over on one side mean that a thread made
+        more calls than its counterpart.
+        
+        Args:
+            barrier_id: The ID of the barrier
+            
+        Returns:
+            List[str]: Descriptions of new differences
+        """
+        differences = []
+        for thread, comparison in sorted(self.math_traces.items()):
+            with comparison.cond:
+                if comparison.stopped:
+                    continue
+                if comparison.difference is not None:
+                    index, record1, record2 = comparison.difference
+                    differences.append(
+                        f"libm call #{index} of thread {thread} differs:\n"
+                        f"  program1: {self.describe_math_call('program1', record1)}\n"
+                        f"  program2: {self.describe_math_call('program2', record2)}"
+                    )
+                elif comparison.buffer["program1"] or comparison.buffer["program2"]:
+                    more = "program1" if comparison.buffer["program1"] else "program2"
+                    size = struct.calcsize(MATH_RECORD_FORMAT)
+                    first = struct.unpack_from(MATH_RECORD_FORMAT, comparison.buffer[more])
+                    differences.append(
+                        f"Thread {thread} of {more} made {len(comparison.buffer[more]) // size} more libm calls, "
+                        f"starting with call #{comparison.compared // size}:\n"
+                        f"  {more}: {self.describe_math_call(more, first)}"
+                    )
+                else:
+                    continue
+            # Report only the first divergence of each thread
+            comparison.stop()
+        return differences
     
-    def compare_variables(self, barrier_id: str) -> bool:
+    def compare_calltrace(self, barrier_id: str) -> List[str]:
+        """Compare the call sequence digests of the segment ending at a barrier.
+        
+        Only programs linked with libcodetango_calltrace send digests, so
+        nothing is compared unless both do. Threads whose calls differ are
+        remembered, to ask both programs for their recent calls.
+        
+        Args:
+            barrier_id: The ID of the barrier
+            
+        Returns:
+            List[str]: Descriptions of the differences
+        """
+        calltrace1 = self.barriers[barrier_id]["program1"].calltrace
+        calltrace2 = self.barriers[barrier_id]["program2"].calltrace
+        if not calltrace1 or not calltrace2:
+            return []
+        
+        differences = []
+        threads = []
+        for thread in sorted(set(calltrace1) | set(calltrace2)):
+            digest1, events1 = calltrace1.get(thread, (None, 0))
+            digest2, events2 = calltrace2.get(thread, (None, 0))
+            if events1 == 0 and events2 == 0 or digest1 == digest2:
+                continue
+            differences.append(
+                f"Call sequence of thread {thread} differs: "
+                f"{events1} calls and returns in program1, {events2} in program2"
+            )
+            threads.append(thread)
+        
+        if threads:
+            self.calltrace_request = {"barrier_id": barrier_id, "threads": threads, "rings": {}}
+        return differences
+    
+    def receive_calltrace_ring(self, program_id: str, rings: Dict[str, Dict[str, Any]]) -> None:
+        """Receive the recent calls of a program and, once both sent them, release the barrier.
+        
+        Args:
+            program_id: The ID of the program
+            rings: The recent calls by thread: events in the segment, count and [exit, function]
+        """
+        with self.lock:
+            request = self.calltrace_request
+            if request is None:
+                return
+            request["rings"][program_id] = {int(thread): ring for thread, ring in rings.items()}
+            if len(request["rings"]) < 2:
+                return
+            self.calltrace_request = None
+        
+        print(f"\nCall paths at barrier '{request['barrier_id']}':")
+        for thread in request["threads"]:
+            ring1 = request["rings"]["program1"].get(thread)
+            ring2 = request["rings"]["program2"].get(thread)
+            for line in self.describe_call_split(thread, ring1, ring2):
+                print(f"  {line}")
+        
+        for program_id, program in self.programs.items():
+            if program.connection:
+                try:
+                    program.connection.sendall(encode_message(request["result"]))
+                except Exception as e:
+                    print(f"Error sending result to {program_id}: {e}")
+    
+    @staticmethod
+    def describe_call_split(thread: int, ring1: Optional[Dict[str, Any]],
+                            ring2: Optional[Dict[str, Any]]) -> List[str]:
+        """Describe where the call paths of a thread split.
+        
+        When both rings hold the whole segment, they start at the same point
+        and the split is after their common prefix; the call stack there is
+        rebuilt from the prefix. Otherwise the rings only line up at the
+        barrier, and the events before their common suffix are shown.
+        
+        Args:
+            thread: The index of the thread
+            ring1: The recent calls of the thread in program1
+            ring2: The recent calls of the thread in program2
+            
+        Returns:
+            List[str]: The lines of the description
+        """
+        def describe(events: List[List[Any]]) -> str:
+            return ", ".join(f"{'<-' if exit else '->'} {name}" for exit, name in events) or "(end of segment)"
+        
+        if ring1 is None or ring2 is None:
+            missing = "program1" if ring1 is None else "program2"
+            return [f"Thread {thread}: {missing} made no calls"]
+        
+        events1, events2 = ring1["ring"], ring2["ring"]
+        if ring1["count"] == ring1["events"] and ring2["count"] == ring2["events"]:
+            common = 0
+            while common < min(len(events1), len(events2)) and events1[common] == events2[common]:
+                common += 1
+            stack: List[str] = []
+            for exit, name in events1[:common]:
+                if not exit:
+                    stack.append(name)
+                elif stack:
+                    stack.pop()
+            return [
+                f"Thread {thread} splits after {common} common calls and returns",
+                f"  in: {' > '.join(stack) or '(segment start)'}",
+                f"  program1: {describe(events1[common:common + CALLTRACE_CONTEXT])}",
+                f"  program2: {describe(events2[common:common + CALLTRACE_CONTEXT])}",
+            ]
+        
+        common = 0
+        while common < min(len(events1), len(events2)) and events1[-1 - common] == events2[-1 - common]:
+            common += 1
+        end1, end2 = len(events1) - common, len(events2) - common
+        if end1 == 0 or end2 == 0:
+            return [f"Thread {thread}: the last {common} calls and returns match, the paths split further back "
+                    f"(increase CODETANGO_CALLTRACE_RING)"]
+        return [
+            f"Thread {thread}: the segment exceeds the call ring (CODETANGO_CALLTRACE_RING), "
+            f"the paths differ before the last {common} common calls and returns",
+            f"  program1: {describe(events1[max(end1 - CALLTRACE_CONTEXT, 0):end1])}",
+            f"  program2: {describe(events2[max(end2 - CALLTRACE_CONTEXT, 0):end2])}",
+        ]
+    
+    def compare_streams(self, barrier_id: str) -> List[str]:
+        """Collect the results of the stream comparisons at a specific barrier.
+        
+        Args:
+            barrier_id: The ID of the barrier to compare
+            
+        Returns:
+            List[str]: Descriptions of the differences
+        """
+        registry = self.streams.pop(barrier_id, {})
+        self.stream_declarations.pop(barrier_id, None)
+        differences = []
+        for name in sorted(registry):
+            difference = registry[name].result()
+            if difference:
+                differences.append(difference)
+        return differences
+    
+    def compare_variables(self, barrier_id: str, timer: Optional[StageTimer] = None) -> bool:
         """Compare variables between programs at a specific barrier.
         
         Args:
             barrier_id: The ID of the barrier to compare
+            timer: Times the comparison apart from the report, if given
             
         Returns:
             bool: True if all variables match, False otherwise
         """
-        program1_vars = self.barriers[barrier_id]["program1"]
-        program2_vars = self.barriers[barrier_id]["program2"]
+        program1_vars = self.barriers[barrier_id]["program1"].variables
+        program2_vars = self.barriers[barrier_id]["program2"].variables
         
         # Check for missing or different variables
         all_keys = set(program1_vars.keys()) | set(program2_vars.keys())
@@ -233,8 +1368,21 @@ class CodeTango:
                     f"  program2: {program2_vars[key]}"
                 )
         
+        differences.extend(self.compare_scalars(barrier_id))
+        differences.extend(self.compare_lanes(barrier_id))
+        differences.extend(self.compare_regions(barrier_id))
+        differences.extend(self.compare_watches(barrier_id))
+        differences.extend(self.compare_files(barrier_id))
+        differences.extend(self.compare_streams(barrier_id))
+        differences.extend(self.compare_math(barrier_id))
+        differences.extend(self.compare_calltrace(barrier_id))
+        if timer:
+            timer.lap("compare")
+        
         # Report differences
         if differences:
+            if self.divergence is None:
+                self.divergence = (barrier_id, sorted({difference_subject(diff) for diff in differences}))
             print(f"\nDifferences detected at barrier '{barrier_id}':")
             for diff in differences:
                 print(f"  - {diff}")
@@ -244,26 +1392,664 @@ class CodeTango:
                 print(f"All variables match at barrier '{barrier_id}'")
             return True
     
+    def compare_regions(self, barrier_id: str) -> List[str]:
+        """Compare raw memory regions between programs at a specific barrier.
+        
+        Regions arrive already masked, so equal regions are found by a single
+        memcmp; only a differing region is searched for its first difference.
+        
+        Args:
+            barrier_id: The ID of the barrier to compare
+            
+        Returns:
+            List[str]: Descriptions of the differences
+        """
+        program1_regions = self.barriers[barrier_id]["program1"].regions
+        program2_regions = self.barriers[barrier_id]["program2"].regions
+        differences = []
+        
+        for name in sorted(set(program1_regions) | set(program2_regions)):
+            if name not in program1_regions:
+                differences.append(f"Region '{name}' exists in program2 but not in program1")
+                continue
+            if name not in program2_regions:
+                differences.append(f"Region '{name}' exists in program1 but not in program2")
+                continue
+            
+            region1, data1 = program1_regions[name]
+            region2, data2 = program2_regions[name]
+            mask = region1.get("mask")
+            if len(data1) != len(data2):
+                differences.append(
+                    f"Region '{name}' differs in size:\n"
+                    f"  program1: {len(data1)} bytes\n"
+                    f"  program2: {len(data2)} bytes"
+                )
+            elif mask != region2.get("mask"):
+                differences.append(f"Region '{name}' is masked differently by program1 and program2")
+            elif (region1.get("shape"), region1.get("dtype")) != (region2.get("shape"), region2.get("dtype")):
+                differences.append(
+                    f"Grid '{name}' differs in layout:\n"
+                    f"  program1: {describe_layout(region1)}\n"
+                    f"  program2: {describe_layout(region2)}"
+                )
+            elif data1 != data2 and "shape" in region1:
+                # Grids are located by region rather than by the first differing byte
+                differences.append(describe_grid_difference(name, data1, data2, region1["shape"], region1["dtype"]))
+            elif data1 != data2:
+                offset = find_first_difference(data1, data2)
+                location = f"byte {offset}"
+                if mask:
+                    record_size = len(mask) // 2
+                    location += f" (record {offset // record_size}, byte {offset % record_size})"
+                differences.append(
+                    f"Region '{name}' differs at {location}:\n"
+                    f"  program1: 0x{data1[offset]:02x}\n"
+                    f"  program2: 0x{data2[offset]:02x}"
+                )
+        
+        return differences
+    
+    def compare_lanes(self, barrier_id: str) -> List[str]:
+        """Compare the lane variables of both programs at a barrier, lane by lane.
+        
+        The lanes that differ are reported together, each with the variables
+        it differs in, and recorded for the verdicts at the end of the run.
+        
+        Args:
+            barrier_id: The ID of the barrier
+            
+        Returns:
+            The differences: missing lane variables, lane counts, and the differing lanes
+        """
+        lanes1 = self.barriers[barrier_id]["program1"].lanes
+        lanes2 = self.barriers[barrier_id]["program2"].lanes
+        differences = []
+        # Differing variables of each lane, with both values
+        failures: Dict[int, List[Tuple[str, Any, Any]]] = {}
+        count = 0
+        
+        for name in sorted(set(lanes1) | set(lanes2)):
+            if name not in lanes1:
+                differences.append(f"Lane variable '{name}' exists in program2 but not in program1")
+                continue
+            if name not in lanes2:
+                differences.append(f"Lane variable '{name}' exists in program1 but not in program2")
+                continue
+            values1, values2 = lanes1[name][1], lanes2[name][1]
+            if len(values1) != len(values2):
+                differences.append(
+                    f"Lane variable '{name}' differs in lanes:\n"
+                    f"  program1: {len(values1)}\n"
+                    f"  program2: {len(values2)}"
+                )
+                continue
+            count = max(count, len(values1))
+            for lane in differing_lanes(values1, values2):
+                failures.setdefault(lane, []).append((name, values1[lane], values2[lane]))
+        
+        self.lane_count = max(self.lane_count, count)
+        if failures:
+            lanes = sorted(failures)
+            lines = [f"Lanes differ in {len(lanes)} of {count} lanes: {format_lanes(lanes)}"]
+            for lane in lanes[:SCALAR_REPORT_LIMIT]:
+                details = ", ".join(f"{name} ({value1!r} vs {value2!r})" for name, value1, value2 in failures[lane])
+                lines.append(f"  lane {lane}: {details}")
+            if len(lanes) > SCALAR_REPORT_LIMIT:
+                lines.append(f"  ... and {len(lanes) - SCALAR_REPORT_LIMIT} more lanes")
+            differences.append("\n".join(lines))
+            for lane in lanes:
+                self.lane_failures.setdefault(lane, (barrier_id, [name for name, _, _ in failures[lane]]))
+        return differences
+    
+    def report_lanes(self) -> None:
+        """Print the verdict of each lane over the run."""
+        failed = sorted(self.lane_failures)
+        print(f"\nLanes: {self.lane_count - len(failed)} of {self.lane_count} matched at every barrier")
+        for lane in failed[:SCALAR_REPORT_LIMIT]:
+            barrier_id, names = self.lane_failures[lane]
+            print(f"  lane {lane} first differed at barrier '{barrier_id}' in {', '.join(names)}")
+        if len(failed) > SCALAR_REPORT_LIMIT:
+            print(f"  ... and {len(failed) - SCALAR_REPORT_LIMIT} more lanes: {format_lanes(failed[SCALAR_REPORT_LIMIT:])}")
+    
+    def compare_scalars(self, barrier_id: str) -> List[str]:
+        """Compare the scalars of both programs at a barrier.
+        
+        The values are compared bit for bit as one block when both programs
+        use the same name table, or gathered into the same order first, so
+        only the differences are visited one by one.
+        
+        Args:
+            barrier_id: The ID of the barrier
+            
+        Returns:
+            The differences, at most SCALAR_REPORT_LIMIT of each kind
+        """
+        scalars1 = self.barriers[barrier_id]["program1"].scalars
+        scalars2 = self.barriers[barrier_id]["program2"].scalars
+        if not scalars1 and not scalars2:
+            return []
+        if not scalars1 or not scalars2:
+            return [f"Scalars were registered by {'program1' if scalars1 else 'program2'} only"]
+        
+        (desc1, values1), (desc2, values2) = scalars1, scalars2
+        names1 = self.scalar_tables.get(("program1", desc1["table"]))
+        names2 = self.scalar_tables.get(("program2", desc2["table"]))
+        if names1 is None or names2 is None:
+            return ["Scalars refer to a name table that was not received"]
+        join = self.scalar_joins.get((desc1["table"], desc2["table"]))
+        if join is None:
+            join = ScalarJoin.merge(names1, names2)
+            self.scalar_joins[(desc1["table"], desc2["table"])] = join
+        
+        def limited(items: List[str], what: str) -> List[str]:
+            if len(items) > SCALAR_REPORT_LIMIT:
+                return items[:SCALAR_REPORT_LIMIT] + [f"... and {len(items) - SCALAR_REPORT_LIMIT} more {what}"]
+            return items
+        
+        differences = limited([f"Variable '{name}' exists in program1 but not in program2" for name in join.only1],
+                              "scalars only in program1")
+        differences += limited([f"Variable '{name}' exists in program2 but not in program1" for name in join.only2],
+                               "scalars only in program2")
+        
+        # Same table: one block compare; otherwise gather program2 into the order of program1
+        bits1 = values1.cast('Q')
+        bits2 = values2.cast('Q')
+        if join.index1 is None:
+            start = find_first_difference(values1, values2)
+            if start < 0:
+                return differences
+            positions = [(i, i) for i in range(start // 8, len(bits1)) if bits1[i] != bits2[i]]
+        else:
+            gathered1 = array.array('Q', map(bits1.__getitem__, join.index1))
+            gathered2 = array.array('Q', map(bits2.__getitem__, join.index2))
+            if gathered1 == gathered2:
+                return differences
+            positions = [(join.index1[k], join.index2[k]) for k in range(len(gathered1))
+                         if gathered1[k] != gathered2[k]]
+        
+        doubles1 = values1.cast('d')
+        doubles2 = values2.cast('d')
+        differences += [
+            f"Variable '{names1[i]}' differs:\n"
+            f"  program1: {doubles1[i]!r}\n"
+            f"  program2: {doubles2[j]!r}"
+            for i, j in positions[:SCALAR_REPORT_LIMIT]
+        ]
+        if len(positions) > SCALAR_REPORT_LIMIT:
+            differences.append(f"... and {len(positions) - SCALAR_REPORT_LIMIT} more scalars differ")
+        return differences
+    
+    def compare_watches(self, barrier_id: str) -> List[str]:
+        """Compare the writes to watched variables in the segment ending at a barrier.
+        
+        The values written are compared in order; the writing instructions
+        only locate a difference, as they differ between builds.
+        
+        Args:
+            barrier_id: The ID of the barrier to compare
+            
+        Returns:
+            List[str]: Descriptions of the differences
+        """
+        program1_watches = self.barriers[barrier_id]["program1"].watches
+        program2_watches = self.barriers[barrier_id]["program2"].watches
+        differences = []
+        
+        def describe(watch: Dict[str, Any], record: Tuple[int, int, int]) -> str:
+            occurrence, ip, value = record
+            fmt = "<" + DTYPE_FORMATS[watch["dtype"]]
+            decoded = struct.unpack_from(fmt, value.to_bytes(8, "little"))[0]
+            return f"{decoded!r} (write #{occurrence}, at {watch['sites'].get(str(ip), hex(ip))})"
+        
+        for name in sorted(set(program1_watches) | set(program2_watches)):
+            if name not in program1_watches:
+                differences.append(f"Watch '{name}' exists in program2 but not in program1")
+                continue
+            if name not in program2_watches:
+                differences.append(f"Watch '{name}' exists in program1 but not in program2")
+                continue
+            
+            watch1, data1 = program1_watches[name]
+            watch2, data2 = program2_watches[name]
+            for program_id, watch in (("program1", watch1), ("program2", watch2)):
+                if watch["dropped"]:
+                    differences.append(
+                        f"Watch '{name}' dropped {watch['dropped']} writes in {program_id} "
+                        f"(raise CODETANGO_WATCH_LIMIT)"
+                    )
+            
+            # Values are every third field of the records
+            values1 = data1.cast('Q')[2::3]
+            values2 = data2.cast('Q')[2::3]
+            index = next((i for i, (v1, v2) in enumerate(zip(values1, values2)) if v1 != v2), None)
+            if index is not None:
+                differences.append(
+                    f"Watch '{name}' differs at write {index} of this segment:\n"
+                    f"  program1: {describe(watch1, struct.unpack_from(WATCH_RECORD_FORMAT, data1, index * WATCH_RECORD_SIZE))}\n"
+                    f"  program2: {describe(watch2, struct.unpack_from(WATCH_RECORD_FORMAT, data2, index * WATCH_RECORD_SIZE))}"
+                )
+            elif len(values1) != len(values2):
+                more, watch, data = (("program1", watch1, data1) if len(values1) > len(values2)
+                                     else ("program2", watch2, data2))
+                index = min(len(values1), len(values2))
+                differences.append(
+                    f"Watch '{name}' was written {len(values1)} times by program1 and "
+                    f"{len(values2)} times by program2 in this segment; the first extra write:\n"
+                    f"  {more}: {describe(watch, struct.unpack_from(WATCH_RECORD_FORMAT, data, index * WATCH_RECORD_SIZE))}"
+                )
+        
+        return differences
+    
+    def compare_files(self, barrier_id: str) -> List[str]:
+        """Compare file regions between programs at a specific barrier.
+        
+        Both files are mapped into the utility and compared in place, so the
+        programs never load or send the data.
+        
+        Args:
+            barrier_id: The ID of the barrier to compare
+            
+        Returns:
+            List[str]: Descriptions of the differences
+        """
+        program1_files = self.barriers[barrier_id]["program1"].files
+        program2_files = self.barriers[barrier_id]["program2"].files
+        differences = []
+        
+        for name in sorted(set(program1_files) | set(program2_files)):
+            if name not in program1_files:
+                differences.append(f"File region '{name}' exists in program2 but not in program1")
+                continue
+            if name not in program2_files:
+                differences.append(f"File region '{name}' exists in program1 but not in program2")
+                continue
+            
+            file1 = program1_files[name]
+            file2 = program2_files[name]
+            if file1["length"] != file2["length"] or file1["dtype"] != file2["dtype"]:
+                differences.append(
+                    f"File region '{name}' differs in layout:\n"
+                    f"  program1: {file1['length']} bytes of {file1['dtype']}\n"
+                    f"  program2: {file2['length']} bytes of {file2['dtype']}"
+                )
+                continue
+            
+            try:
+                difference = self.compare_file_regions(name, file1, file2)
+            except (OSError, ValueError) as e:
+                difference = f"File region '{name}' could not be compared: {e}"
+            if difference:
+                differences.append(difference)
+        
+        return differences
+    
+    def compare_file_regions(self, name: str, file1: Dict[str, Any], file2: Dict[str, Any]) -> Optional[str]:
+        """Map two file regions and compare them.
+        
+        Args:
+            name: The name of the file region
+            file1: The region registered by program1
+            file2: The region registered by program2
+            
+        Returns:
+            A description of the first difference, or None if the regions match
+        """
+        length = file1["length"]
+        if length == 0:
+            return None
+        fmt = DTYPE_FORMATS.get(file1["dtype"], "B")
+        itemsize = struct.calcsize(fmt)
+        
+        maps = []
+        views = []
+        try:
+            for region in (file1, file2):
+                # Mappings must start at a multiple of the allocation granularity
+                start = region["offset"] - region["offset"] % mmap.ALLOCATIONGRANULARITY
+                with open(region["path"], "rb") as f:
+                    mapping = mmap.mmap(f.fileno(), region["offset"] - start + length,
+                                        access=mmap.ACCESS_READ, offset=start)
+                maps.append(mapping)
+                views.append(memoryview(mapping)[region["offset"] - start:])
+            
+            if views[0] == views[1]:
+                return None
+            
+            offset = find_first_difference(views[0], views[1])
+            index = offset // itemsize
+            value1, value2 = (struct.unpack_from(fmt, view, index * itemsize)[0] for view in views)
+            return (
+                f"File region '{name}' differs at element {index} (byte {offset}):\n"
+                f"  program1: {value1}\n"
+                f"  program2: {value2}"
+            )
+        finally:
+            for view in views:
+                view.release()
+            for mapping in maps:
+                mapping.close()
+    
+    def compare_accounting(self, barrier_id: str) -> List[str]:
+        """Compare the I/O and syscall counters of the segment ending at a barrier.
+        
+        These do not fail the barrier, they point at segments where one
+        program does much more I/O or many more syscalls than the other.
+        
+        Args:
+            barrier_id: The ID of the barrier
+            
+        Returns:
+            List[str]: Descriptions of the counters differing by more than the ratio
+        """
+        accounting1 = self.barriers[barrier_id]["program1"].accounting
+        accounting2 = self.barriers[barrier_id]["program2"].accounting
+        notes = []
+        
+        for program_id, accounting in (("program1", accounting1), ("program2", accounting2)):
+            for key, value in accounting.items():
+                totals = self.accounting_totals.setdefault(program_id, {})
+                totals[key] = totals.get(key, 0) + value
+        
+        for key in sorted(set(accounting1) & set(accounting2)):
+            value1, value2 = accounting1[key], accounting2[key]
+            if max(value1, value2) < ACCOUNTING_FLOORS.get(key, ACCOUNTING_FLOOR):
+                continue
+            ratio = max(value1, value2) / max(min(value1, value2), 1)
+            if ratio > self.accounting_ratio:
+                notes.append(f"{key}: program1 {value1}, program2 {value2} ({ratio:.1f}x)")
+        return notes
+    
     def release_programs(self, barrier_id: str) -> None:
         """Release programs waiting at a barrier.
         
         Args:
             barrier_id: The ID of the barrier
         """
-        matched = self.compare_variables(barrier_id)
+        timer = self.profiler.release(self.barriers[barrier_id])
+        matched = self.compare_variables(barrier_id, timer)
+        timer.lap("report")
+        
+        if self.checkpoint_sinks:
+            values = {program_id: self.checkpoint_values(program_id, checkpoint)
+                      for program_id, checkpoint in self.barriers[barrier_id].items()}
+            for sink in self.checkpoint_sinks:
+                sink.add(barrier_id, matched, values)
+            timer.lap("sinks")
+        
+        if self.cgroup_session:
+            self.sample_usage(barrier_id)
+        
+        notes = self.compare_accounting(barrier_id)
+        if notes:
+            print(f"\nResource usage differs in the segment ending at barrier '{barrier_id}':")
+            for note in notes:
+                print(f"  - {note}")
+        timer.lap("usage" if self.cgroup_session or self.accounting else None)
+        
+        # The next occurrence of this barrier is a new checkpoint
+        del self.barriers[barrier_id]
         
         # Send result to both programs
         if matched:
             result_msg = {"status": "success", "message": "Variables match"}
+            if self.snapshot_interval and not self.rewound:
+                self.matched_barriers += 1
+                if self.matched_barriers % self.snapshot_interval == 0:
+                    result_msg["snapshot"] = self.matched_barriers // self.snapshot_interval
+                    self.snapshot_streams[result_msg["snapshot"]] = {
+                        program_id: len(stream) for program_id, stream in self.barrier_streams.items()}
         else:
             result_msg = {"status": "failure", "message": "Variables differ"}
+        
+        # Both programs apply changed filters from the next barrier on
+        if self.push_filters:
+            result_msg["filters"] = self.encode_filters()
+            self.push_filters = False
+        
+        # On a call sequence mismatch, the result waits for the recent calls
+        if self.calltrace_request is not None:
+            self.calltrace_request["result"] = result_msg
+            result_msg = {"send_calltrace": True}
             
+        # A program is blocked until its own result is sent, after those sent before
+        now = time.monotonic()
+        blocked = set(timer.programs)
         for program_id, program in self.programs.items():
             if program.connection:
                 try:
-                    program.connection.sendall(json.dumps(result_msg).encode('utf-8'))
+                    program.connection.sendall(encode_message(result_msg))
                 except Exception as e:
                     print(f"Error sending result to {program_id}: {e}")
+                timer.lap("send", list(blocked))
+                blocked.discard(program_id)
+            if program_id in timer.stages:
+                timer.finish(barrier_id, program_id)
+            program.last_barrier = barrier_id
+            program.segment_start = now
+            program.waiting_since = None
+            program.stalled = False
+        
+        if not matched and self.snapshots and not self.rewound and self.rewind():
+            return
+        if not matched and self.fail_fast:
+            print(f"\nStopping the programs at barrier '{barrier_id}' (fail-fast)")
+            self.stop_programs()
+    
+    def encode_filters(self) -> Dict[str, str]:
+        """Encode the filters for the programs, as patterns separated by newlines."""
+        return {key: "\n".join(patterns) for key, patterns in self.filters.items()}
+    
+    def update_filters(self, request: Dict[str, Any]) -> Dict[str, Any]:
+        """Serve the "filters" control request: replace the kinds of filters given.
+        
+        Args:
+            request: Lists of patterns by kind, see FILTER_KEYS; kinds not given are kept
+            
+        Returns:
+            All the filters after the update
+            
+        Raises:
+            ValueError: If a list of patterns is malformed
+        """
+        for key in FILTER_KEYS:
+            patterns = request.get(key, [])
+            if not isinstance(patterns, list) or not all(
+                    isinstance(pattern, str) and pattern and "\n" not in pattern for pattern in patterns):
+                raise ValueError(f"{key} must be a list of non-empty patterns")
+        with self.lock:
+            changed = {key: request[key] for key in FILTER_KEYS if key in request}
+            if changed:
+                self.filters.update(changed)
+                self.push_filters = True
+                print(f"\nFilters changed, applied from the next barrier on: {format_filters(self.filters)}")
+            return {"filters": self.filters}
+    
+    def checkpoint_values(self, program_id: str, checkpoint: Checkpoint) -> Dict[str, Any]:
+        """Get the values of a checkpoint by name: variables, scalars, lanes as lists and regions as bytes."""
+        values = dict(checkpoint.variables)
+        if checkpoint.scalars:
+            desc, data = checkpoint.scalars
+            names = self.scalar_tables.get((program_id, desc["table"]), [])
+            values.update(zip(names, data.cast('d')))
+        for name, (_, data) in checkpoint.regions.items():
+            values[name] = bytes(data)
+        for name, (_, data) in checkpoint.lanes.items():
+            values[name] = data.tolist()
+        return values
+    
+    def accept_snapshots(self) -> None:
+        """Accept the connections of snapshots forked by the programs at matching barriers."""
+        while True:
+            try:
+                conn, _ = self.server.accept()
+            except socket.timeout:
+                continue
+            except OSError:
+                # The server was closed
+                break
+            
+            reader = MessageReader(conn)
+            received = reader.read_message()
+            if not received or "snapshot" not in received[0]:
+                print("Warning: Unexpected connection after the programs connected")
+                conn.close()
+                continue
+            message, _ = received
+            snapshot = Snapshot(program_id=message["program_id"], barrier_id=message["barrier_id"],
+                                pid=message["pid"], connection=conn, reader=reader)
+            with self.lock:
+                if self.rewound:
+                    conn.close()
+                    continue
+                self.snapshots.setdefault(message["snapshot"], {})[snapshot.program_id] = snapshot
+                if self.verbose:
+                    print(f"Snapshot {message['snapshot']} of {snapshot.program_id} taken at barrier "
+                          f"'{snapshot.barrier_id}' (pid {snapshot.pid})")
+                self.prune_snapshots()
+    
+    def prune_snapshots(self) -> None:
+        """Drop the oldest snapshots beyond the count and memory limits; the newest is always kept."""
+        while len(self.snapshots) > self.snapshot_limit:
+            self.discard_snapshots(min(self.snapshots))
+        if self.snapshot_memory_limit:
+            while len(self.snapshots) > 1 and sum(
+                    snapshot_memory(snapshot.pid)
+                    for snapshots in self.snapshots.values()
+                    for snapshot in snapshots.values()) > self.snapshot_memory_limit:
+                self.discard_snapshots(min(self.snapshots))
+    
+    def discard_snapshots(self, number: int) -> None:
+        """Let the snapshots of both programs with this number exit, by closing their connections."""
+        for snapshot in self.snapshots.pop(number).values():
+            self.snapshot_pids.append(snapshot.pid)
+            try:
+                snapshot.connection.close()
+            except OSError:
+                pass
+    
+    def rewind(self) -> bool:
+        """Replace both programs with their last snapshots taken at the same barrier.
+        
+        The snapshots run again from there with rewind_env set, and report
+        their barriers as the programs did.
+        
+        Returns:
+            bool: True if the programs were rewound
+        """
+        complete = [number for number, snapshots in self.snapshots.items() if len(snapshots) == 2]
+        if not complete:
+            return False
+        snapshots = self.snapshots.pop(max(complete))
+        for number in list(self.snapshots):
+            self.discard_snapshots(number)
+        self.rewound = True
+        
+        barrier_id = snapshots["program1"].barrier_id
+        print(f"\nRewinding both programs to barrier '{barrier_id}' "
+              f"(snapshot {max(complete)}, after {max(complete) * self.snapshot_interval} matching barriers)")
+        
+        # The programs go first, so that the utility adopts their snapshots
+        self.stop_programs()
+        for program in self.programs.values():
+            program.process.wait()
+        self.barriers.clear()
+        self.streams.clear()
+        self.stream_declarations.clear()
+        for program_id, length in self.snapshot_streams.get(max(complete), {}).items():
+            del self.barrier_streams[program_id][length:]
+        self.math_traces.clear()
+        self.calltrace_request = None
+        
+        # The snapshots have the filters of the time they were taken at
+        self.push_filters = True
+        env = dict(self.rewind_env, CODETANGO_REWOUND="1")
+        for program_id, snapshot in snapshots.items():
+            program = replace(self.programs[program_id], process=SnapshotProcess(snapshot.pid),
+                              connection=snapshot.connection, reader=snapshot.reader, last_site=None,
+                              last_barrier=barrier_id, segment_start=time.monotonic(),
+                              waiting_since=None, stalled=False, sample=None, disconnected=False)
+            self.programs[program_id] = program
+            try:
+                snapshot.connection.sendall(encode_message({"resume": True, "env": env}))
+            except OSError as e:
+                print(f"Error resuming the snapshot of {program_id}: {e}")
+            thread = threading.Thread(target=self.handle_barrier, args=(program_id, snapshot.connection))
+            thread.daemon = True
+            thread.start()
+        return True
+    
+    def end_segment(self, program: ProgramInfo, barrier_id: str) -> None:
+        """Learn the duration of the segment a program completed by reaching a barrier."""
+        now = time.monotonic()
+        seconds = now - program.segment_start
+        self.segment_times.add((program.program_id, program.last_barrier), seconds)
+        program.waiting_since = now
+        if program.stalled:
+            print(f"{program.program_id} reached barrier '{barrier_id}' after {seconds:.1f} s")
+    
+    def watch_stalls(self) -> None:
+        """Check the programs for stalls until they finish.
+        
+        Each check samples the programs that run a segment, so a stalled
+        program is described by its activity since the previous check.
+        """
+        while not self.finished.wait(STALL_POLL_SECONDS):
+            with self.lock:
+                programs = [program for program in self.programs.values()
+                            if program.waiting_since is None and program.process.poll() is None]
+            for program in programs:
+                previous, program.sample = program.sample, sample_process(program.process.pid)
+                key = (program.program_id, program.last_barrier)
+                elapsed = time.monotonic() - program.segment_start
+                if program.stalled or previous is None or elapsed <= self.segment_times.limit(key):
+                    continue
+                with self.lock:
+                    # Released meanwhile
+                    if program.waiting_since is not None or program.stalled:
+                        continue
+                    program.stalled = True
+                    self.stalls += 1
+                    self.report_stall(program, previous, elapsed)
+                if self.fail_fast:
+                    print("\nStopping the programs at the stall (fail-fast)")
+                    self.stop_programs()
+    
+    def report_stall(self, program: ProgramInfo, previous: ProcessSample, elapsed: float) -> None:
+        """Print where a stalled program is, what it does and what the other program does.
+        
+        Args:
+            program: The stalled program
+            previous: The sample of the program taken one check before
+            elapsed: Seconds since the program was released from its last barrier
+        """
+        since = f"barrier '{program.last_barrier}'" if program.last_barrier else "its start"
+        typical = self.segment_times.typical((program.program_id, program.last_barrier))
+        usual = f"usually {typical:.2f} s" if typical is not None else f"timeout {self.timeout} s"
+        print(f"\nStall: {program.program_id} has not reached a barrier {elapsed:.1f} s after {since} ({usual})")
+        print(f"  {program.program_id}: {describe_activity(program.process.pid, previous, program.sample)}")
+        for other in self.programs.values():
+            if other is program:
+                continue
+            if other.process.poll() is not None:
+                print(f"  {other.program_id}: exited")
+            elif other.waiting_since is not None:
+                barrier_id = next((b for b, checkpoints in self.barriers.items() if other.program_id in checkpoints), "?")
+                print(f"  {other.program_id}: waiting at barrier '{barrier_id}' for "
+                      f"{time.monotonic() - other.waiting_since:.1f} s")
+            else:
+                other_since = f"barrier '{other.last_barrier}'" if other.last_barrier else "its start"
+                print(f"  {other.program_id}: running since {other_since}, "
+                      f"{describe_activity(other.process.pid, other.sample, sample_process(other.process.pid))}")
+    
+    def stop_programs(self) -> None:
+        """Kill both programs, e.g. at the first difference or when they hang."""
+        for program in self.programs.values():
+            if program.process.poll() is None:
+                try:
+                    program.process.kill()
+                except OSError:
+                    pass
     
     def send_result(self, program_id: str, success: bool, message: str) -> None:
         """Send a result message to a specific program.
@@ -276,7 +2062,7 @@ class CodeTango:
         result_msg = {"status": "success" if success else "failure", "message": message}
         try:
             if self.programs[program_id].connection:
-                self.programs[program_id].connection.sendall(json.dumps(result_msg).encode('utf-8'))
+                self.programs[program_id].connection.sendall(encode_message(result_msg))
         except Exception as e:
             print(f"Error sending result to {program_id}: {e}")
     
@@ -292,6 +2078,10 @@ class CodeTango:
             
             # Accept connections
             self.accept_connections()
+            if self.snapshot_interval:
+                threading.Thread(target=self.accept_snapshots, daemon=True).start()
+            if self.stall_factor > 0:
+                threading.Thread(target=self.watch_stalls, daemon=True).start()
             
             # Create threads for each program
             threads = []
@@ -305,10 +2095,15 @@ class CodeTango:
                     thread.start()
                     threads.append(thread)
             
-            # Wait for both programs to complete
+            # Wait for both programs to complete; a rewind replaces them with their snapshots
             exit_codes = []
-            for program_id, program in self.programs.items():
-                exit_code = program.process.wait()
+            for program_id in self.programs:
+                while True:
+                    process = self.programs[program_id].process
+                    exit_code = process.wait()
+                    with self.lock:
+                        if self.programs[program_id].process is process:
+                            break
                 exit_codes.append(exit_code)
                 if self.verbose:
                     print(f"{program_id} exited with code {exit_code}")
@@ -317,15 +2112,34 @@ class CodeTango:
             if any(code != 0 for code in exit_codes):
                 print("Warning: One or more programs exited with non-zero status")
             
+            # Resource usage at exit
+            self.report_usage()
+            
+            # Where the utility spent its time
+            if self.profile:
+                print()
+                for line in format_metrics(self.profiler.metrics()):
+                    print(line)
+            
             # Print final barrier sequence
             print(f"\nBarrier sequence: {' -> '.join(self.barrier_sequence)}")
             
+            if self.lane_count:
+                self.report_lanes()
+            
+            # Where the control flow of the programs diverged
+            stream1, stream2 = self.barrier_streams["program1"], self.barrier_streams["program2"]
+            if stream1 != stream2:
+                print(f"\nThe barrier streams differ: program1 reached {len(stream1)} barriers, "
+                      f"program2 {len(stream2)}")
+                for line in report_alignment(stream1, stream2, self.barrier_names):
+                    print(f"  {line}")
+            
             # Check if all barriers were passed
-            all_passed = True
-            for barrier_id in self.barrier_sequence:
-                if len(self.barriers[barrier_id]) != 2:
-                    print(f"Warning: Barrier '{barrier_id}' was not reached by both programs")
-                    all_passed = False
+            all_passed = not self.desynchronized
+            for barrier_id in self.barriers:
+                print(f"Warning: Barrier '{barrier_id}' was not reached by both programs")
+                all_passed = False
             
             if all_passed:
                 print("\nAll barriers passed successfully!")
@@ -343,6 +2157,20 @@ class CodeTango:
     
     def cleanup(self) -> None:
         """Cleanup resources."""
+        self.finished.set()
+        
+        # Exported files are completed even if the run was interrupted
+        for sink in self.checkpoint_sinks:
+            try:
+                sink.close()
+            except OSError as e:
+                print(f"Error closing {type(sink).__name__}: {e}")
+        self.checkpoint_sinks = []
+        
+        if self.control:
+            self.control.close()
+            self.control = None
+        
         # Close socket connections
         for program_id, program in self.programs.items():
             if program.connection:
@@ -351,6 +2179,10 @@ class CodeTango:
                 except:
                     pass
         
+        # Snapshots not resumed exit once their connections are closed
+        for number in list(self.snapshots):
+            self.discard_snapshots(number)
+        
         # Close socket server
         if self.server:
             try:
@@ -359,9 +2191,9 @@ class CodeTango:
                 pass
         
         # Remove socket file
-        if os.path.exists(SOCKET_PATH):
+        if os.path.exists(self.socket_path):
             try:
-                os.unlink(SOCKET_PATH)
+                os.unlink(self.socket_path)
             except:
                 pass
         
@@ -376,9 +2208,54 @@ class CodeTango:
                         program.process.kill()
                 except:
                     pass
+        
+        # Snapshots outliving their programs were adopted by the utility
+        for pid in self.snapshot_pids:
+            try:
+                os.waitpid(pid, 0)
+            except ChildProcessError:
+                pass
+        
+        # Remove the cgroups once the processes are gone
+        if self.cgroup_session:
+            self.cgroup_session.cleanup()
 
 def main():
     """Main entry point."""
+    # Subcommands have their own options
+    if len(sys.argv) > 1 and sys.argv[1] == "shadow":
+        from .shadow import main as shadow_main
+        shadow_main(sys.argv[2:])
+        return
+    if len(sys.argv) > 1 and sys.argv[1] == "schema":
+        from .schema import main as schema_main
+        schema_main(sys.argv[2:])
+        return
+    if len(sys.argv) > 1 and sys.argv[1] == "reduce":
+        from .reduce import main as reduce_main
+        reduce_main(sys.argv[2:])
+        return
+    if len(sys.argv) > 1 and sys.argv[1] in ("batch", "select"):
+        from .coverage import main_batch, main_select
+        (main_batch if sys.argv[1] == "batch" else main_select)(sys.argv[2:])
+        return
+    if len(sys.argv) > 1 and sys.argv[1] == "query":
+        from .store import main as query_main
+        query_main(sys.argv[2:])
+        return
+    if len(sys.argv) > 1 and sys.argv[1] == "subscribe":
+        from .shm import main as subscribe_main
+        subscribe_main(sys.argv[2:])
+        return
+    if len(sys.argv) > 1 and sys.argv[1] == "metrics":
+        from .profile import main as metrics_main
+        metrics_main(sys.argv[2:])
+        return
+    if len(sys.argv) > 1 and sys.argv[1] == "filter":
+        from .control import main as filter_main
+        filter_main(sys.argv[2:])
+        return
+    
     parser = argparse.ArgumentParser(
         description="CodeTango - Run two programs in sync and check state equality at barriers"
     )
@@ -396,7 +2273,8 @@ def main():
         "--timeout", 
         type=int, 
         default=60,
-        help="Timeout in seconds for waiting at barriers (default: 60)"
+        help="Timeout in seconds for connections, and for segments between barriers until "
+             "their usual duration is learned (default: 60)"
     )
     parser.add_argument(
         "--verbose", 
@@ -404,6 +2282,131 @@ def main():
         action="store_true",
         help="Print verbose output"
     )
+    parser.add_argument(
+        "--cgroups",
+        action="store_true",
+        help="Run each program in its own transient cgroup and report its resource usage"
+    )
+    parser.add_argument(
+        "--cpu-limit",
+        type=float,
+        help="Limit each program to this many CPU cores (implies --cgroups)"
+    )
+    parser.add_argument(
+        "--memory-limit",
+        type=parse_size,
+        help="Limit the memory of each program, e.g. 512M or 2G (implies --cgroups)"
+    )
+    parser.add_argument(
+        "--accounting",
+        action="store_true",
+        help="Compare I/O and syscall counters of the programs for each barrier segment"
+    )
+    parser.add_argument(
+        "--accounting-ratio",
+        type=float,
+        default=2.0,
+        help="Report segments where a counter differs by more than this factor (default: 2.0)"
+    )
+    parser.add_argument(
+        "--mathtrace",
+        metavar="LIB",
+        help="Preload this libcodetango_mathtrace.so into the programs to compare their libm calls"
+    )
+    parser.add_argument(
+        "--stdin",
+        metavar="FILE",
+        help="Feed this file to the standard input of both programs"
+    )
+    parser.add_argument(
+        "--fail-fast",
+        action="store_true",
+        help="Stop both programs at the first barrier where they differ"
+    )
+    parser.add_argument(
+        "--snapshots",
+        type=int,
+        default=0,
+        metavar="N",
+        help="Fork a snapshot of both programs at every N-th matching barrier, and rewind "
+             "them to the last one at the first difference"
+    )
+    parser.add_argument(
+        "--snapshot-limit",
+        type=int,
+        default=2,
+        help="Number of snapshots of each program kept at a time (default: 2)"
+    )
+    parser.add_argument(
+        "--snapshot-memory",
+        type=parse_size,
+        help="Drop older snapshots when the kept ones hold more than this memory, e.g. 4G"
+    )
+    parser.add_argument(
+        "--rewind-env",
+        action="append",
+        default=[],
+        metavar="NAME=VALUE",
+        help="Set an environment variable in the rewound programs, e.g. to check more often"
+    )
+    parser.add_argument(
+        "--schema",
+        metavar="FILE",
+        help="Schema of the checkpoint records sent by programs using generated serializers"
+    )
+    parser.add_argument(
+        "--stall-factor",
+        type=float,
+        default=10.0,
+        help="Report a program as stalled when a segment takes this many times its usual "
+             "duration (default: 10, 0 disables)"
+    )
+    parser.add_argument(
+        "--arrow",
+        metavar="DIR",
+        help="Export the checkpoints to Arrow IPC files in this directory, one per barrier"
+    )
+    parser.add_argument(
+        "--store",
+        metavar="FILE",
+        help="Record the numeric values column by column to a trace store for codetango query"
+    )
+    parser.add_argument(
+        "--shm",
+        metavar="NAME",
+        help="Publish the checkpoints to a shared-memory ring /dev/shm/NAME for live readers"
+    )
+    parser.add_argument(
+        "--shm-size",
+        type=parse_size,
+        default=64 << 20,
+        help="Size of the shared-memory ring; readers falling further behind drop records (default: 64M)"
+    )
+    for key in FILTER_KEYS:
+        action, kind = key.split("_")
+        parser.add_argument(
+            f"--{action}-{kind[:-1]}",
+            dest=key,
+            action="append",
+            default=[],
+            metavar="PATTERN",
+            help=f"{action.capitalize()} the {kind} matching this shell-style pattern; may be given several times"
+        )
+    parser.add_argument(
+        "--profile",
+        action="store_true",
+        help="Print where the utility spent its time, per stage and per barrier, at the end"
+    )
+    parser.add_argument(
+        "--control",
+        metavar="PATH",
+        help="Serve control requests on this socket while running, e.g. codetango metrics PATH"
+    )
+    parser.add_argument(
+        "--socket",
+        default=SOCKET_PATH,
+        help=f"Path of the socket the programs connect to (default: {SOCKET_PATH})"
+    )
     
     args = parser.parse_args()
     
@@ -412,7 +2415,29 @@ def main():
         program1_cmd=args.program1,
         program2_cmd=args.program2,
         timeout=args.timeout,
-        verbose=args.verbose
+        verbose=args.verbose,
+        cgroups=args.cgroups,
+        cpu_limit=args.cpu_limit,
+        memory_limit=args.memory_limit,
+        accounting=args.accounting,
+        accounting_ratio=args.accounting_ratio,
+        mathtrace=args.mathtrace,
+        socket_path=args.socket,
+        stdin=args.stdin,
+        fail_fast=args.fail_fast,
+        snapshot_interval=args.snapshots,
+        snapshot_limit=args.snapshot_limit,
+        snapshot_memory_limit=args.snapshot_memory,
+        rewind_env=dict(item.split("=", 1) for item in args.rewind_env),
+        schema=args.schema,
+        stall_factor=args.stall_factor,
+        arrow=args.arrow,
+        shm=args.shm,
+        shm_size=args.shm_size,
+        store=args.store,
+        profile=args.profile,
+        control=args.control,
+        filters={key: getattr(args, key) for key in FILTER_KEYS}
     )
     
     success = codetango.run()
@@ -0,0 +1,279 @@
+"""
+CodeTango alignment of barrier streams
+
+When the control flow of the programs diverges, the utility lets them run
+on and records the barriers each one reaches. This module aligns both
+streams with the O((N+M)D) difference algorithm of Myers, in its linear
+space form that splits the problem at the middle snake, and describes the
+runs of checkpoints only one program reached, compressing loops into
+repetition counts.
+"""
+
+from typing import List, Optional, Sequence, Tuple
+
+# Differences searched for in one part of the streams before it is split
+# where the search got furthest; bounds the time per split, so the total
+# grows with the number of differences instead of its square
+ALIGN_MAX_COST = 64
+
+# Longest loop body recognized by the run-length compression
+ALIGN_MAX_PERIOD = 8
+
+# Loop bodies shown per run, and runs shown per report
+ALIGN_DESCRIBE_UNITS = 6
+ALIGN_REPORT_LIMIT = 20
+
+# (tag, i1, i2, j1, j2) as in difflib: "equal", "delete", "insert" or "replace"
+# of a[i1:i2] by b[j1:j2]
+Opcode = Tuple[str, int, int, int, int]
+
+def common_prefix(a: Sequence, i: int, i2: int, b: Sequence, j: int, j2: int) -> int:
+    """Get the length of the common prefix of a[i:i2] and b[j:j2].
+
+    Long runs are compared in slices of doubling length, so that the loops
+    of the programs cost little more than a memcmp.
+    """
+    limit = min(i2 - i, j2 - j)
+    n = 0
+    while n < limit and n < 8 and a[i + n] == b[j + n]:
+        n += 1
+    if n < 8:
+        return n
+    step = 8
+    while n < limit:
+        size = min(step, limit - n)
+        if a[i + n:i + n + size] != b[j + n:j + n + size]:
+            low, high = 0, size
+            while high - low > 1:
+                middle = (low + high) // 2
+                if a[i + n:i + n + middle] == b[j + n:j + n + middle]:
+                    low = middle
+                else:
+                    high = middle
+            return n + low
+        n += size
+        step *= 2
+    return n
+
+def common_suffix(a: Sequence, i1: int, i: int, b: Sequence, j1: int, j: int) -> int:
+    """Get the length of the common suffix of a[i1:i] and b[j1:j]."""
+    limit = min(i - i1, j - j1)
+    n = 0
+    while n < limit and n < 8 and a[i - n - 1] == b[j - n - 1]:
+        n += 1
+    if n < 8:
+        return n
+    step = 8
+    while n < limit:
+        size = min(step, limit - n)
+        if a[i - n - size:i - n] != b[j - n - size:j - n]:
+            low, high = 0, size
+            while high - low > 1:
+                middle = (low + high) // 2
+                if a[i - n - middle:i - n] == b[j - n - middle:j - n]:
+                    low = middle
+                else:
+                    high = middle
+            return n + low
+        n += size
+        step *= 2
+    return n
+
+def middle_snake(a: Sequence, left: int, right: int, b: Sequence, top: int, bottom: int,
+                 max_cost: int) -> Optional[Tuple[int, int, int, int]]:
+    """Find the middle snake of a shortest edit script of a[left:right] into b[top:bottom].
+
+    The forward search from the top left and the backward search from the
+    bottom right run in turn, one difference further each time, until their
+    paths overlap. Both keep the furthest point of each diagonal only, so
+    the search takes linear space.
+
+    If the parts differ in more than max_cost elements, the search stops
+    there and the point of the box either search got furthest to is taken
+    instead, as an empty snake: the part is split in two that are each
+    searched again, so that long streams differing in many places still
+    align run by run, at a cost bounded by max_cost per split.
+
+    Returns:
+        The diagonal (x, y) to (u, v) of matching elements the shortest path
+        crosses halfway, or None if the parts differ in more than max_cost
+        elements and mostly differ where the searches got to
+    """
+    delta = (right - left) - (bottom - top)
+    limit = min((right - left + bottom - top + 1) // 2, max_cost)
+    # Furthest x of each diagonal k = (x - left) - (y - top) forward, and
+    # furthest y of each diagonal c = k - delta backward
+    size = 2 * limit + 3
+    forward = [0] * size
+    backward = [0] * size
+    forward[1] = left
+    backward[1] = bottom
+    for d in range(limit + 1):
+        for k in range(-d, d + 1, 2):
+            if k == -d or (k != d and forward[k - 1] < forward[k + 1]):
+                x = forward[k + 1]
+            else:
+                x = forward[k - 1] + 1
+            y = top + (x - left) - k
+            # Most diagonals end at once; calls only follow actual snakes
+            run = common_prefix(a, x, right, b, y, bottom) if x < right and y < bottom and a[x] == b[y] else 0
+            forward[k] = x + run
+            c = k - delta
+            if delta & 1 and -(d - 1) <= c <= d - 1 and y + run >= backward[c]:
+                return x, y, x + run, y + run
+
+        for c in range(-d, d + 1, 2):
+            if c == -d or (c != d and backward[c - 1] > backward[c + 1]):
+                y = backward[c + 1]
+            else:
+                y = backward[c - 1] - 1
+            k = c + delta
+            x = left + (y - top) + k
+            run = common_suffix(a, left, x, b, top, y) if x > left and y > top and a[x - 1] == b[y - 1] else 0
+            backward[c] = y - run
+            if not delta & 1 and -d <= k <= d and x - run <= forward[k]:
+                return x - run, y - run, x, y
+
+    # Too expensive: split at the furthest point either search reached
+    # inside the box, measured by the elements it consumed
+    best, split = 0, None
+    for k in range(-limit, limit + 1, 2):
+        x = forward[k]
+        y = top + (x - left) - k
+        if left <= x <= right and top <= y <= bottom and (x - left) + (y - top) > best:
+            best, split = (x - left) + (y - top), (x, y)
+        y = backward[k]
+        x = left + (y - top) + k + delta
+        if left <= x <= right and top <= y <= bottom and (right - x) + (bottom - y) > best:
+            best, split = (right - x) + (bottom - y), (x, y)
+    # A path of limit differences that matched fewer elements than that
+    # means unrelated parts, which stay unaligned
+    if split is None or best < 2 * limit or split in ((left, top), (right, bottom)):
+        return None
+    return split + split
+
+def align(a: Sequence, b: Sequence, max_cost: int = ALIGN_MAX_COST) -> List[Opcode]:
+    """Align two sequences along a shortest edit script.
+
+    Common prefixes and suffixes are matched first, which leaves little to
+    search when the streams only differ in places. Parts that differ in
+    more than max_cost elements are split where the search got furthest,
+    so the script may then be longer than the shortest one, unless they
+    look unrelated there; those come out as replaced.
+
+    Returns:
+        The opcodes turning a into b, in order
+    """
+    matches: List[Tuple[int, int, int]] = []
+    parts = [(0, len(a), 0, len(b))]
+    while parts:
+        i1, i2, j1, j2 = parts.pop()
+        n = common_prefix(a, i1, i2, b, j1, j2)
+        if n:
+            matches.append((i1, j1, n))
+            i1 += n
+            j1 += n
+        n = common_suffix(a, i1, i2, b, j1, j2)
+        if n:
+            matches.append((i2 - n, j2 - n, n))
+            i2 -= n
+            j2 -= n
+        if i1 == i2 or j1 == j2:
+            continue
+        snake = middle_snake(a, i1, i2, b, j1, j2, max_cost)
+        if snake is None:
+            continue
+        x, y, u, v = snake
+        if u > x:
+            matches.append((x, y, u - x))
+        parts.append((u, i2, v, j2))
+        parts.append((i1, x, j1, y))
+
+    opcodes: List[Opcode] = []
+    i = j = 0
+    for x, y, n in sorted(matches) + [(len(a), len(b), 0)]:
+        if i < x or j < y:
+            tag = "replace" if i < x and j < y else "delete" if i < x else "insert"
+            opcodes.append((tag, i, x, j, y))
+        if n:
+            if opcodes and opcodes[-1][0] == "equal":
+                opcodes[-1] = ("equal", opcodes[-1][1], x + n, opcodes[-1][3], y + n)
+            else:
+                opcodes.append(("equal", x, x + n, y, y + n))
+        i, j = x + n, y + n
+    return opcodes
+
+def compress(stream: Sequence, start: int, end: int) -> List[Tuple[int, int, int]]:
+    """Split a run of a stream into repeated loop bodies.
+
+    At each position, the period up to ALIGN_MAX_PERIOD that covers the most
+    elements wins; a body that does not repeat is a single element.
+
+    Returns:
+        (start, period, count) of each body, in order
+    """
+    units = []
+    i = start
+    while i < end:
+        best = (1, 1)
+        for period in range(1, min(ALIGN_MAX_PERIOD, (end - i) // 2) + 1):
+            # A run with period p matches itself shifted by p
+            count = (common_prefix(stream, i + period, end, stream, i, end) + period) // period
+            if count > 1 and count * period > best[0] * best[1]:
+                best = (period, count)
+        units.append((i, best[0], best[1]))
+        i += best[0] * best[1]
+    return units
+
+def describe_run(stream: Sequence, start: int, end: int, names: Sequence[str]) -> str:
+    """Describe a run of barrier IDs, e.g. "init -> step ×1000 -> (check -> retry) ×3"."""
+    parts = []
+    units = compress(stream, start, end)
+    for unit_start, period, count in units[:ALIGN_DESCRIBE_UNITS]:
+        body = " -> ".join(names[code] for code in stream[unit_start:unit_start + period])
+        if count == 1:
+            parts.append(body)
+        else:
+            parts.append(f"{body} ×{count}" if period == 1 else f"({body}) ×{count}")
+    text = " -> ".join(parts)
+    if len(units) > ALIGN_DESCRIBE_UNITS:
+        text += f" -> ... ({end - start} checkpoints)"
+    return text
+
+def describe_position(stream: Sequence, index: int, names: Sequence[str]) -> str:
+    """Describe where a run starts, e.g. "after step #5" for the sixth occurrence of step."""
+    if index == 0:
+        return "at the start"
+    code = stream[index - 1]
+    occurrence = stream[:index - 1].count(code)
+    return f"after {names[code]} #{occurrence}"
+
+def report_alignment(stream1: Sequence[int], stream2: Sequence[int], names: Sequence[str]) -> List[str]:
+    """Describe how the barrier streams of the programs differ.
+
+    Args:
+        stream1: The barriers program1 reached, as indices into names
+        stream2: The barriers program2 reached
+        names: The barrier IDs
+
+    Returns:
+        The lines of the report, one per run of the alignment
+    """
+    lines = []
+    opcodes = align(stream1, stream2)
+    for tag, i1, i2, j1, j2 in opcodes[:ALIGN_REPORT_LIMIT]:
+        if tag == "equal":
+            lines.append(f"both:           {describe_run(stream1, i1, i2, names)}")
+        elif tag == "delete":
+            lines.append(f"program1 only:  {describe_run(stream1, i1, i2, names)} "
+                         f"({describe_position(stream1, i1, names)})")
+        elif tag == "insert":
+            lines.append(f"program2 only:  {describe_run(stream2, j1, j2, names)} "
+                         f"({describe_position(stream2, j1, names)})")
+        else:
+            lines.append(f"replaced:       program1 {describe_run(stream1, i1, i2, names)} "
+                         f"by program2 {describe_run(stream2, j1, j2, names)} "
+                         f"({describe_position(stream1, i1, names)})")
+    if len(opcodes) > ALIGN_REPORT_LIMIT:
+        lines.append(f"... and {len(opcodes) - ALIGN_REPORT_LIMIT} more runs")
+    return lines
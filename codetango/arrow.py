@@ -0,0 +1,467 @@
+"""
+CodeTango Arrow export
+
+This module writes the checkpoints of a run as Arrow IPC files, which
+dataframe tools load directly and can memory-map. Each barrier gets a file
+with one row per program and occurrence of the barrier, and one typed
+column per variable, scalar and region. Rows are written as record batches
+of at most ARROW_BATCH_ROWS rows while the programs run, so the trace is
+never held in memory as a whole.
+
+The writer is a minimal implementation of the Arrow IPC file format
+(https://arrow.apache.org/docs/format/Columnar.html), including the
+FlatBuffers encoding of its metadata, so it needs no dependency.
+"""
+
+import array
+import json
+import os
+import re
+import struct
+import sys
+from typing import Any, Dict, List, Optional, Set, Tuple
+
+# Rows of a record batch, and payload bytes after which a batch is written early
+ARROW_BATCH_ROWS = 4096
+ARROW_BATCH_BYTES = 64 * 2**20
+
+# Start and end of an Arrow IPC file
+ARROW_MAGIC = b"ARROW1"
+
+# Metadata version V5, and the message header types
+METADATA_VERSION = 4
+HEADER_SCHEMA = 1
+HEADER_RECORD_BATCH = 3
+
+# Column types: the Type union member of the schema and, for lists, the item type.
+# Values that fit no other type are written as their JSON text.
+COLUMN_TYPES = {
+    "bool": 6,
+    "int64": 2,
+    "float64": 3,
+    "utf8": 5,
+    "binary": 4,
+    "json": 5,
+    "list<int64>": 12,
+    "list<float64>": 12,
+}
+
+class FlatTable:
+    """A FlatBuffers table: values by field slot.
+
+    A value is a (struct format, number) pair for scalars, a str, a
+    FlatVector or another FlatTable.
+    """
+
+    def __init__(self, *fields: Tuple[int, Any]):
+        self.fields = [(slot, value) for slot, value in fields if value is not None]
+
+class FlatVector:
+    """A FlatBuffers vector of structs of a given format, or of tables or strings without one."""
+
+    def __init__(self, items: List[Any], fmt: Optional[str] = None):
+        self.items = items
+        self.fmt = fmt
+
+class FlatBlob:
+    """An object encoded beforehand by encode_flatbuffer(), embedded as it is.
+
+    Offsets within a buffer are relative, so an encoded buffer stays valid
+    anywhere in another one at the same alignment.
+    """
+
+    def __init__(self, data: bytes):
+        self.data = data
+
+def encode_flatbuffer(root: FlatTable) -> bytes:
+    """Encode a FlatBuffers buffer.
+
+    Objects are written front to back: a table, then the objects it refers
+    to, since offsets to objects are unsigned and point forward.
+    """
+    buf = bytearray(4)
+
+    def pad(alignment: int) -> None:
+        buf.extend(bytes(-len(buf) % alignment))
+
+    def patch(position: int, target: int) -> None:
+        struct.pack_into("<I", buf, position, target - position)
+
+    def place(obj: Any) -> int:
+        if isinstance(obj, FlatBlob):
+            pad(8)
+            position = len(buf)
+            buf.extend(obj.data)
+            return position + struct.unpack_from("<I", obj.data)[0]
+
+        if isinstance(obj, str):
+            pad(4)
+            position = len(buf)
+            data = obj.encode('utf-8')
+            buf.extend(struct.pack("<I", len(data)) + data + b"\0")
+            return position
+
+        if isinstance(obj, FlatVector):
+            if obj.fmt:
+                # Structs are aligned to their largest member, 8 bytes here
+                pad(4)
+                if (len(buf) + 4) % 8:
+                    buf.extend(bytes(4))
+                position = len(buf)
+                buf.extend(struct.pack("<I", len(obj.items)))
+                for item in obj.items:
+                    buf.extend(struct.pack("<" + obj.fmt, *item))
+                return position
+            pad(4)
+            position = len(buf)
+            buf.extend(struct.pack("<I", len(obj.items)))
+            slots = len(buf)
+            buf.extend(bytes(4 * len(obj.items)))
+            for i, item in enumerate(obj.items):
+                patch(slots + 4 * i, place(item))
+            return position
+
+        # Table: the inline fields sorted by size, after the offset of the vtable
+        sizes = [(slot, struct.calcsize("<" + value[0]) if isinstance(value, tuple) else 4)
+                 for slot, value in obj.fields]
+        layout = {}
+        size = 4
+        for slot, field_size in sorted(sizes, key=lambda item: -item[1]):
+            size += -size % field_size
+            layout[slot] = size
+            size += field_size
+        slot_count = max(layout) + 1 if layout else 0
+
+        pad(2)
+        vtable = len(buf)
+        buf.extend(struct.pack("<HH", 4 + 2 * slot_count, size))
+        buf.extend(struct.pack(f"<{slot_count}H", *(layout.get(slot, 0) for slot in range(slot_count))))
+        pad(8 if any(field_size == 8 for _, field_size in sizes) else 4)
+        table = len(buf)
+        buf.extend(bytes(size))
+        struct.pack_into("<i", buf, table, table - vtable)
+
+        # Strings go last, so that a table ends with them, see field_blob()
+        references = []
+        for slot, value in obj.fields:
+            if isinstance(value, tuple):
+                struct.pack_into("<" + value[0], buf, table + layout[slot], value[1])
+            else:
+                references.append((table + layout[slot], value))
+        references.sort(key=lambda reference: isinstance(reference[1], str))
+        for position, value in references:
+            patch(position, place(value))
+        return table
+
+    patch(0, place(root))
+    return bytes(buf)
+
+# Column types of the values of simple Python types
+VALUE_TYPES = {type(None): None, bool: "bool", float: "float64", str: "utf8", bytes: "binary"}
+
+def column_type(value: Any) -> Optional[str]:
+    """Get the column type of a value, or None for a null."""
+    value_type = VALUE_TYPES.get(type(value), "")
+    if value_type != "":
+        return value_type
+    if isinstance(value, bool):
+        return "bool"
+    if isinstance(value, int):
+        return "int64" if -2**63 <= value < 2**63 else "json"
+    if isinstance(value, float):
+        return "float64"
+    if isinstance(value, str):
+        return "utf8"
+    if isinstance(value, (bytes, bytearray, memoryview)):
+        return "binary"
+    if isinstance(value, list) and all(isinstance(item, (int, float)) and not isinstance(item, bool) for item in value):
+        if all(isinstance(item, int) and -2**63 <= item < 2**63 for item in value):
+            return "list<int64>"
+        return "list<float64>"
+    return "json"
+
+def unify_types(type1: Optional[str], type2: Optional[str]) -> Optional[str]:
+    """Get a column type holding the values of two types."""
+    if type1 is None or type1 == type2:
+        return type2
+    if type2 is None:
+        return type1
+    for wide, narrow in (("float64", "int64"), ("list<float64>", "list<int64>")):
+        if {type1, type2} == {wide, narrow}:
+            return wide
+    return "json"
+
+def fits_type(column: str, value: Any) -> bool:
+    """Check whether a value can be written to a column of a type."""
+    value_type = column_type(value)
+    return value_type is None or column == "json" or unify_types(column, value_type) == column
+
+def field_table(name: str, column: str) -> FlatTable:
+    """The schema field of a column."""
+    if column == "int64":
+        type_table = FlatTable((0, ("i", 64)), (1, ("?", True)))
+    elif column == "float64":
+        type_table = FlatTable((0, ("h", 2)))
+    else:
+        type_table = FlatTable()
+    children = [field_table("item", column[5:-1])] if column.startswith("list<") else []
+    return FlatTable((0, name), (1, ("?", True)), (2, ("B", COLUMN_TYPES[column])), (3, type_table),
+                     (5, FlatVector(children)))
+
+# Encoded schema fields with an empty name by column type
+FIELD_TEMPLATES: Dict[str, bytes] = {}
+
+def field_blob(name: str, column: str) -> FlatBlob:
+    """The encoded schema field of a column.
+
+    Files may have hundreds of thousands of columns, so the field of each
+    type is encoded once, and the name, which it ends with, is replaced.
+    """
+    prefix = FIELD_TEMPLATES.get(column)
+    if prefix is None:
+        # Cut the template before its name: the string the name field points to
+        data = encode_flatbuffer(field_table("", column))
+        table = struct.unpack_from("<I", data)[0]
+        vtable = table - struct.unpack_from("<i", data, table)[0]
+        slot = table + struct.unpack_from("<H", data, vtable + 4)[0]
+        prefix = FIELD_TEMPLATES[column] = data[:slot + struct.unpack_from("<I", data, slot)[0]]
+    encoded = name.encode('utf-8')
+    return FlatBlob(prefix + struct.pack("<I", len(encoded)) + encoded + b"\0")
+
+def schema_table(columns: List[Tuple[str, str]], metadata: Dict[str, str]) -> FlatTable:
+    """The schema of a file: its columns and key-value metadata."""
+    return FlatTable(
+        (0, ("h", 0 if sys.byteorder == "little" else 1)),
+        (1, FlatVector([field_blob(name, column) for name, column in columns])),
+        (2, FlatVector([FlatTable((0, key), (1, value)) for key, value in metadata.items()])),
+    )
+
+def validity_bitmap(values: List[Any]) -> Tuple[bytes, int]:
+    """Get the validity bitmap of a column and its null count; no bitmap without nulls."""
+    nulls = sum(value is None for value in values)
+    if not nulls:
+        return b"", 0
+    bitmap = bytearray((len(values) + 7) // 8)
+    for i, value in enumerate(values):
+        if value is not None:
+            bitmap[i >> 3] |= 1 << (i & 7)
+    return bytes(bitmap), nulls
+
+def build_column(column: str, values: List[Any]) -> Tuple[List[Tuple[int, int]], List[bytes]]:
+    """Build the field nodes (length, null count) and buffers of a column, in schema order."""
+    validity, nulls = validity_bitmap(values)
+    nodes = [(len(values), nulls)]
+    if column == "bool":
+        bits = bytearray((len(values) + 7) // 8)
+        for i, value in enumerate(values):
+            if value:
+                bits[i >> 3] |= 1 << (i & 7)
+        return nodes, [validity, bytes(bits)]
+    if column in ("int64", "float64"):
+        data = array.array("q" if column == "int64" else "d",
+                           (0 if value is None else value for value in values))
+        return nodes, [validity, data.tobytes()]
+    if column.startswith("list<"):
+        offsets = array.array("i", [0])
+        items = array.array("q" if column == "list<int64>" else "d")
+        for value in values:
+            items.extend(value or [])
+            offsets.append(len(items))
+        nodes.append((len(items), 0))
+        return nodes, [validity, offsets.tobytes(), b"", items.tobytes()]
+
+    # Variable-size: utf8, binary and JSON text
+    if column == "json":
+        data = [b"" if value is None else json.dumps(value).encode('utf-8') for value in values]
+    elif column == "utf8":
+        data = [b"" if value is None else value.encode('utf-8') for value in values]
+    else:
+        data = [b"" if value is None else bytes(value) for value in values]
+    offsets = array.array("i", [0])
+    total = 0
+    for item in data:
+        total += len(item)
+        offsets.append(total)
+    return nodes, [validity, offsets.tobytes(), b"".join(data)]
+
+class ArrowFileWriter:
+    """Writes record batches of a fixed schema to an Arrow IPC file."""
+
+    def __init__(self, path: str, columns: List[Tuple[str, str]], metadata: Dict[str, str]):
+        """Create the file and write its schema.
+
+        Args:
+            path: The path of the file
+            columns: The columns: (name, type), see COLUMN_TYPES
+            metadata: Key-value metadata of the schema
+        """
+        self.columns = columns
+        self.schema = schema_table(columns, metadata)
+        self.blocks: List[Tuple[int, int, int]] = []
+        self.file = open(path, "wb")
+        self.file.write(ARROW_MAGIC + b"\0\0")
+        self.write_message(HEADER_SCHEMA, self.schema, b"")
+
+    def write_message(self, header_type: int, header: FlatTable, body: bytes) -> Tuple[int, int, int]:
+        """Write an encapsulated message: its metadata, padded to 8 bytes, then its body.
+
+        Returns:
+            The block of the message: offset, metadata length and body length
+        """
+        metadata = encode_flatbuffer(FlatTable(
+            (0, ("h", METADATA_VERSION)), (1, ("B", header_type)), (2, header), (3, ("q", len(body)))))
+        metadata += bytes(-len(metadata) % 8)
+        offset = self.file.tell()
+        self.file.write(struct.pack("<Ii", 0xFFFFFFFF, len(metadata)) + metadata)
+        self.file.write(body)
+        return offset, 8 + len(metadata), len(body)
+
+    def write_batch(self, columns: List[List[Any]]) -> None:
+        """Write a record batch.
+
+        Args:
+            columns: The values of each column, None for nulls
+        """
+        nodes = []
+        buffers = []
+        body = bytearray()
+        for (_, column), values in zip(self.columns, columns):
+            column_nodes, column_buffers = build_column(column, values)
+            nodes.extend(column_nodes)
+            for data in column_buffers:
+                buffers.append((len(body), len(data)))
+                body.extend(data)
+                body.extend(bytes(-len(body) % 8))
+        length = len(columns[0]) if columns else 0
+        batch = FlatTable((0, ("q", length)), (1, FlatVector(nodes, "qq")), (2, FlatVector(buffers, "qq")))
+        self.blocks.append(self.write_message(HEADER_RECORD_BATCH, batch, bytes(body)))
+
+    def close(self) -> None:
+        """Write the end of stream marker and the footer locating the record batches."""
+        self.file.write(struct.pack("<Ii", 0xFFFFFFFF, 0))
+        footer = encode_flatbuffer(FlatTable(
+            (0, ("h", METADATA_VERSION)), (1, self.schema), (2, FlatVector([], "qi4xq")),
+            (3, FlatVector(self.blocks, "qi4xq"))))
+        self.file.write(footer + struct.pack("<i", len(footer)) + ARROW_MAGIC)
+        self.file.close()
+
+class BarrierExport:
+    """The rows of one barrier: buffered, then written as record batches.
+
+    The columns of a file are those of its first batch, typed to hold all
+    of its values; a column holding both integers and floats is float64.
+    A later row that does not fit, e.g. with a new variable, starts the
+    next file.
+    """
+
+    def __init__(self, path: str, barrier_id: str):
+        self.path = path
+        self.barrier_id = barrier_id
+        self.rows: List[Dict[str, Any]] = []
+        self.bytes = 0
+        self.writer: Optional[ArrowFileWriter] = None
+        self.types: Dict[str, str] = {}
+        self.parts = 0
+
+    def open(self, rows: List[Dict[str, Any]]) -> None:
+        """Start the next file, with columns fitting the given rows."""
+        types: Dict[str, Optional[str]] = {}
+        for row in rows:
+            for name, value in row.items():
+                types[name] = unify_types(types.get(name), column_type(value))
+        columns = [(name, column or "utf8") for name, column in types.items()]
+        self.parts += 1
+        path = self.path if self.parts == 1 else f"{os.path.splitext(self.path)[0]}.{self.parts}.arrow"
+        self.writer = ArrowFileWriter(path, columns, {"barrier_id": self.barrier_id})
+        self.types = dict(columns)
+
+    def fits(self, row: Dict[str, Any]) -> bool:
+        """Check whether a row can be written to the current file."""
+        types = self.types
+        return all(name in types and fits_type(types[name], value) for name, value in row.items())
+
+    def add(self, row: Dict[str, Any], size: int) -> None:
+        """Add a row of about size bytes."""
+        self.rows.append(row)
+        self.bytes += size
+        if len(self.rows) >= ARROW_BATCH_ROWS or self.bytes >= ARROW_BATCH_BYTES:
+            self.flush()
+
+    def flush(self) -> None:
+        """Write the buffered rows."""
+        rows, self.rows, self.bytes = self.rows, [], 0
+        while rows:
+            if self.writer is None:
+                self.open(rows)
+            count = 0
+            while count < len(rows) and self.fits(rows[count]):
+                count += 1
+            if count:
+                self.writer.write_batch([[row.get(name) for row in rows[:count]]
+                                         for name, _ in self.writer.columns])
+            if count < len(rows):
+                self.writer.close()
+                self.writer = None
+            rows = rows[count:]
+
+    def close(self) -> None:
+        """Write the remaining rows and finish the file."""
+        self.flush()
+        if self.writer:
+            self.writer.close()
+            self.writer = None
+
+class ArrowExporter:
+    """Writes the checkpoints of a run to one Arrow IPC file per barrier in a directory.
+
+    Each row has the columns program, occurrence (the number of times the
+    barrier was reached before) and matched, then the values of the program
+    at that occurrence.
+    """
+
+    def __init__(self, directory: str):
+        """Create the directory of the files.
+
+        Args:
+            directory: The directory
+        """
+        self.directory = directory
+        os.makedirs(directory, exist_ok=True)
+        self.barriers: Dict[str, BarrierExport] = {}
+        self.occurrences: Dict[str, int] = {}
+        # File names given to barriers, which must not collide once sanitized
+        self.names: Set[str] = set()
+
+    def add(self, barrier_id: str, matched: bool, values: Dict[str, Dict[str, Any]]) -> None:
+        """Add the checkpoints of both programs at a barrier.
+
+        Args:
+            barrier_id: The ID of the barrier
+            matched: Whether the checkpoints matched
+            values: The values of each program by name
+        """
+        export = self.barriers.get(barrier_id)
+        if export is None:
+            # Without dots, no name can collide with the next file of another barrier
+            base = name = re.sub(r"[^\w-]", "_", barrier_id) or "_"
+            suffix = 1
+            while name in self.names:
+                suffix += 1
+                name = f"{base}-{suffix}"
+            self.names.add(name)
+            export = BarrierExport(os.path.join(self.directory, f"{name}.arrow"), barrier_id)
+            self.barriers[barrier_id] = export
+        occurrence = self.occurrences.get(barrier_id, 0)
+        self.occurrences[barrier_id] = occurrence + 1
+
+        for program_id in sorted(values):
+            row = {"program": program_id, "occurrence": occurrence, "matched": matched}
+            row.update(values[program_id])
+            row.update(program=program_id, occurrence=occurrence, matched=matched)
+            size = sum(len(value) if isinstance(value, (bytes, str, list)) else 8 for value in row.values())
+            export.add(row, size)
+
+    def close(self) -> None:
+        """Finish all files."""
+        for export in self.barriers.values():
+            export.close()
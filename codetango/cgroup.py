@@ -0,0 +1,292 @@
+"""
+CodeTango cgroup v2 support
+
+This module places each launched program in its own transient cgroup, applies
+optional CPU and memory limits, and reads the resource usage of each program.
+"""
+
+import os
+import re
+from typing import Any, Dict, List, Optional
+
+# Mount point of the cgroup v2 hierarchy
+CGROUP_ROOT = "/sys/fs/cgroup"
+
+# Controllers needed for limits and accounting
+CONTROLLERS = ("cpu", "memory", "io")
+
+# Period of the CPU bandwidth limit, in microseconds
+CPU_PERIOD = 100000
+
+class CgroupError(Exception):
+    """Raised when transient cgroups cannot be created."""
+
+def parse_size(text: str) -> int:
+    """Parse a size with an optional K, M, G or T suffix (powers of 1024).
+
+    Args:
+        text: The size, e.g. "512M"
+
+    Returns:
+        int: The size in bytes
+    """
+    match = re.fullmatch(r"\s*(\d+(?:\.\d+)?)\s*([KMGT]?)i?B?\s*", text, re.IGNORECASE)
+    if not match:
+        raise ValueError(f"Invalid size: {text}")
+    exponent = " KMGT".index(match.group(2).upper() or " ")
+    return int(float(match.group(1)) * 1024 ** exponent)
+
+def read_keyed_file(path: str) -> Dict[str, int]:
+    """Read a flat keyed cgroup file such as cpu.stat.
+
+    Args:
+        path: The path of the file
+
+    Returns:
+        The values by key
+    """
+    values = {}
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) == 2:
+                values[fields[0]] = int(fields[1])
+    return values
+
+class ProgramCgroup:
+    """The transient cgroup of one launched program."""
+
+    def __init__(self, path: str):
+        """Initialize the cgroup.
+
+        Args:
+            path: The path of the cgroup directory
+        """
+        self.path = path
+
+    def attach_self(self) -> None:
+        """Move the calling process into this cgroup.
+
+        Meant to be called in the child between fork and exec, so the program
+        is accounted from its first instruction.
+        """
+        with open(os.path.join(self.path, "cgroup.procs"), "w") as f:
+            f.write("0")
+
+    def contains(self, pid: int) -> bool:
+        """Check whether a process is a member of this cgroup."""
+        try:
+            with open(os.path.join(self.path, "cgroup.procs")) as f:
+                return str(pid) in f.read().split()
+        except OSError:
+            return False
+
+    def read_stats(self) -> Dict[str, int]:
+        """Read the resource usage of the cgroup.
+
+        Statistics of controllers that are not enabled are omitted.
+
+        Returns:
+            The usage: cpu_user_usec, cpu_system_usec, cpu_throttled_usec,
+            memory_peak, io_read_bytes, io_write_bytes, io_read_ops, io_write_ops
+        """
+        stats = {}
+        try:
+            cpu = read_keyed_file(os.path.join(self.path, "cpu.stat"))
+            stats["cpu_user_usec"] = cpu.get("user_usec", 0)
+            stats["cpu_system_usec"] = cpu.get("system_usec", 0)
+            stats["cpu_throttled_usec"] = cpu.get("throttled_usec", 0)
+        except OSError:
+            pass
+
+        # memory.peak is only available since Linux 5.19
+        for name in ("memory.peak", "memory.current"):
+            try:
+                with open(os.path.join(self.path, name)) as f:
+                    stats["memory_peak"] = int(f.read())
+                break
+            except OSError:
+                continue
+
+        try:
+            totals = {"rbytes": 0, "wbytes": 0, "rios": 0, "wios": 0}
+            with open(os.path.join(self.path, "io.stat")) as f:
+                for line in f:
+                    for item in line.split()[1:]:
+                        key, _, value = item.partition("=")
+                        if key in totals:
+                            totals[key] += int(value)
+            stats["io_read_bytes"] = totals["rbytes"]
+            stats["io_write_bytes"] = totals["wbytes"]
+            stats["io_read_ops"] = totals["rios"]
+            stats["io_write_ops"] = totals["wios"]
+        except OSError:
+            pass
+
+        return stats
+
+class CgroupSession:
+    """A transient cgroup holding one child cgroup per launched program.
+
+    The session is created below the cgroup of the utility itself, so it only
+    works where that cgroup is delegated to the user (e.g. in a systemd
+    scope started with Delegate=yes, or as root).
+    """
+
+    def __init__(self, cpu_limit: Optional[float] = None, memory_limit: Optional[int] = None):
+        """Create the session cgroup.
+
+        Args:
+            cpu_limit: CPU bandwidth limit per program, in cores
+            memory_limit: Memory limit per program, in bytes
+
+        Raises:
+            CgroupError: If the session cgroup cannot be created
+        """
+        self.cpu_limit = cpu_limit
+        self.memory_limit = memory_limit
+        self.groups: List[ProgramCgroup] = []
+
+        if not os.path.exists(os.path.join(CGROUP_ROOT, "cgroup.controllers")):
+            raise CgroupError(f"no cgroup v2 hierarchy at {CGROUP_ROOT}")
+
+        parent = os.path.join(CGROUP_ROOT, self.own_cgroup().lstrip("/"))
+        self.path = os.path.join(parent, f"codetango-{os.getpid()}")
+        try:
+            os.mkdir(self.path)
+        except OSError as e:
+            raise CgroupError(f"cannot create {self.path}: {e.strerror}")
+
+        # Make the controllers available to the program cgroups. Enabling them
+        # in the parent fails if it has member processes; only the controllers
+        # that end up available are used.
+        for controller in CONTROLLERS:
+            if controller not in self.read_controllers(self.path):
+                self.enable_controller(parent, controller)
+            self.enable_controller(self.path, controller)
+        self.controllers = self.read_controllers(self.path)
+
+    @staticmethod
+    def own_cgroup() -> str:
+        """Get the cgroup v2 path of the calling process."""
+        with open("/proc/self/cgroup") as f:
+            for line in f:
+                if line.startswith("0::"):
+                    return line[3:].strip()
+        raise CgroupError("the utility is not in a cgroup v2 hierarchy")
+
+    @staticmethod
+    def read_controllers(path: str) -> List[str]:
+        """Get the controllers available in a cgroup."""
+        try:
+            with open(os.path.join(path, "cgroup.controllers")) as f:
+                return f.read().split()
+        except OSError:
+            return []
+
+    @staticmethod
+    def enable_controller(path: str, controller: str) -> bool:
+        """Enable a controller for the children of a cgroup."""
+        try:
+            with open(os.path.join(path, "cgroup.subtree_control"), "w") as f:
+                f.write(f"+{controller}")
+            return True
+        except OSError:
+            return False
+
+    def create_group(self, program_id: str) -> ProgramCgroup:
+        """Create the cgroup of a program and apply the limits.
+
+        Args:
+            program_id: The ID of the program
+
+        Returns:
+            The cgroup of the program
+        """
+        path = os.path.join(self.path, program_id)
+        try:
+            os.mkdir(path)
+        except OSError as e:
+            raise CgroupError(f"cannot create {path}: {e.strerror}")
+        group = ProgramCgroup(path)
+        self.groups.append(group)
+
+        if self.cpu_limit is not None:
+            self.write_limit(path, "cpu", "cpu.max", f"{int(self.cpu_limit * CPU_PERIOD)} {CPU_PERIOD}")
+        if self.memory_limit is not None:
+            self.write_limit(path, "memory", "memory.max", str(self.memory_limit))
+
+        return group
+
+    def write_limit(self, path: str, controller: str, name: str, value: str) -> None:
+        """Write a limit to a cgroup, failing if the controller is not available."""
+        if controller not in self.controllers:
+            raise CgroupError(f"the {controller} controller is not delegated, cannot apply {name}")
+        try:
+            with open(os.path.join(path, name), "w") as f:
+                f.write(value)
+        except OSError as e:
+            raise CgroupError(f"cannot write {name}: {e.strerror}")
+
+    def cleanup(self) -> None:
+        """Remove the cgroups; they must not contain processes anymore."""
+        for group in self.groups:
+            try:
+                os.rmdir(group.path)
+            except OSError:
+                pass
+        try:
+            os.rmdir(self.path)
+        except OSError:
+            pass
+
+def format_stat(name: str, value: Optional[int]) -> str:
+    """Format a statistic returned by ProgramCgroup.read_stats() for the report."""
+    if value is None:
+        return "-"
+    if name.endswith("_usec"):
+        return f"{value / 1e6:.3f} s"
+    if name == "memory_peak" or name.endswith("_bytes"):
+        for unit in ("B", "KiB", "MiB", "GiB"):
+            if value < 1024 or unit == "GiB":
+                return f"{value:.0f} {unit}" if unit == "B" else f"{value:.1f} {unit}"
+            value /= 1024
+    return str(value)
+
+# Report rows: statistic -> label
+STAT_LABELS = {
+    "cpu_user_usec": "CPU time (user)",
+    "cpu_system_usec": "CPU time (system)",
+    "cpu_throttled_usec": "CPU throttled",
+    "memory_peak": "Peak memory",
+    "io_read_bytes": "I/O read",
+    "io_write_bytes": "I/O written",
+    "io_read_ops": "I/O read operations",
+    "io_write_ops": "I/O write operations",
+}
+
+def format_report(stats: Dict[str, Dict[str, int]],
+                  segments: Dict[str, Dict[str, int]]) -> List[str]:
+    """Format the resource usage of both programs side by side.
+
+    Args:
+        stats: Final usage by program ID
+        segments: CPU time in microseconds spent before each barrier, by
+            barrier ID and program ID
+
+    Returns:
+        The lines of the report
+    """
+    programs = sorted(stats)
+    lines = [f"{'Resource usage:':<30}" + "".join(f"{p:>16}" for p in programs)]
+    for name, label in STAT_LABELS.items():
+        if any(name in stats[p] for p in programs):
+            lines.append(f"  {label:<28}" + "".join(
+                f"{format_stat(name, stats[p].get(name)):>16}" for p in programs))
+
+    if segments:
+        lines.append(f"{'CPU time by segment:':<30}" + "".join(f"{p:>16}" for p in programs))
+        for barrier_id, usage in segments.items():
+            lines.append(f"  {'-> ' + barrier_id:<28}" + "".join(
+                f"{format_stat('cpu_usec', usage.get(p)):>16}" for p in programs))
+    return lines
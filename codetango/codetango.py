@@ -6,26 +6,142 @@ at barrier points and comparing state variables.
 """
 
 import os
+import sys
+import array
+import ctypes
+import fnmatch
 import json
+import resource
 import socket
-from typing import Any, Dict, List, Union
+import threading
+from typing import Any, Dict, Iterable, List, Optional, Sequence, Set, Union
+
+# struct/array formats of the element types of regions and streams
+DTYPE_FORMATS = {
+    "bytes": "B", "int8": "b", "uint8": "B", "int16": "h", "uint16": "H",
+    "int32": "i", "uint32": "I", "int64": "q", "uint64": "Q",
+    "float32": "f", "float64": "d",
+}
+
+# Bytes of a region masked at a time, so masking needs little memory besides the copy
+MASK_CHUNK_SIZE = 1 << 20
+
+# Size of a libm call recorded by libcodetango_mathtrace
+MATH_RECORD_SIZE = 32
+
+class MathFunction(ctypes.Structure):
+    """An entry of the function table of libcodetango_mathtrace."""
+    _fields_ = [("name", ctypes.c_char_p), ("arity", ctypes.c_int)]
+
+# Receives the libm calls recorded by a thread: ctx, thread, records, count
+MATHTRACE_SINK = ctypes.CFUNCTYPE(ctypes.c_bool, ctypes.c_void_p, ctypes.c_uint, ctypes.c_void_p, ctypes.c_size_t)
+
+# Names kept in an enable table before it starts over, for names made up at run time
+FILTER_TABLE_LIMIT = 65536
+
+# Code object flags of functions taking *args and **kwargs
+CO_VARARGS = 0x04
+CO_VARKEYWORDS = 0x08
+
+def to_json_value(value: Any) -> Any:
+    """Convert a captured argument or return value to a JSON value.
+    
+    Containers are converted recursively, objects with a tolist() method
+    (e.g. arrays) are converted to lists, and anything else to its repr().
+    """
+    if value is None or isinstance(value, (bool, int, float, str)):
+        return value
+    if isinstance(value, (list, tuple)):
+        return [to_json_value(item) for item in value]
+    if isinstance(value, dict):
+        return {str(key): to_json_value(item) for key, item in value.items()}
+    if hasattr(value, "tolist"):
+        return to_json_value(value.tolist())
+    return repr(value)
+
+class Filter:
+    """Include and exclude patterns of barrier IDs or variable names.
+    
+    A name is enabled if it matches an include pattern, or there are none,
+    and no exclude pattern. The patterns are matched once per name, and the
+    result kept in a table.
+    """
+    
+    def __init__(self, include: str, exclude: str):
+        """Initialize the filter.
+        
+        Args:
+            include: Include patterns separated by newlines
+            exclude: Exclude patterns separated by newlines
+        """
+        self.include = [pattern for pattern in include.split("\n") if pattern]
+        self.exclude = [pattern for pattern in exclude.split("\n") if pattern]
+        self.enabled: Dict[str, bool] = {}
+    
+    def enables(self, name: str) -> bool:
+        """Check whether a name is enabled."""
+        enabled = self.enabled.get(name)
+        if enabled is None:
+            enabled = ((not self.include or any(fnmatch.fnmatchcase(name, pattern) for pattern in self.include))
+                       and not any(fnmatch.fnmatchcase(name, pattern) for pattern in self.exclude))
+            if len(self.enabled) >= FILTER_TABLE_LIMIT:
+                self.enabled.clear()
+            self.enabled[name] = enabled
+        return enabled
 
 class Barrier:
     """A class for synchronizing execution with another program at barrier points."""
     
-    def __init__(self, program_id: str):
+    def __init__(self, program_id: str, schema_hash: Optional[str] = None):
         """Initialize the Barrier.
         
         Args:
             program_id: A unique identifier for this program
+            schema_hash: SCHEMA_HASH of the module generated by codetango schema,
+                if the program sends checkpoints with wait_record()
         """
         self.program_id = program_id
+        self.schema_hash = schema_hash
         self.variables: Dict[str, Any] = {}
+        self.regions: Dict[str, Any] = {}
+        # Shape and element type of the regions registered as grids
+        self.grids: Dict[str, Dict[str, Any]] = {}
+        self.files: Dict[str, Dict[str, Any]] = {}
+        self.streams: Dict[str, Any] = {}
+        # Scalars in registration order, and the name tables already sent
+        self.scalar_names: List[str] = []
+        self.scalar_values = array.array('d')
+        self.scalar_tables: Set[str] = set()
+        # Lane variables: name -> (values, dtype)
+        self.lanes: Dict[str, Any] = {}
         self.socket = None
+        self.recv_buffer = b""
+        self.accounting = os.environ.get("CODETANGO_ACCOUNTING") == "1"
+        # Barriers and variables enabled by the utility, or None if all are
+        self.barrier_filter: Optional[Filter] = None
+        self.variable_filter: Optional[Filter] = None
+        if os.environ.get("CODETANGO_FILTERS"):
+            self.set_filters(json.loads(os.environ["CODETANGO_FILTERS"]))
+        # Serializes messages of wait() and of libm trace flushes from other threads
+        self.send_lock = threading.RLock()
+        self.mathtrace = None
+        # Automatic checkpoints, see monitor()
+        self.monitor_tool: Optional[int] = None
+        self.monitor_profile = False
+        # Whether this program runs again from a snapshot, and the snapshots it forked
+        self.rewound = False
+        self.snapshots: List[int] = []
         self.connect()
+        self.attach_mathtrace()
+        if self.accounting:
+            self.accounting_base = self.read_accounting()
     
-    def connect(self) -> None:
-        """Connect to the CodeTango control utility."""
+    def connect(self, **fields: Any) -> None:
+        """Connect to the CodeTango control utility.
+        
+        Args:
+            fields: More fields of the initialization message
+        """
         # Get the socket path from the environment
         socket_path = os.environ.get("CODETANGO_SOCKET")
         if not socket_path:
@@ -42,19 +158,23 @@ class Barrier:
             raise RuntimeError(f"Failed to connect to CodeTango: {e}")
         
         # Send the initialization message
-        init_msg = {"program_id": self.program_id}
+        init_msg = {"program_id": self.program_id, **fields}
+        if self.schema_hash:
+            init_msg["schema"] = self.schema_hash
         try:
-            self.socket.sendall(json.dumps(init_msg).encode('utf-8'))
+            self.send_message(init_msg)
         except socket.error as e:
             self.socket.close()
             self.socket = None
             raise RuntimeError(f"Failed to send init message: {e}")
     
-    def wait(self, barrier_id: str) -> bool:
+    def wait(self, barrier_id: str, site: Optional[str] = None) -> bool:
         """Wait at a barrier until both programs reach this point.
         
         Args:
             barrier_id: A unique identifier for this barrier point
+            site: The source location of the barrier as file:line, for coverage
+                of batch runs; defaults to the caller
             
         Returns:
             bool: True if the barrier was successfully synchronized
@@ -64,24 +184,88 @@ class Barrier:
         """
         if not self.socket:
             raise RuntimeError("Not connected to CodeTango utility")
+        if self.barrier_filter and not self.barrier_filter.enables(barrier_id):
+            self.clear_checkpoint()
+            return True
         
         # Prepare the barrier message
+        if site is None:
+            caller = sys._getframe(1)
+            site = f"{os.path.abspath(caller.f_code.co_filename)}:{caller.f_lineno}"
         barrier_msg = {
             "barrier_id": barrier_id,
+            "site": site,
             "variables": self.variables
         }
         
-        # Send the barrier message
+        # Resource usage of the segment since the previous barrier
+        if self.accounting:
+            counters = self.read_accounting()
+            barrier_msg["accounting"] = {
+                key: value - self.accounting_base.get(key, 0) for key, value in counters.items()
+            }
+        
+        # Regions follow the message as binary payload, in the same order
+        payload = []
+        if self.regions:
+            offset = 0
+            regions = {}
+            for name, (data, mask) in self.regions.items():
+                regions[name] = {"offset": offset, "length": len(data)}
+                regions[name].update(self.grids.get(name, {}))
+                if mask is not None:
+                    regions[name]["mask"] = mask.hex()
+                offset += len(data)
+                payload.append(data)
+            barrier_msg["regions"] = regions
+            barrier_msg["binary"] = offset
+        
+        # Scalars follow the regions: the name table if it is new, then the values
+        if self.scalar_names:
+            offset = barrier_msg.get("binary", 0)
+            table = f"{len(self.scalar_names)}-{hash(tuple(self.scalar_names)) & 0xffffffffffffffff:016x}"
+            scalars = {"table": table, "count": len(self.scalar_values), "offset": offset}
+            if table not in self.scalar_tables:
+                names = "\0".join(self.scalar_names).encode('utf-8') + b"\0"
+                scalars["names"] = len(names)
+                offset += len(names)
+                payload.append(names)
+                self.scalar_tables.add(table)
+            payload.append(self.scalar_values)
+            barrier_msg["scalars"] = scalars
+            barrier_msg["binary"] = offset + len(self.scalar_values) * self.scalar_values.itemsize
+        
+        # Lane variables follow the scalars
+        if self.lanes:
+            offset = barrier_msg.get("binary", 0)
+            lanes = {}
+            for name, (data, dtype) in self.lanes.items():
+                lanes[name] = {"offset": offset, "count": len(data) // array.array(DTYPE_FORMATS[dtype]).itemsize,
+                               "dtype": dtype}
+                offset += len(data)
+                payload.append(data)
+            barrier_msg["lanes"] = lanes
+            barrier_msg["binary"] = offset
+        if self.files:
+            barrier_msg["files"] = self.files
+        if self.streams:
+            barrier_msg["streams"] = {name: {"dtype": dtype} for name, (_, dtype) in self.streams.items()}
+        
+        # Send the libm calls recorded before the barrier, then the barrier message
         try:
-            self.socket.sendall(json.dumps(barrier_msg).encode('utf-8'))
+            with self.send_lock:
+                if self.mathtrace:
+                    self.mathtrace.codetango_mathtrace_flush()
+                self.send_message(barrier_msg, payload)
+                self.send_streams()
         except socket.error as e:
             print(f"Error sending barrier message: {e}")
             return False
         
         # Wait for the response
         try:
-            response = self.socket.recv(4096)
-            if not response:
+            response = self.recv_message()
+            if response is None:
                 print("Connection closed by CodeTango utility")
                 return False
             
@@ -93,7 +277,19 @@ class Barrier:
                 print(f"Barrier failed: {response_data['message']}")
             
             # Clear the variables after the barrier
-            self.variables = {}
+            self.clear_checkpoint()
+            
+            # Filters changed while the programs run apply from the next barrier on
+            if "filters" in response_data:
+                self.set_filters(response_data["filters"])
+            
+            # At every few matching barriers, the utility asks for a snapshot
+            if success and "snapshot" in response_data:
+                self.take_snapshot(response_data["snapshot"], barrier_id)
+            
+            # The next segment starts now, excluding the time spent at the barrier
+            if self.accounting:
+                self.accounting_base = self.read_accounting()
             
             return success
             
@@ -104,6 +300,72 @@ class Barrier:
             print(f"Error parsing barrier response: {e}")
             return False
     
+    def clear_checkpoint(self) -> None:
+        """Discard the variables registered for the current barrier."""
+        self.variables = {}
+        self.regions = {}
+        self.grids = {}
+        self.files = {}
+        self.streams = {}
+        self.scalar_names = []
+        self.scalar_values = array.array('d')
+        self.lanes = {}
+    
+    def set_filters(self, filters: Dict[str, str]) -> None:
+        """Replace the filters with those sent by the utility.
+        
+        Args:
+            filters: Patterns separated by newlines: include_barriers,
+                exclude_barriers, include_variables and exclude_variables
+        """
+        barriers = Filter(filters.get("include_barriers", ""), filters.get("exclude_barriers", ""))
+        variables = Filter(filters.get("include_variables", ""), filters.get("exclude_variables", ""))
+        filtered = barriers.include or barriers.exclude or variables.include or variables.exclude
+        self.barrier_filter = barriers if filtered else None
+        self.variable_filter = variables if filtered else None
+    
+    def wait_record(self, index: int, barrier_id: str, record: bytes) -> bool:
+        """Wait at a barrier with a fixed-layout checkpoint record.
+        
+        Called by wait() of a module generated by codetango schema. The record
+        is sent as is, tagged with the index of its barrier in the schema; the
+        utility decodes it with the same schema. Variables registered with
+        the add_*() methods are not sent with it.
+        
+        Args:
+            index: The index of the barrier in the schema
+            barrier_id: The name of the barrier, sent only with snapshots
+            record: The packed record
+            
+        Returns:
+            bool: True if the barrier was successfully synchronized
+        """
+        if not self.socket:
+            raise RuntimeError("Not connected to CodeTango utility")
+        if self.barrier_filter and not self.barrier_filter.enables(barrier_id):
+            return True
+        
+        try:
+            with self.send_lock:
+                if self.mathtrace:
+                    self.mathtrace.codetango_mathtrace_flush()
+                self.send_message({"record": index, "binary": len(record)}, [record])
+            response = self.recv_message()
+        except socket.error as e:
+            print(f"Error exchanging barrier record: {e}")
+            return False
+        if response is None:
+            print("Connection closed by CodeTango utility")
+            return False
+        
+        response_data = json.loads(response.decode('utf-8'))
+        success = response_data.get("status") == "success"
+        if "filters" in response_data:
+            self.set_filters(response_data["filters"])
+        if success and "snapshot" in response_data:
+            self.take_snapshot(response_data["snapshot"], barrier_id)
+        return success
+    
     def add_int(self, name: str, value: int) -> None:
         """Register an integer variable to be compared at the next barrier.
         
@@ -111,6 +373,8 @@ class Barrier:
             name: The name of the variable
             value: The value of the variable
         """
+        if self.variable_filter and not self.variable_filter.enables(name):
+            return
         self.variables[name] = value
     
     def add_float(self, name: str, value: float) -> None:
@@ -120,6 +384,8 @@ class Barrier:
             name: The name of the variable
             value: The value of the variable
         """
+        if self.variable_filter and not self.variable_filter.enables(name):
+            return
         self.variables[name] = value
     
     def add_str(self, name: str, value: str) -> None:
@@ -129,6 +395,8 @@ class Barrier:
             name: The name of the variable
             value: The value of the variable
         """
+        if self.variable_filter and not self.variable_filter.enables(name):
+            return
         self.variables[name] = value
     
     def add_bool(self, name: str, value: bool) -> None:
@@ -138,6 +406,8 @@ class Barrier:
             name: The name of the variable
             value: The value of the variable
         """
+        if self.variable_filter and not self.variable_filter.enables(name):
+            return
         self.variables[name] = value
     
     def add_list(self, name: str, value: List[Any]) -> None:
@@ -147,6 +417,8 @@ class Barrier:
             name: The name of the variable
             value: The value of the variable
         """
+        if self.variable_filter and not self.variable_filter.enables(name):
+            return
         self.variables[name] = value
     
     def add_dict(self, name: str, value: Dict[str, Any]) -> None:
@@ -156,6 +428,8 @@ class Barrier:
             name: The name of the variable
             value: The value of the variable
         """
+        if self.variable_filter and not self.variable_filter.enables(name):
+            return
         self.variables[name] = value
     
     def add_variable(self, name: str, value: Any) -> None:
@@ -168,10 +442,477 @@ class Barrier:
         Notes:
             The value must be JSON serializable.
         """
+        if self.variable_filter and not self.variable_filter.enables(name):
+            return
         self.variables[name] = value
     
+    def add_scalar(self, name: str, value: float) -> None:
+        """Register a scalar to be compared at the next barrier, for checkpoints of many scalars.
+        
+        Unlike add_float(), scalars are kept in registration order rather than
+        by name. Their names are sent once per distinct list of names, and
+        their values as one packed array of doubles, compared bit for bit.
+        Register them in the same order at each barrier to send the names
+        only once.
+        
+        Args:
+            name: The name of the scalar
+            value: The value of the scalar
+        """
+        if self.variable_filter and not self.variable_filter.enables(name):
+            return
+        self.scalar_names.append(name)
+        self.scalar_values.append(value)
+    
+    def add_lanes(self, name: str, values: Any, dtype: str = "float64") -> None:
+        """Register a variable of a batch of independent problems, one value per lane.
+        
+        The utility compares lane variables lane by lane and reports which
+        lanes differ and in what, so one vectorized program solving many
+        problems at once is checked against a reference that solves them one
+        at a time and registers its results per lane, in one program pair.
+        
+        Args:
+            name: The name of the variable
+            values: The value of each lane: a sequence of numbers, or a
+                bytes-like object of dtype elements, which is sent without
+                copying and must not change until wait()
+            dtype: The element type: int8..int64, uint8..uint64, float32 or float64
+        """
+        if self.variable_filter and not self.variable_filter.enables(name):
+            return
+        fmt = DTYPE_FORMATS[dtype]
+        try:
+            data = memoryview(values).cast('B')
+        except TypeError:
+            data = memoryview(array.array(fmt, values)).cast('B')
+        if len(data) % array.array(fmt).itemsize:
+            raise ValueError(f"Lane variable {name} is not a whole number of {dtype} values")
+        self.lanes[name] = (data, dtype)
+    
+    def add_region(self, name: str, data: Any, mask: Optional[bytes] = None) -> None:
+        """Register a raw memory region to be compared byte-wise at the next barrier.
+        
+        Args:
+            name: The name of the region
+            data: Any bytes-like object, e.g. bytes, bytearray, array or memoryview.
+                Unmasked data is sent at wait() without copying, so it must
+                not change until then.
+            mask: Optional per-record bitmask, applied cyclically; its length
+                is the record size. Bits cleared in the mask are excluded
+                from the comparison.
+        """
+        if self.variable_filter and not self.variable_filter.enables(name):
+            return
+        view = memoryview(data).cast('B')
+        # An empty mask is no mask, as in the C++ client
+        mask = (bytes(mask) or None) if mask is not None else None
+        if mask is not None:
+            if len(view) % len(mask) != 0:
+                raise ValueError("Region size is not a multiple of the mask size")
+            # A big-integer AND per chunk of whole records masks at C speed
+            chunk = max(MASK_CHUNK_SIZE // len(mask), 1) * len(mask)
+            tile = int.from_bytes(mask * (min(chunk, len(view)) // len(mask)), 'little')
+            masked = bytearray(len(view))
+            for start in range(0, len(view), chunk):
+                size = min(chunk, len(view) - start)
+                if size < chunk:
+                    tile &= (1 << (8 * size)) - 1
+                value = int.from_bytes(view[start:start + size], 'little') & tile
+                masked[start:start + size] = value.to_bytes(size, 'little')
+            view = memoryview(masked)
+        self.regions[name] = (view, mask)
+        self.grids.pop(name, None)
+    
+    def add_grid(self, name: str, data: Any, shape: Sequence[int], dtype: str = "float64") -> None:
+        """Register an array with a shape, e.g. the field of a stencil code, to be compared at the next barrier.
+        
+        It is compared like a region, but where it differs the utility
+        reports the bounding box, connected regions and per-axis counts of
+        the differing cells instead of the first differing byte.
+        
+        Args:
+            name: The name of the grid
+            data: The cells in row-major order, any bytes-like object; it is
+                sent without copying, so it must not change until wait()
+            shape: The extent of each axis, slowest first
+            dtype: The element type: bytes, int8..int64, uint8..uint64, float32 or float64
+        """
+        if self.variable_filter and not self.variable_filter.enables(name):
+            return
+        if not shape:
+            raise ValueError(f"Grid {name} needs a shape")
+        view = memoryview(data).cast('B')
+        cells = 1
+        for extent in shape:
+            cells *= extent
+        if cells * array.array(DTYPE_FORMATS[dtype]).itemsize != len(view):
+            raise ValueError(f"Grid {name} has {len(view)} bytes, not the size of its shape and dtype")
+        self.add_region(name, view)
+        self.grids[name] = {"shape": list(shape), "dtype": dtype}
+    
+    def add_file_region(self, name: str, path: str, offset: int, length: int,
+                        dtype: str = "bytes", sync: bool = False) -> None:
+        """Register a region of a file to be compared at the next barrier.
+        
+        Only the reference is sent: the CodeTango utility maps the files of
+        both programs and compares the regions directly. Data must be flushed
+        from user-space buffers (e.g. ``file.flush()``) before the barrier.
+        
+        Args:
+            name: The name of the region
+            path: The path of the file
+            offset: The offset of the region in the file, in bytes
+            length: The length of the region in bytes
+            dtype: The element type: bytes, int8..int64, uint8..uint64, float32 or float64
+            sync: Whether to fdatasync() the file before the barrier, for files
+                that bypass the local page cache
+        """
+        if self.variable_filter and not self.variable_filter.enables(name):
+            return
+        path = os.path.realpath(path)
+        if os.path.getsize(path) < offset + length:
+            raise ValueError(f"File region exceeds the size of {path}")
+        if sync:
+            fd = os.open(path, os.O_RDONLY)
+            try:
+                os.fdatasync(fd)
+            finally:
+                os.close(fd)
+        self.files[name] = {"path": path, "offset": offset, "length": length, "dtype": dtype}
+    
+    def add_stream(self, name: str, chunks: Iterable[Any], dtype: str = "float64") -> None:
+        """Register a stream of values to be compared at the next barrier.
+        
+        The chunks are produced, sent and compared one at a time during
+        wait(), so the stream is never materialized as a whole.
+        
+        Args:
+            name: The name of the stream
+            chunks: An iterable (e.g. a generator) yielding chunks, each either
+                a sequence of numbers or a bytes-like object of dtype elements
+            dtype: The element type: bytes, int8..int64, uint8..uint64, float32 or float64
+        """
+        if self.variable_filter and not self.variable_filter.enables(name):
+            return
+        self.streams[name] = (chunks, dtype)
+    
+    def send_streams(self) -> None:
+        """Send the chunks of the registered streams, in the order of their names."""
+        for name in sorted(self.streams):
+            chunks, dtype = self.streams[name]
+            for chunk in chunks:
+                try:
+                    data = memoryview(chunk).cast('B')
+                except TypeError:
+                    data = memoryview(array.array(DTYPE_FORMATS[dtype], chunk)).cast('B')
+                if len(data):
+                    self.send_message({"stream": name, "binary": len(data)}, [data])
+            self.send_message({"stream": name, "end": True})
+    
+    @staticmethod
+    def read_accounting() -> Dict[str, int]:
+        """Read the I/O and syscall counters of this process.
+        
+        Returns:
+            The counters of /proc/self/io and getrusage()
+        """
+        counters = {}
+        try:
+            with open("/proc/self/io") as f:
+                for line in f:
+                    key, _, value = line.partition(":")
+                    if key != "cancelled_write_bytes":
+                        counters[key] = int(value)
+        except (OSError, ValueError):
+            # Unreadable in some containers, in which case only getrusage() counts
+            pass
+        
+        usage = resource.getrusage(resource.RUSAGE_SELF)
+        counters["voluntary_ctxt_switches"] = usage.ru_nvcsw
+        counters["involuntary_ctxt_switches"] = usage.ru_nivcsw
+        counters["minor_page_faults"] = usage.ru_minflt
+        counters["major_page_faults"] = usage.ru_majflt
+        return counters
+    
+    def attach_mathtrace(self) -> None:
+        """Start recording libm calls, if libcodetango_mathtrace is preloaded."""
+        try:
+            lib = ctypes.CDLL(None)
+            attach = lib.codetango_mathtrace_attach
+            lib.codetango_mathtrace_set_thread.argtypes = [ctypes.c_uint]
+        except (OSError, AttributeError):
+            return
+        
+        attach.restype = ctypes.POINTER(MathFunction)
+        attach.argtypes = [MATHTRACE_SINK, ctypes.c_void_p, ctypes.POINTER(ctypes.c_size_t)]
+        count = ctypes.c_size_t()
+        # Keep a reference to the callback for as long as it is attached
+        self.mathtrace_sink = MATHTRACE_SINK(self.send_math_records)
+        functions = attach(self.mathtrace_sink, None, ctypes.byref(count))
+        self.mathtrace_functions = [
+            [functions[i].name.decode('utf-8'), functions[i].arity] for i in range(count.value)
+        ]
+        self.mathtrace = lib
+    
+    def send_math_records(self, ctx: int, thread: int, records: int, count: int) -> bool:
+        """Send the libm calls recorded by a thread, called by libcodetango_mathtrace.
+        
+        Returns:
+            bool: True if the records were sent
+        """
+        with self.send_lock:
+            if not self.socket:
+                return False
+            data = ctypes.string_at(records, count * MATH_RECORD_SIZE)
+            message = {"mathtrace": thread, "binary": len(data)}
+            if self.mathtrace_functions:
+                message["functions"] = self.mathtrace_functions
+                self.mathtrace_functions = None
+            try:
+                self.send_message(message, [data])
+            except socket.error:
+                # Dropped; the barrier will report the error
+                pass
+            return True
+    
+    def trace_math_thread(self, key: int) -> None:
+        """Compare the libm calls of the calling thread, under a key.
+        
+        With codetango --mathtrace, the calls of the thread that created the
+        Barrier are compared as thread 0. Other threads are compared once
+        they call this, and are paired across the programs by their keys, so
+        give each the same key in both, e.g. the index of a worker. Calls
+        made before are not recorded.
+        
+        Args:
+            key: The key of the thread, unique in the program and 1 or more
+        """
+        if key < 1:
+            raise ValueError("Thread key 0 is the thread that created the Barrier")
+        if self.mathtrace:
+            self.mathtrace.codetango_mathtrace_set_thread(key)
+    
+    def monitor(self, functions: Iterable[str], variables: Iterable[str] = ("*",)) -> None:
+        """Emit a checkpoint automatically at each return of the selected functions.
+        
+        At each return, the arguments the function was called with and its
+        return value ("return") are registered as variables, and wait() is
+        called with the qualified name of the function as the barrier ID,
+        e.g. "Solver.step". Only calls made by the calling thread are
+        checkpointed, and only those that started after monitor(); self and
+        cls are not captured.
+        
+        With sys.monitoring (Python 3.12+), monitoring is disabled on the code
+        of each function that does not match, so unselected code runs at full
+        speed after its first call. Older versions fall back to
+        sys.setprofile(), which cannot tell a return from an exception, so a
+        function left by an exception is checkpointed as returning None.
+        
+        Args:
+            functions: Patterns of the functions to checkpoint, matched against
+                "module.qualname" and "qualname", e.g. "solver.*" or "Solver.step"
+            variables: Patterns of the argument names to capture; "return"
+                matches the return value
+        """
+        self.stop_monitoring()
+        self.monitor_functions = list(functions)
+        self.monitor_variables = list(variables)
+        self.monitor_thread = threading.get_ident()
+        # Code object -> whether it is checkpointed
+        self.monitor_codes: Dict[Any, bool] = {}
+        # Captured arguments of the checkpointed calls in progress, by frame
+        self.monitor_calls: Dict[int, Dict[str, Any]] = {}
+        self.monitor_busy = False
+        
+        monitoring = getattr(sys, "monitoring", None)
+        if monitoring is None:
+            sys.setprofile(self.profile_event)
+            self.monitor_profile = True
+            return
+        
+        tool = next((i for i in range(6) if monitoring.get_tool(i) is None), None)
+        if tool is None:
+            raise RuntimeError("No free sys.monitoring tool ID")
+        monitoring.use_tool_id(tool, "codetango")
+        monitoring.register_callback(tool, monitoring.events.PY_START, self.monitor_start)
+        monitoring.register_callback(tool, monitoring.events.PY_RETURN, self.monitor_return)
+        monitoring.register_callback(tool, monitoring.events.PY_UNWIND, self.monitor_unwind)
+        monitoring.set_events(tool, monitoring.events.PY_START | monitoring.events.PY_RETURN |
+                              monitoring.events.PY_UNWIND)
+        # Code disabled by an earlier monitor() may match the new patterns
+        monitoring.restart_events()
+        self.monitor_tool = tool
+    
+    def stop_monitoring(self) -> None:
+        """Stop emitting automatic checkpoints."""
+        if self.monitor_profile:
+            sys.setprofile(None)
+            self.monitor_profile = False
+        if self.monitor_tool is not None:
+            monitoring = sys.monitoring
+            monitoring.set_events(self.monitor_tool, 0)
+            for event in (monitoring.events.PY_START, monitoring.events.PY_RETURN, monitoring.events.PY_UNWIND):
+                monitoring.register_callback(self.monitor_tool, event, None)
+            monitoring.free_tool_id(self.monitor_tool)
+            self.monitor_tool = None
+    
+    def is_monitored(self, code: Any, frame: Any) -> bool:
+        """Check whether the function of a code object is checkpointed."""
+        monitored = self.monitor_codes.get(code)
+        if monitored is None:
+            module = frame.f_globals.get("__name__", "")
+            qualname = getattr(code, "co_qualname", code.co_name)
+            # The client itself is never checkpointed, so wait() cannot recurse
+            monitored = code.co_filename != __file__ and any(
+                fnmatch.fnmatchcase(f"{module}.{qualname}", pattern) or fnmatch.fnmatchcase(qualname, pattern)
+                for pattern in self.monitor_functions)
+            self.monitor_codes[code] = monitored
+        return monitored
+    
+    def capture_arguments(self, code: Any, frame: Any) -> Dict[str, Any]:
+        """Capture the selected arguments of a call, before the function changes them."""
+        count = code.co_argcount + code.co_kwonlyargcount
+        count += bool(code.co_flags & CO_VARARGS) + bool(code.co_flags & CO_VARKEYWORDS)
+        arguments = {}
+        for name in code.co_varnames[:count]:
+            if name in ("self", "cls") or name not in frame.f_locals:
+                continue
+            if any(fnmatch.fnmatchcase(name, pattern) for pattern in self.monitor_variables):
+                arguments[name] = to_json_value(frame.f_locals[name])
+        return arguments
+    
+    def checkpoint_return(self, code: Any, frame: Any, value: Any) -> None:
+        """Emit the checkpoint of a returning call, unless it started before monitor()."""
+        arguments = self.monitor_calls.pop(id(frame), None)
+        if arguments is None:
+            return
+        self.variables.update(arguments)
+        if any(fnmatch.fnmatchcase("return", pattern) for pattern in self.monitor_variables):
+            self.variables["return"] = to_json_value(value)
+        if self.variable_filter:
+            self.variables = {name: value for name, value in self.variables.items()
+                              if self.variable_filter.enables(name)}
+        self.monitor_busy = True
+        try:
+            self.wait(getattr(code, "co_qualname", code.co_name), f"{os.path.abspath(code.co_filename)}:{code.co_firstlineno}")
+        finally:
+            self.monitor_busy = False
+    
+    def monitor_start(self, code: Any, offset: int) -> Any:
+        """Handle sys.monitoring PY_START: capture the arguments of a checkpointed call."""
+        frame = sys._getframe(1)
+        if not self.is_monitored(code, frame):
+            return sys.monitoring.DISABLE
+        if threading.get_ident() == self.monitor_thread and not self.monitor_busy:
+            self.monitor_calls[id(frame)] = self.capture_arguments(code, frame)
+        return None
+    
+    def monitor_return(self, code: Any, offset: int, value: Any) -> Any:
+        """Handle sys.monitoring PY_RETURN: emit the checkpoint of a call."""
+        frame = sys._getframe(1)
+        if not self.is_monitored(code, frame):
+            return sys.monitoring.DISABLE
+        if threading.get_ident() == self.monitor_thread and not self.monitor_busy:
+            self.checkpoint_return(code, frame, value)
+        return None
+    
+    def monitor_unwind(self, code: Any, offset: int, exception: BaseException) -> None:
+        """Handle sys.monitoring PY_UNWIND: a call left by an exception has no checkpoint."""
+        frame = sys._getframe(1)
+        if (threading.get_ident() == self.monitor_thread and not self.monitor_busy and
+                self.is_monitored(code, frame)):
+            self.monitor_calls.pop(id(frame), None)
+    
+    def profile_event(self, frame: Any, event: str, arg: Any) -> None:
+        """Handle a sys.setprofile() event, the fallback of sys.monitoring."""
+        if event not in ("call", "return") or self.monitor_busy:
+            return
+        code = frame.f_code
+        if not self.is_monitored(code, frame):
+            return
+        if event == "call":
+            self.monitor_calls[id(frame)] = self.capture_arguments(code, frame)
+        else:
+            self.checkpoint_return(code, frame, arg)
+    
+    def take_snapshot(self, snapshot: int, barrier_id: str) -> None:
+        """Fork a snapshot of the program, which the utility can resume after a divergence.
+        
+        The program returns at once. The snapshot opens a connection of its
+        own and waits on it: it exits when the utility closes the connection,
+        or returns from here in place of the program when the utility resumes
+        it, with the environment the utility sends. Only the calling thread
+        is copied.
+        
+        Args:
+            snapshot: The number of the snapshot
+            barrier_id: The ID of the barrier the snapshot is taken at
+        """
+        # Snapshots the utility discarded have exited
+        for pid in list(self.snapshots):
+            try:
+                done, _ = os.waitpid(pid, os.WNOHANG)
+            except ChildProcessError:
+                done = pid
+            if done:
+                self.snapshots.remove(pid)
+        
+        # Output buffered so far belongs to the program only
+        sys.stdout.flush()
+        sys.stderr.flush()
+        
+        pid = os.fork()
+        if pid:
+            self.snapshots.append(pid)
+            return
+        
+        # The connection of the program is shared with the snapshot: leave it alone
+        self.socket.close()
+        self.recv_buffer = b""
+        try:
+            self.connect(snapshot=snapshot, barrier_id=barrier_id, pid=os.getpid())
+            message = self.recv_message()
+        except (RuntimeError, OSError):
+            message = None
+        resume = json.loads(message) if message else {}
+        if not resume.get("resume"):
+            os._exit(0)
+        
+        os.environ.update(resume.get("env", {}))
+        self.rewound = True
+        self.snapshots = []
+    
+    def send_message(self, message: Dict[str, Any], payload: List[Any] = ()) -> None:
+        """Send a newline-terminated JSON message followed by its binary payload.
+        
+        Args:
+            message: The message to send
+            payload: Buffers to send after the message
+        """
+        self.socket.sendall(json.dumps(message).encode('utf-8') + b"\n")
+        for data in payload:
+            self.socket.sendall(data)
+    
+    def recv_message(self) -> Optional[bytes]:
+        """Receive one newline-terminated message from the CodeTango utility.
+        
+        Returns:
+            The message without the trailing newline, or None if the connection was closed
+        """
+        while b"\n" not in self.recv_buffer:
+            data = self.socket.recv(4096)
+            if not data:
+                return None
+            self.recv_buffer += data
+        line, self.recv_buffer = self.recv_buffer.split(b"\n", 1)
+        return line
+    
     def __del__(self) -> None:
         """Close the socket connection when the object is garbage collected."""
+        self.stop_monitoring()
+        if self.mathtrace:
+            self.mathtrace.codetango_mathtrace_detach()
         if self.socket:
             try:
                 self.socket.close()
@@ -0,0 +1,148 @@
+"""
+CodeTango control channel
+
+With --control PATH, the utility listens on a second Unix socket while it
+runs. Each request is a line of JSON, {"command": NAME, ...}, answered by
+a line of JSON; a failed request is answered with {"error": MESSAGE}. The
+commands are served by the parts of the utility they concern, e.g.
+"metrics" by the profiler and "filters" by the coordinator.
+"""
+
+import argparse
+import json
+import os
+import socket
+import sys
+import threading
+from typing import Any, Callable, Dict, List
+
+# Seconds between two checks whether the channel was closed
+CONTROL_POLL_SECONDS = 0.5
+
+# Kinds of filters of the barriers and variables the programs check, each a
+# list of shell-style patterns
+FILTER_KEYS = ("include_barriers", "exclude_barriers", "include_variables", "exclude_variables")
+
+# Handler of a command: the request in, the reply out
+Handler = Callable[[Dict[str, Any]], Dict[str, Any]]
+
+class ControlServer:
+    """Serves the requests of control clients, one connection at a time."""
+
+    def __init__(self, path: str, handlers: Dict[str, Handler]):
+        """Listen on the control socket.
+
+        Args:
+            path: Path of the socket
+            handlers: The handler of each command
+        """
+        self.path = path
+        self.handlers = handlers
+        self.closed = threading.Event()
+        if os.path.exists(path):
+            os.unlink(path)
+        self.server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.server.bind(path)
+        self.server.listen(4)
+        self.server.settimeout(CONTROL_POLL_SECONDS)
+        threading.Thread(target=self.serve, daemon=True).start()
+
+    def serve(self) -> None:
+        """Accept control connections until the channel is closed."""
+        while not self.closed.is_set():
+            try:
+                conn, _ = self.server.accept()
+            except socket.timeout:
+                continue
+            except OSError:
+                break
+            with conn:
+                try:
+                    self.serve_connection(conn)
+                except OSError:
+                    pass
+
+    def serve_connection(self, conn: socket.socket) -> None:
+        """Answer the requests of a connection until it is closed."""
+        conn.settimeout(None)
+        buffer = b""
+        while True:
+            end = buffer.find(b"\n")
+            if end < 0:
+                data = conn.recv(65536)
+                if not data:
+                    return
+                buffer += data
+                continue
+            line, buffer = buffer[:end], buffer[end + 1:]
+            try:
+                message = json.loads(line.decode('utf-8'))
+                handler = self.handlers.get(message.get("command"))
+                if handler is None:
+                    raise ValueError(f"unknown command {message.get('command')!r}, "
+                                     f"expected one of {', '.join(sorted(self.handlers))}")
+                reply = handler(message)
+            except Exception as e:
+                reply = {"error": str(e)}
+            conn.sendall((json.dumps(reply) + "\n").encode('utf-8'))
+
+    def close(self) -> None:
+        """Stop serving and remove the socket."""
+        self.closed.set()
+        self.server.close()
+        if os.path.exists(self.path):
+            os.unlink(self.path)
+
+def request(path: str, message: Dict[str, Any], timeout: float = 10.0) -> Dict[str, Any]:
+    """Send a request to a running utility and wait for its reply.
+
+    Raises:
+        OSError: If the utility does not listen on the socket
+        RuntimeError: If the utility failed to serve the request
+    """
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as conn:
+        conn.settimeout(timeout)
+        conn.connect(path)
+        conn.sendall((json.dumps(message) + "\n").encode('utf-8'))
+        buffer = b""
+        while not buffer.endswith(b"\n"):
+            data = conn.recv(65536)
+            if not data:
+                raise RuntimeError("the utility closed the control connection")
+            buffer += data
+    reply = json.loads(buffer.decode('utf-8'))
+    if "error" in reply:
+        raise RuntimeError(reply["error"])
+    return reply
+
+def format_filters(filters: Dict[str, List[str]]) -> str:
+    """Describe filters, e.g. "include_barriers step*, check; exclude_variables tmp_*"."""
+    kinds = [f"{key} {', '.join(filters[key])}" for key in FILTER_KEYS if filters.get(key)]
+    return "; ".join(kinds) if kinds else "none, all barriers and variables are checked"
+
+def main(argv: List[str]) -> None:
+    """Entry point of "codetango filter"."""
+    parser = argparse.ArgumentParser(
+        prog="codetango filter",
+        description="Show or change which barriers and variables a running utility checks; "
+                    "the programs apply a change from the next barrier on"
+    )
+    parser.add_argument("control", help="The socket given to --control")
+    for key in FILTER_KEYS:
+        action, kind = key.split("_")
+        parser.add_argument(f"--{action}-{kind[:-1]}", dest=key, action="append", metavar="PATTERN",
+                            help=f"{action.capitalize()} the {kind} matching this pattern; replaces the "
+                                 f"patterns of this kind, and may be given several times")
+    parser.add_argument("--reset", action="store_true", help="Remove the patterns of the kinds not given")
+    args = parser.parse_args(argv)
+
+    message: Dict[str, Any] = {"command": "filters"}
+    for key in FILTER_KEYS:
+        if getattr(args, key) is not None or args.reset:
+            message[key] = getattr(args, key) or []
+    try:
+        reply = request(args.control, message)
+    except (OSError, RuntimeError) as e:
+        print(f"Error: {e}")
+        sys.exit(1)
+    print(f"Filters: {format_filters(reply['filters'])}")
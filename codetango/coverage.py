@@ -0,0 +1,252 @@
+"""
+CodeTango coverage index
+
+This module runs a program pair over a corpus of inputs, records the source
+segments between barriers that each input runs through, and selects the
+inputs to rerun after a change from the ranges a unified diff touches.
+"""
+
+import argparse
+import contextlib
+import io
+import json
+import os
+import re
+import shlex
+import sys
+import zlib
+from typing import Dict, Iterable, List, Tuple
+
+# First line of an index file
+INDEX_MAGIC = b"CODETANGO-COVERAGE 1\n"
+
+# A source segment: (program ID, file, first line, last line)
+Segment = Tuple[str, str, int, int]
+
+class CoverageIndex:
+    """The inputs that run through each source segment, as one bitmap per segment.
+
+    Bit i of the bitmap of a segment is set if input i runs through it, so a
+    selection is the OR of the bitmaps of the segments touched by a change.
+    On disk, the bitmaps are compressed separately and only those of the
+    selected segments are read and decompressed.
+
+    File layout:
+        INDEX_MAGIC
+        JSON header line: inputs, names_length, segments [[program, file, first, last, length]]
+        zlib-compressed input names, one per line
+        zlib-compressed bitmap of each segment, in header order
+    """
+
+    def __init__(self):
+        """Initialize an empty index."""
+        self.inputs: List[str] = []
+        self.segments: Dict[Segment, bytearray] = {}
+
+    def add_input(self, name: str, segments: Iterable[Segment]) -> None:
+        """Record the segments an input runs through.
+
+        Args:
+            name: The input
+            segments: The segments
+        """
+        index = len(self.inputs)
+        self.inputs.append(name)
+        size = (index >> 3) + 1
+        for segment in segments:
+            bitmap = self.segments.setdefault(segment, bytearray())
+            if len(bitmap) < size:
+                bitmap.extend(bytes(size - len(bitmap)))
+            bitmap[index >> 3] |= 1 << (index & 7)
+
+    def save(self, path: str) -> None:
+        """Write the index to a file.
+
+        Args:
+            path: The path of the index
+        """
+        names = zlib.compress("\n".join(self.inputs).encode('utf-8'))
+        segments = sorted(self.segments)
+        bitmaps = [zlib.compress(bytes(self.segments[segment])) for segment in segments]
+        header = {
+            "inputs": len(self.inputs),
+            "names_length": len(names),
+            "segments": [[*segment, len(bitmap)] for segment, bitmap in zip(segments, bitmaps)],
+        }
+        with open(path, "wb") as f:
+            f.write(INDEX_MAGIC)
+            f.write(json.dumps(header).encode('utf-8') + b"\n")
+            f.write(names)
+            for bitmap in bitmaps:
+                f.write(bitmap)
+
+    @staticmethod
+    def select(path: str, changes: Dict[str, List[Tuple[int, int]]]) -> List[str]:
+        """Select the inputs running through segments that overlap changed lines.
+
+        Args:
+            path: The path of the index
+            changes: Changed line ranges (first, last) by file, as in the diff
+
+        Returns:
+            The selected inputs, in index order
+        """
+        with open(path, "rb") as f:
+            if f.readline() != INDEX_MAGIC:
+                raise ValueError(f"{path} is not a CodeTango coverage index")
+            header = json.loads(f.readline())
+            names_offset = f.tell()
+            offset = names_offset + header["names_length"]
+
+            selected = 0
+            for program_id, file, first, last, length in header["segments"]:
+                if segment_changed(file, first, last, changes):
+                    f.seek(offset)
+                    selected |= int.from_bytes(zlib.decompress(f.read(length)), "little")
+                offset += length
+
+            if not selected:
+                return []
+            f.seek(names_offset)
+            names = zlib.decompress(f.read(header["names_length"])).decode('utf-8').split("\n")
+
+        bitmap = selected.to_bytes((header["inputs"] + 7) // 8, "little")
+        return [names[(i << 3) + bit] for i, byte in enumerate(bitmap) if byte
+                for bit in range(8) if byte >> bit & 1]
+
+def segment_changed(file: str, first: int, last: int, changes: Dict[str, List[Tuple[int, int]]]) -> bool:
+    """Check whether a segment overlaps a changed range.
+
+    Diff paths are relative to the repository, segment paths are as the
+    programs reported them, so a diff path matches any path it is a suffix of.
+    """
+    for path, ranges in changes.items():
+        if file == path or file.endswith("/" + path):
+            if any(start <= last and end >= first for start, end in ranges):
+                return True
+    return False
+
+def parse_diff(text: str) -> Dict[str, List[Tuple[int, int]]]:
+    """Get the changed line ranges of a unified diff.
+
+    Ranges are line numbers of the old version, which is the version the
+    index was built with. A pure insertion is the line it follows.
+
+    Args:
+        text: The diff, e.g. the output of git diff
+
+    Returns:
+        Changed ranges (first, last) by file
+    """
+    changes: Dict[str, List[Tuple[int, int]]] = {}
+    path = None
+    # Old and new lines left in the current hunk; lines of a hunk that look
+    # like file headers, e.g. a removed "-- comment", are its content
+    old_left = new_left = 0
+    for line in text.splitlines():
+        if old_left > 0 or new_left > 0:
+            if line.startswith("-"):
+                old_left -= 1
+            elif line.startswith("+"):
+                new_left -= 1
+            elif not line.startswith("\\"):
+                old_left -= 1
+                new_left -= 1
+        elif line.startswith("--- "):
+            name = line[4:].split("\t")[0]
+            path = None if name == "/dev/null" else re.sub(r"^a/", "", name)
+        elif line.startswith("+++ ") and path is None:
+            name = line[4:].split("\t")[0]
+            path = None if name == "/dev/null" else re.sub(r"^b/", "", name)
+        elif line.startswith("@@"):
+            match = re.match(r"@@ -(\d+)(?:,(\d+))? \+\d+(?:,(\d+))? @@", line)
+            if match:
+                start, count = int(match.group(1)), int(match.group(2) or 1)
+                old_left, new_left = count, int(match.group(3) or 1)
+                if path:
+                    changes.setdefault(path, []).append((start, start + max(count, 1) - 1))
+    return changes
+
+def read_inputs(path: str) -> List[str]:
+    """Get the inputs of a corpus: the files of a directory, or the lines of a file."""
+    if os.path.isdir(path):
+        return sorted(entry.path for entry in os.scandir(path) if entry.is_file())
+    with open(path) as f:
+        return [line.strip() for line in f if line.strip()]
+
+def input_command(command: str, input_path: str) -> List[str]:
+    """Build the command for an input: {} is replaced by it, or it is appended."""
+    args = shlex.split(command)
+    if not any("{}" in arg for arg in args):
+        return args + [input_path]
+    return [arg.replace("{}", input_path) for arg in args]
+
+def run_batch(program1: str, program2: str, inputs: List[str], index_path: str,
+              timeout: int = 60, verbose: bool = False) -> bool:
+    """Run the program pair on each input and build the coverage index.
+
+    Args:
+        program1: Command of the first program, with {} for the input
+        program2: Command of the second program, with {} for the input
+        inputs: The inputs
+        index_path: The path to write the index to
+        timeout: Timeout in seconds for waiting at barriers
+        verbose: Whether to print the output of each run
+
+    Returns:
+        bool: True if the programs matched on all inputs
+    """
+    from . import CodeTango
+
+    index = CoverageIndex()
+    failed = 0
+    for input_path in inputs:
+        output = io.StringIO()
+        with contextlib.redirect_stdout(sys.stdout if verbose else output):
+            codetango = CodeTango(input_command(program1, input_path), input_command(program2, input_path),
+                                  timeout=timeout, verbose=verbose)
+            passed = codetango.run()
+        index.add_input(input_path, codetango.coverage)
+        failed += not passed
+        print(f"{'pass' if passed else 'FAIL'}  {input_path}  ({len(codetango.coverage)} segments)")
+
+    index.save(index_path)
+    print(f"\n{len(inputs) - failed} of {len(inputs)} inputs passed; "
+          f"{len(index.segments)} segments indexed in {index_path}")
+    return failed == 0
+
+def main_batch(argv: List[str]) -> None:
+    """Entry point of "codetango batch"."""
+    parser = argparse.ArgumentParser(
+        prog="codetango batch",
+        description="Run a program pair over a corpus of inputs and index the source segments each input runs through"
+    )
+    parser.add_argument("--program1", required=True, help="Command of the first program; {} is replaced by the input")
+    parser.add_argument("--program2", required=True, help="Command of the second program; {} is replaced by the input")
+    parser.add_argument("--inputs", required=True, help="Directory of inputs, or a file listing one input per line")
+    parser.add_argument("--index", default="codetango.coverage", help="Path of the index to write (default: codetango.coverage)")
+    parser.add_argument("--timeout", type=int, default=60, help="Timeout in seconds for waiting at barriers (default: 60)")
+    parser.add_argument("--verbose", "-v", action="store_true", help="Print the output of each run")
+    args = parser.parse_args(argv)
+
+    success = run_batch(args.program1, args.program2, read_inputs(args.inputs), args.index,
+                        timeout=args.timeout, verbose=args.verbose)
+    sys.exit(0 if success else 1)
+
+def main_select(argv: List[str]) -> None:
+    """Entry point of "codetango select"."""
+    parser = argparse.ArgumentParser(
+        prog="codetango select",
+        description="Print the inputs whose segments overlap the lines changed by a diff"
+    )
+    parser.add_argument("--index", default="codetango.coverage", help="Path of the index (default: codetango.coverage)")
+    parser.add_argument("--diff", default="-", help="Unified diff against the indexed sources (default: standard input)")
+    args = parser.parse_args(argv)
+
+    if args.diff == "-":
+        text = sys.stdin.read()
+    else:
+        with open(args.diff) as f:
+            text = f.read()
+    for name in CoverageIndex.select(args.index, parse_diff(text)):
+        print(name)
@@ -0,0 +1,230 @@
+"""
+CodeTango localization of differences in grids
+
+A region registered with a shape is a grid of cells in row-major order.
+When the grids of the programs differ, this module finds where: the
+bounding box of the differing cells, their connected regions, and how many
+differ at each index along each axis, so that a difference confined to a
+boundary strip or a halo reads as such instead of as one offset.
+
+Rows along the last axis are compared as whole blocks of memory first, so
+only the rows that differ are visited cell by cell. The differing cells of
+a row form runs, and the connected regions are found by joining the runs
+of neighbouring rows that overlap, so the work grows with the number of
+runs rather than cells.
+"""
+
+from typing import Dict, List, Optional, Sequence, Tuple
+
+from .codetango import DTYPE_FORMATS
+
+# Connected regions and ranges of an axis profile shown per grid
+GRID_REPORT_REGIONS = 5
+GRID_REPORT_RANGES = 6
+
+# Formats comparing the cells of a size bit for bit, like any region
+CELL_FORMATS = {1: "B", 2: "H", 4: "I", 8: "Q"}
+
+# A run of differing cells: row, first and last index along the last axis
+Run = Tuple[int, int, int]
+
+def find_runs(data1: memoryview, data2: memoryview, shape: Sequence[int], size: int) -> List[Run]:
+    """Find the runs of differing cells, row by row."""
+    row_bytes = shape[-1] * size
+    rows = len(data1) // row_bytes if row_bytes else 0
+    fmt = CELL_FORMATS[size]
+    runs = []
+    for row in range(rows):
+        start = row * row_bytes
+        row1 = data1[start:start + row_bytes]
+        row2 = data2[start:start + row_bytes]
+        if row1 == row2:
+            continue
+        first = previous = -2
+        for i, (a, b) in enumerate(zip(row1.cast(fmt), row2.cast(fmt))):
+            if a == b:
+                continue
+            if i != previous + 1:
+                if first >= 0:
+                    runs.append((row, first, previous))
+                first = i
+            previous = i
+        runs.append((row, first, previous))
+    return runs
+
+def row_coordinates(row: int, shape: Sequence[int]) -> List[int]:
+    """Get the indices of a row along the axes before the last."""
+    coordinates = []
+    for extent in reversed(shape[:-1]):
+        row, index = divmod(row, extent)
+        coordinates.append(index)
+    return coordinates[::-1]
+
+def connect_runs(runs: List[Run], shape: Sequence[int]) -> List[List[int]]:
+    """Group runs into regions of cells connected across faces.
+
+    Each run is joined with the overlapping runs of the preceding row along
+    every axis, which sees each pair of neighbouring rows once.
+
+    Returns:
+        The indices of the runs of each region
+    """
+    parent = list(range(len(runs)))
+
+    def find(i: int) -> int:
+        while parent[i] != i:
+            parent[i] = parent[parent[i]]
+            i = parent[i]
+        return i
+
+    # Runs of each row, in order along the row
+    by_row: Dict[int, List[int]] = {}
+    for index, (row, _, _) in enumerate(runs):
+        by_row.setdefault(row, []).append(index)
+
+    strides = [1] * (len(shape) - 1)
+    for axis in range(len(shape) - 3, -1, -1):
+        strides[axis] = strides[axis + 1] * shape[axis + 1]
+
+    for row, indices in by_row.items():
+        coordinates = row_coordinates(row, shape)
+        for axis, stride in enumerate(strides):
+            if coordinates[axis] == 0 or row - stride not in by_row:
+                continue
+            # Both rows list their runs in order: join overlapping ones with two cursors
+            others = by_row[row - stride]
+            i = j = 0
+            while i < len(indices) and j < len(others):
+                _, first1, last1 = runs[indices[i]]
+                _, first2, last2 = runs[others[j]]
+                if first1 <= last2 and first2 <= last1:
+                    root1, root2 = find(indices[i]), find(others[j])
+                    if root1 != root2:
+                        parent[root1] = root2
+                if last1 < last2:
+                    i += 1
+                else:
+                    j += 1
+
+    regions: Dict[int, List[int]] = {}
+    for index in range(len(runs)):
+        regions.setdefault(find(index), []).append(index)
+    return list(regions.values())
+
+def bounding_box(runs: List[Run], indices: Sequence[int], shape: Sequence[int]) -> List[Tuple[int, int]]:
+    """Get the first and last index along each axis of a set of runs."""
+    low = list(shape)
+    high = [-1] * len(shape)
+    for index in indices:
+        row, first, last = runs[index]
+        for axis, coordinate in enumerate(row_coordinates(row, shape) + [first]):
+            low[axis] = min(low[axis], coordinate)
+            high[axis] = max(high[axis], last if axis == len(shape) - 1 else coordinate)
+    return list(zip(low, high))
+
+def format_box(box: List[Tuple[int, int]]) -> str:
+    """Format a box, e.g. "[0..3, 0..1023]"."""
+    return "[" + ", ".join(f"{low}..{high}" if low != high else f"{low}" for low, high in box) + "]"
+
+def axis_profiles(runs: List[Run], shape: Sequence[int]) -> List[Dict[int, int]]:
+    """Count the differing cells at each index along each axis."""
+    profiles: List[Dict[int, int]] = [{} for _ in shape]
+    # Runs start and end along the last axis, whose counts are their prefix sums
+    steps = [0] * (shape[-1] + 1)
+    for row, first, last in runs:
+        cells = last - first + 1
+        for axis, coordinate in enumerate(row_coordinates(row, shape)):
+            profiles[axis][coordinate] = profiles[axis].get(coordinate, 0) + cells
+        steps[first] += 1
+        steps[last + 1] -= 1
+    count = 0
+    for i in range(shape[-1]):
+        count += steps[i]
+        if count:
+            profiles[-1][i] = count
+    return profiles
+
+def format_profile(profile: Dict[int, int]) -> str:
+    """Format an axis profile as ranges of consecutive indices and their cell counts, e.g. "0..3 (4096)"."""
+    ranges: List[List[int]] = []
+    for index in sorted(profile):
+        if ranges and index == ranges[-1][1] + 1:
+            ranges[-1][1] = index
+            ranges[-1][2] += profile[index]
+        else:
+            ranges.append([index, index, profile[index]])
+    parts = [f"{first}..{last} ({cells})" if first != last else f"{first} ({cells})"
+             for first, last, cells in ranges[:GRID_REPORT_RANGES]]
+    if len(ranges) > GRID_REPORT_RANGES:
+        parts.append(f"... {len(ranges) - GRID_REPORT_RANGES} more ranges")
+    return ", ".join(parts)
+
+def largest_difference(data1: memoryview, data2: memoryview, runs: List[Run], shape: Sequence[int],
+                       dtype: str) -> Optional[Tuple[float, int, float, float]]:
+    """Find the differing cell with the largest absolute difference of a numeric grid.
+
+    Returns:
+        The difference, the flat index of the cell and both values, or None for bytes
+    """
+    if dtype == "bytes":
+        return None
+    values1 = data1.cast(DTYPE_FORMATS[dtype])
+    values2 = data2.cast(DTYPE_FORMATS[dtype])
+    best = None
+    for row, first, last in runs:
+        base = row * shape[-1]
+        for i in range(base + first, base + last + 1):
+            difference = abs(values1[i] - values2[i])
+            # NaN against a number is the largest difference there is
+            if difference != difference:
+                difference = float("inf")
+            if best is None or difference > best[0]:
+                best = (difference, i, values1[i], values2[i])
+    return best
+
+def describe_grid_difference(name: str, data1: memoryview, data2: memoryview, shape: Sequence[int],
+                             dtype: str) -> str:
+    """Describe where two differing grids differ.
+
+    Args:
+        name: The name of the grid
+        data1: The cells of program1
+        data2: The cells of program2, of the same size
+        shape: The extent of each axis, slowest first
+        dtype: The element type, see DTYPE_FORMATS
+
+    Returns:
+        The description, one line per finding
+    """
+    size = memoryview(b"").cast(DTYPE_FORMATS[dtype]).itemsize
+    runs = find_runs(data1, data2, shape, size)
+    cells = sum(last - first + 1 for _, first, last in runs)
+    total = len(data1) // size
+    extent = "x".join(str(extent) for extent in shape)
+    lines = [f"Grid '{name}' ({extent} {dtype}) differs in {cells} of {total} cells:",
+             f"  bounding box: {format_box(bounding_box(runs, range(len(runs)), shape))}"]
+
+    regions = connect_runs(runs, shape)
+    sizes = [(sum(runs[i][2] - runs[i][1] + 1 for i in region), region) for region in regions]
+    sizes.sort(key=lambda item: -item[0])
+    lines.append(f"  {len(regions)} connected region{'s' if len(regions) != 1 else ''}:")
+    for region_cells, region in sizes[:GRID_REPORT_REGIONS]:
+        lines.append(f"    {region_cells} cell{'s' if region_cells != 1 else ''} in "
+                     f"{format_box(bounding_box(runs, region, shape))}")
+    if len(regions) > GRID_REPORT_REGIONS:
+        lines.append(f"    ... and {len(regions) - GRID_REPORT_REGIONS} more")
+
+    for axis, profile in enumerate(axis_profiles(runs, shape)):
+        lines.append(f"  differing cells along axis {axis}: {format_profile(profile)}")
+
+    largest = largest_difference(data1, data2, runs, shape, dtype)
+    if largest:
+        _, index, value1, value2 = largest
+        position = []
+        for extent in reversed(shape):
+            index, coordinate = divmod(index, extent)
+            position.append(str(coordinate))
+        lines.append(f"  largest difference: {abs(value1 - value2)!r} at [{', '.join(reversed(position))}]\n"
+                     f"    program1: {value1!r}\n"
+                     f"    program2: {value2!r}")
+    return "\n".join(lines)
@@ -0,0 +1,231 @@
+"""
+CodeTango profiling of the utility itself
+
+When checkpoints pass slowly, this module tells where the utility spends
+its time. Each barrier goes through stages: receiving the message of each
+program, decoding it, waiting for the lock and for the other program,
+comparing the checkpoints, printing the report, feeding the sinks, and
+sending the results. Each stage is timed with the monotonic clock into a
+histogram of four buckets per power of two, which costs a few integer
+operations per sample.
+
+The time each program was blocked at a barrier is also summed per stage
+and barrier: the critical path, which shows whether a slow barrier waits
+for the utility or for the other program.
+"""
+
+import argparse
+import json
+import sys
+import threading
+import time
+from typing import Any, Dict, Iterable, List, Optional, Tuple
+
+from .control import request
+
+# Stages of a barrier in the order a program goes through them
+STAGES = ("receive", "decode", "streams", "lock", "wait", "compare", "report", "sinks", "usage", "send")
+
+# Quantiles given per stage
+PROFILE_QUANTILES = (0.5, 0.9, 0.99)
+
+def bucket_index(ns: int) -> int:
+    """Get the histogram bucket of a duration: exact below 8 ns, then four per power of two."""
+    if ns < 8:
+        return max(ns, 0)
+    shift = ns.bit_length() - 3
+    return 4 * shift + (ns >> shift)
+
+def bucket_limit(index: int) -> int:
+    """Get the longest duration of a histogram bucket."""
+    if index < 8:
+        return index
+    shift = index // 4 - 1
+    return ((index % 4 + 5) << shift) - 1
+
+def format_duration(ns: float) -> str:
+    """Format a duration, e.g. "812 ns", "12.3 µs" or "4.10 ms"."""
+    if ns < 1000:
+        return f"{ns:.0f} ns"
+    if ns < 1000000:
+        return f"{ns / 1000:.1f} µs"
+    if ns < 1000000000:
+        return f"{ns / 1000000:.2f} ms"
+    return f"{ns / 1000000000:.2f} s"
+
+class Histogram:
+    """Durations of a stage in nanoseconds."""
+
+    def __init__(self):
+        self.counts: List[int] = []
+        self.count = 0
+        self.total = 0
+        self.max = 0
+
+    def add(self, ns: int) -> None:
+        """Count a duration."""
+        index = bucket_index(ns)
+        if index >= len(self.counts):
+            self.counts.extend([0] * (index + 1 - len(self.counts)))
+        self.counts[index] += 1
+        self.count += 1
+        self.total += ns
+        self.max = max(self.max, ns)
+
+    def quantile(self, q: float) -> int:
+        """Get an upper bound of the q-quantile, within a quarter of a power of two."""
+        rank = q * self.count
+        seen = 0
+        for index, count in enumerate(self.counts):
+            seen += count
+            if count and seen >= rank:
+                return min(bucket_limit(index), self.max)
+        return self.max
+
+    def metrics(self) -> Dict[str, Any]:
+        """Get the histogram as plain data."""
+        metrics = {"count": self.count, "total_ns": self.total, "max_ns": self.max}
+        for q in PROFILE_QUANTILES:
+            metrics[f"p{q * 100:g}_ns"] = self.quantile(q)
+        metrics["buckets"] = [[bucket_limit(index), count] for index, count in enumerate(self.counts) if count]
+        return metrics
+
+class StageTimer:
+    """Times consecutive stages of the programs at a barrier, and sums them per program."""
+
+    def __init__(self, profiler: "Profiler", programs: Iterable[str]):
+        self.profiler = profiler
+        self.programs = list(programs)
+        self.stages: Dict[str, Dict[str, int]] = {program_id: {} for program_id in self.programs}
+        self.last = time.perf_counter_ns()
+
+    def add(self, stage: str, ns: int, programs: Iterable[str]) -> None:
+        """Record a duration of a stage that blocked some programs."""
+        self.profiler.record(stage, ns)
+        for program_id in programs:
+            stages = self.stages[program_id]
+            stages[stage] = stages.get(stage, 0) + ns
+
+    def lap(self, stage: Optional[str], programs: Optional[Iterable[str]] = None) -> None:
+        """End a stage that started at the end of the previous one.
+
+        Args:
+            stage: The stage, or None to skip the time since the previous stage
+            programs: The programs blocked during the stage (default: all of the timer)
+        """
+        now = time.perf_counter_ns()
+        if stage:
+            self.add(stage, now - self.last, self.programs if programs is None else programs)
+        self.last = now
+
+    def finish(self, barrier_id: str, program_id: str) -> None:
+        """Add the stages of a program released from a barrier to its critical path."""
+        self.profiler.finish(barrier_id, program_id, self.stages.pop(program_id, {}))
+
+class Profiler:
+    """Histograms of the stages of the utility, and the critical path of each barrier."""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.stages = {stage: Histogram() for stage in STAGES}
+        # When the checkpoint of each waiting program arrived, and its stages until then
+        self.arrivals: Dict[str, Tuple[int, Dict[str, int]]] = {}
+        # Times each program was blocked at each barrier: occurrences and totals by stage
+        self.paths: Dict[str, Dict[str, Dict[str, int]]] = {}
+
+    def record(self, stage: str, ns: int) -> None:
+        """Count a duration of a stage."""
+        with self.lock:
+            self.stages[stage].add(ns)
+
+    def start(self, program_id: str, receive_ns: int) -> StageTimer:
+        """Start timing the barrier message of a program once it was received."""
+        timer = StageTimer(self, (program_id,))
+        timer.add("receive", receive_ns, timer.programs)
+        return timer
+
+    def arrive(self, timer: StageTimer) -> None:
+        """Note that the checkpoint of a program waits for the other one; called under the barrier lock."""
+        self.arrivals[timer.programs[0]] = (time.perf_counter_ns(), timer.stages[timer.programs[0]])
+
+    def release(self, programs: Iterable[str]) -> StageTimer:
+        """Start timing the comparison of a barrier, ending the wait of its programs."""
+        timer = StageTimer(self, programs)
+        for program_id in timer.programs:
+            if program_id in self.arrivals:
+                arrival, timer.stages[program_id] = self.arrivals.pop(program_id)
+                timer.add("wait", timer.last - arrival, (program_id,))
+        return timer
+
+    def finish(self, barrier_id: str, program_id: str, stages: Dict[str, int]) -> None:
+        """Add the stages of a program released from a barrier to its critical path."""
+        with self.lock:
+            path = self.paths.setdefault(barrier_id, {}).setdefault(program_id, {"occurrences": 0})
+            path["occurrences"] += 1
+            for stage, ns in stages.items():
+                path[stage] = path.get(stage, 0) + ns
+
+    def metrics(self) -> Dict[str, Any]:
+        """Get the histograms and critical paths as plain data, as served by the control channel."""
+        with self.lock:
+            return {
+                "stages": {stage: histogram.metrics() for stage, histogram in self.stages.items()
+                           if histogram.count},
+                "barriers": {barrier_id: {program_id: dict(path) for program_id, path in paths.items()}
+                             for barrier_id, paths in self.paths.items()},
+            }
+
+def format_metrics(metrics: Dict[str, Any]) -> List[str]:
+    """Format the metrics of a profiler as tables: the stages, and the critical path per barrier."""
+    stages = metrics["stages"]
+    quantiles = [f"p{q * 100:g}" for q in PROFILE_QUANTILES]
+    lines = ["Time of the utility per stage:",
+             f"  {'stage':<10} {'count':>9} {'total':>10} {'mean':>10} "
+             + " ".join(f"{q:>10}" for q in quantiles) + f" {'max':>10}"]
+    for stage in STAGES:
+        if stage not in stages:
+            continue
+        histogram = stages[stage]
+        lines.append(f"  {stage:<10} {histogram['count']:>9} {format_duration(histogram['total_ns']):>10} "
+                     f"{format_duration(histogram['total_ns'] / histogram['count']):>10} "
+                     + " ".join(f"{format_duration(histogram[q + '_ns']):>10}" for q in quantiles)
+                     + f" {format_duration(histogram['max_ns']):>10}")
+
+    barriers = metrics["barriers"]
+    if barriers:
+        used = [stage for stage in STAGES
+                if any(stage in path for paths in barriers.values() for path in paths.values())]
+        lines.append("")
+        lines.append("Critical path per barrier, mean time each program was blocked per occurrence:")
+        lines.append(f"  {'barrier':<20} {'program':<9} {'count':>7} "
+                     + " ".join(f"{stage:>9}" for stage in used) + f" {'total':>9}")
+        for barrier_id, paths in barriers.items():
+            for program_id in sorted(paths):
+                path = paths[program_id]
+                count = path["occurrences"]
+                means = [path.get(stage, 0) / count for stage in used]
+                lines.append(f"  {barrier_id:<20} {program_id:<9} {count:>7} "
+                             + " ".join(f"{format_duration(ns):>9}" for ns in means)
+                             + f" {format_duration(sum(means)):>9}")
+    return lines
+
+def main(argv: List[str]) -> None:
+    """Entry point of "codetango metrics"."""
+    parser = argparse.ArgumentParser(
+        prog="codetango metrics",
+        description="Show where a running utility spends its time, per stage and per barrier"
+    )
+    parser.add_argument("control", help="The socket given to --control")
+    parser.add_argument("--json", action="store_true", help="Print the raw metrics, with the histogram buckets")
+    args = parser.parse_args(argv)
+
+    try:
+        metrics = request(args.control, {"command": "metrics"})
+    except (OSError, RuntimeError) as e:
+        print(f"Error: {e}")
+        sys.exit(1)
+    if args.json:
+        print(json.dumps(metrics, indent=2))
+    else:
+        for line in format_metrics(metrics):
+            print(line)
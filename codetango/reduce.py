@@ -0,0 +1,327 @@
+"""
+CodeTango input reduction
+
+This module minimizes an input on which a program pair diverges: the
+arguments of the programs, their standard input or an input file. It
+applies ddmin, runs the candidates of each round as concurrent program
+pairs, and keeps a candidate if the pair first diverges at the same barrier
+on the same variable as with the original input.
+"""
+
+import argparse
+import contextlib
+import hashlib
+import io
+import os
+import shlex
+import shutil
+import sys
+import tempfile
+import threading
+import time
+from concurrent.futures import FIRST_COMPLETED, Future, ProcessPoolExecutor, wait
+from typing import Dict, List, Optional, Tuple
+
+from .coverage import input_command
+
+# Where a pair first diverged: the barrier, and what differed there, e.g. "Variable 'x'"
+Divergence = Tuple[str, List[str]]
+
+def run_pair(program1_cmd: List[str], program2_cmd: List[str], socket_path: str,
+             stdin: Optional[str], timeout: int) -> Optional[Divergence]:
+    """Run a program pair until it first diverges.
+
+    Runs in a worker process, so the report of the pair is discarded
+    without affecting the pairs running next to it.
+
+    Args:
+        program1_cmd: Command of the first program
+        program2_cmd: Command of the second program
+        socket_path: Path of the socket of this pair
+        stdin: Path of a file to feed to the standard input of both programs
+        timeout: Seconds after which the pair is considered hung and killed
+
+    Returns:
+        The divergence, or None if the programs matched, failed otherwise or hung
+    """
+    from . import CodeTango
+
+    with contextlib.redirect_stdout(io.StringIO()):
+        codetango = CodeTango(program1_cmd, program2_cmd, timeout=timeout,
+                              socket_path=socket_path, stdin=stdin, fail_fast=True)
+        watchdog = threading.Timer(timeout, codetango.stop_programs)
+        watchdog.start()
+        try:
+            codetango.run()
+        except SystemExit:
+            # A program did not connect in time
+            pass
+        finally:
+            watchdog.cancel()
+    return codetango.divergence
+
+def expand_arguments(command: str, arguments: List[str]) -> List[str]:
+    """Build a command for a list of arguments: a {} word is replaced by them, or they are appended."""
+    words = shlex.split(command)
+    if "{}" not in words:
+        return words + arguments
+    index = words.index("{}")
+    return words[:index] + arguments + words[index + 1:]
+
+def split(units: list, n: int) -> List[list]:
+    """Split units into n chunks of nearly equal size."""
+    return [units[len(units) * i // n:len(units) * (i + 1) // n] for i in range(n)]
+
+class Reducer:
+    """ddmin over the units of an input: its lines, its bytes or the program arguments.
+
+    Each round splits the current input into n chunks and tests the chunks,
+    then their complements. The first candidate that reproduces the
+    divergence replaces the input; if none does, the chunks are halved.
+    The reduction ends when no single unit can be removed (1-minimal).
+    Candidates are tested by up to jobs pairs at a time, and no new pair is
+    started in a round once one reproduced.
+    """
+
+    def __init__(self, program1: str, program2: str, mode: str, units: list, suffix: str = "",
+                 jobs: int = 1, timeout: int = 30):
+        """Initialize the reducer.
+
+        Args:
+            program1: Command of the first program
+            program2: Command of the second program
+            mode: What is reduced: "args", "stdin" or "file"
+            units: The units of the original input
+            suffix: File name suffix of candidate inputs, e.g. the extension of the original
+            jobs: Number of pairs run concurrently
+            timeout: Seconds after which a pair is considered hung
+        """
+        self.program1 = program1
+        self.program2 = program2
+        self.mode = mode
+        self.units = units
+        self.suffix = suffix
+        self.jobs = jobs
+        self.timeout = timeout
+
+        # The divergence candidates have to reproduce: barrier and subject
+        self.target: Optional[Tuple[str, str]] = None
+
+        # Whether each tested candidate reproduced, by digest of its content
+        self.results: Dict[bytes, bool] = {}
+        self.tests = 0
+        self.cached = 0
+
+        self.workdir = tempfile.mkdtemp(prefix="codetango-reduce-")
+        self.counter = 0
+        self.executor = ProcessPoolExecutor(max_workers=jobs)
+
+    def close(self) -> None:
+        """Stop the workers and remove the candidate inputs."""
+        self.executor.shutdown()
+        shutil.rmtree(self.workdir, ignore_errors=True)
+
+    def content(self, units: list) -> bytes:
+        """Get the input made of some units."""
+        if self.mode == "args":
+            return b"\0".join(unit.encode('utf-8') for unit in units)
+        return b"".join(units)
+
+    def submit(self, units: list) -> Tuple[Future, Optional[str]]:
+        """Start a pair on a candidate input.
+
+        Returns:
+            The future of the pair, and the candidate file to remove once it is done
+        """
+        self.counter += 1
+        socket_path = os.path.join(self.workdir, f"{self.counter}.sock")
+        if self.mode == "args":
+            commands = (expand_arguments(self.program1, units), expand_arguments(self.program2, units))
+            return self.executor.submit(run_pair, *commands, socket_path, None, self.timeout), None
+
+        path = os.path.join(self.workdir, f"{self.counter}{self.suffix}")
+        with open(path, "wb") as f:
+            f.write(self.content(units))
+        if self.mode == "stdin":
+            commands = (shlex.split(self.program1), shlex.split(self.program2))
+            return self.executor.submit(run_pair, *commands, socket_path, path, self.timeout), path
+        commands = (input_command(self.program1, path), input_command(self.program2, path))
+        return self.executor.submit(run_pair, *commands, socket_path, None, self.timeout), path
+
+    def reproduces(self, divergence: Optional[Divergence]) -> bool:
+        """Check whether a pair first diverged like the original input."""
+        return (divergence is not None and divergence[0] == self.target[0]
+                and self.target[1] in divergence[1])
+
+    def find_divergence(self, subject: Optional[str] = None) -> Optional[Divergence]:
+        """Run the original input and choose the divergence to preserve.
+
+        Args:
+            subject: What has to keep differing, e.g. "Variable 'x'"; by default
+                the first difference at the barrier
+
+        Returns:
+            The divergence of the original input, or None if the programs match on it
+        """
+        future, path = self.submit(self.units)
+        divergence = future.result()
+        if path:
+            os.unlink(path)
+        if divergence is None:
+            return None
+        barrier_id, subjects = divergence
+        if subject is not None and subject not in subjects:
+            raise ValueError(f"Barrier '{barrier_id}' differs in {', '.join(subjects)}, not in {subject}")
+        self.target = (barrier_id, subject or subjects[0])
+        return divergence
+
+    def test(self, candidates: List[list]) -> Optional[int]:
+        """Find a candidate that reproduces the divergence.
+
+        Args:
+            candidates: The candidates, in order of preference
+
+        Returns:
+            The index of the first reproducing candidate among those that ran, or None
+        """
+        queue = []
+        for index, units in enumerate(candidates):
+            digest = hashlib.sha1(self.content(units)).digest()
+            if digest not in self.results:
+                queue.append((index, units, digest))
+                continue
+            self.cached += 1
+            if self.results[digest]:
+                return index
+
+        found = []
+        running: Dict[Future, Tuple[int, bytes, Optional[str]]] = {}
+        while queue or running:
+            while queue and not found and len(running) < self.jobs:
+                index, units, digest = queue.pop(0)
+                future, path = self.submit(units)
+                running[future] = (index, digest, path)
+            if not running:
+                break
+            done, _ = wait(running, return_when=FIRST_COMPLETED)
+            for future in done:
+                index, digest, path = running.pop(future)
+                if path:
+                    os.unlink(path)
+                self.tests += 1
+                self.results[digest] = self.reproduces(future.result())
+                if self.results[digest]:
+                    found.append(index)
+        return min(found) if found else None
+
+    def reduce(self, unit_name: str) -> Tuple[list, int, bool]:
+        """Minimize the input, printing each round.
+
+        Args:
+            unit_name: The name of a unit, for the report
+
+        Returns:
+            The reduced units, the number of rounds, and whether the result is 1-minimal
+        """
+        units = self.units
+        n = 2
+        rounds = 0
+        minimal = len(units) < 2
+        while len(units) >= 2:
+            rounds += 1
+            start = time.time()
+            tests = self.tests
+
+            chunks = split(units, n)
+            # With two chunks, the complement of each is the other
+            complements = [] if n == 2 else [
+                units[:len(units) * i // n] + units[len(units) * (i + 1) // n:] for i in range(n)]
+            found = self.test(chunks + complements)
+
+            if found is None:
+                outcome = "no candidate reproduced"
+            elif found < n:
+                outcome = f"kept chunk {found + 1}"
+            else:
+                outcome = f"kept complement of chunk {found - n + 1}"
+            print(f"Round {rounds:>3}: {len(units):>8} {unit_name}s in {n} chunks, {outcome}; "
+                  f"{self.tests - tests} pairs in {time.time() - start:.1f}s")
+
+            if found is None:
+                if n >= len(units):
+                    minimal = True
+                    break
+                n = min(2 * n, len(units))
+            elif found < n:
+                units = chunks[found]
+                n = 2
+            else:
+                units = complements[found - n]
+                n = max(n - 1, 2)
+        return units, rounds, minimal
+
+def main(argv: List[str]) -> None:
+    """Entry point of "codetango reduce"."""
+    parser = argparse.ArgumentParser(
+        prog="codetango reduce",
+        description="Minimize an input on which a program pair diverges, keeping the first divergent barrier and variable"
+    )
+    parser.add_argument("--program1", required=True, help="Command of the first program; {} is replaced by the input")
+    parser.add_argument("--program2", required=True, help="Command of the second program; {} is replaced by the input")
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument("--file", help="Reduce this input file, passed to the programs as {}")
+    source.add_argument("--stdin", help="Reduce this file, fed to the standard input of the programs")
+    source.add_argument("--args", help="Reduce these arguments, passed to the programs as {}")
+    parser.add_argument("--bytes", action="store_true", help="Reduce files byte by byte instead of line by line")
+    parser.add_argument("--variable", help="What has to keep differing, e.g. \"Variable 'x'\" (default: the first difference)")
+    parser.add_argument("--output", help="Path of the reduced file (default: the input with .reduced appended)")
+    parser.add_argument("--jobs", "-j", type=int, default=max(1, (os.cpu_count() or 1) // 2),
+                        help="Number of program pairs run concurrently (default: one per two cores)")
+    parser.add_argument("--timeout", type=int, default=30,
+                        help="Seconds after which a pair is considered hung and does not reproduce (default: 30)")
+    args = parser.parse_args(argv)
+
+    if args.args is not None:
+        mode, units, unit_name, suffix = "args", shlex.split(args.args), "argument", ""
+    else:
+        mode = "file" if args.file else "stdin"
+        path = args.file or args.stdin
+        with open(path, "rb") as f:
+            data = f.read()
+        if args.bytes:
+            units, unit_name = [data[i:i + 1] for i in range(len(data))], "byte"
+        else:
+            units, unit_name = data.splitlines(keepends=True), "line"
+        suffix = os.path.splitext(path)[1]
+
+    reducer = Reducer(args.program1, args.program2, mode, units, suffix=suffix, jobs=args.jobs, timeout=args.timeout)
+    start = time.time()
+    try:
+        try:
+            divergence = reducer.find_divergence(args.variable)
+        except ValueError as e:
+            print(f"Error: {e}")
+            sys.exit(1)
+        if divergence is None:
+            print("Error: The programs do not diverge on the original input")
+            sys.exit(1)
+        print(f"Divergence at barrier '{reducer.target[0]}': {reducer.target[1]}")
+        print(f"Reducing {len(units)} {unit_name}s with {args.jobs} concurrent pairs\n")
+        reduced, rounds, minimal = reducer.reduce(unit_name)
+    finally:
+        reducer.close()
+
+    share = 100.0 * len(reduced) / len(units) if units else 100.0
+    print(f"\nReduced {len(units)} {unit_name}s to {len(reduced)} ({share:.1f}%) in {rounds} rounds, "
+          f"{time.time() - start:.1f}s")
+    print(f"  {reducer.tests + 1} pairs run, {reducer.cached} candidates already tested")
+    if minimal:
+        print(f"  1-minimal: removing any single {unit_name} loses the divergence")
+
+    if mode == "args":
+        print(f"\nReduced arguments: {shlex.join(reduced)}")
+    else:
+        output = args.output or path + ".reduced"
+        with open(output, "wb") as f:
+            f.write(b"".join(reduced))
+        print(f"\nReduced input written to {output}")
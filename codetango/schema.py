@@ -0,0 +1,321 @@
+"""
+CodeTango checkpoint schemas
+
+A schema lists the variables of each barrier, with fixed types:
+
+    # Checkpoints of the quadratic equation solver
+    barrier coefficients
+        float64 a
+        float64 b
+        float64 c
+    barrier roots
+        int32 count
+        float64[2] x
+
+From a schema, "codetango schema" generates a C++ header with a packed
+struct per barrier and a Python module with struct-based packers. A
+checkpoint is then sent as a fixed-layout binary record, tagged with the
+index of its barrier only; the utility decodes it with the same schema,
+and both programs must have been generated from it, which is checked by
+its hash when they connect.
+"""
+
+import argparse
+import hashlib
+import keyword
+import os
+import re
+import struct
+import sys
+from dataclasses import dataclass, field
+from typing import Any, Dict, List, Tuple
+
+# Field types: struct format code and C++ type
+FIELD_TYPES = {
+    "int8": ("b", "int8_t"),
+    "int16": ("h", "int16_t"),
+    "int32": ("i", "int32_t"),
+    "int64": ("q", "int64_t"),
+    "uint8": ("B", "uint8_t"),
+    "uint16": ("H", "uint16_t"),
+    "uint32": ("I", "uint32_t"),
+    "uint64": ("Q", "uint64_t"),
+    "float32": ("f", "float"),
+    "float64": ("d", "double"),
+    "bool": ("?", "bool"),
+}
+
+IDENTIFIER = r"[A-Za-z_][A-Za-z0-9_]*"
+
+# Names the generated Python class defines besides its variables
+RESERVED_NAMES = {"BARRIER", "NAME", "FORMAT", "pack", "self"}
+
+# Keywords and alternative tokens of C++, which cannot name a variable or namespace
+CPP_KEYWORDS = {
+    "alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor", "bool", "break", "case",
+    "catch", "char", "char8_t", "char16_t", "char32_t", "class", "compl", "concept", "const", "consteval",
+    "constexpr", "constinit", "const_cast", "continue", "co_await", "co_return", "co_yield", "decltype",
+    "default", "delete", "do", "double", "dynamic_cast", "else", "enum", "explicit", "export", "extern",
+    "false", "float", "for", "friend", "goto", "if", "inline", "int", "long", "mutable", "namespace", "new",
+    "noexcept", "not", "not_eq", "nullptr", "operator", "or", "or_eq", "private", "protected", "public",
+    "register", "reinterpret_cast", "requires", "return", "short", "signed", "sizeof", "static",
+    "static_assert", "static_cast", "struct", "switch", "template", "this", "thread_local", "throw", "true",
+    "try", "typedef", "typeid", "typename", "union", "unsigned", "using", "virtual", "void", "volatile",
+    "wchar_t", "while", "xor", "xor_eq", "NULL",
+}
+
+class SchemaError(Exception):
+    """Raised when a schema cannot be parsed."""
+
+@dataclass
+class SchemaField:
+    """A variable of a barrier: a scalar, or a fixed-size array if count is given."""
+    name: str
+    dtype: str
+    count: int = 0
+
+    @property
+    def format(self) -> str:
+        code = FIELD_TYPES[self.dtype][0]
+        return f"{self.count}{code}" if self.count else code
+
+@dataclass
+class BarrierSchema:
+    """The variables of a barrier, in record order."""
+    name: str
+    index: int
+    fields: List[SchemaField] = field(default_factory=list)
+
+    @property
+    def struct(self) -> struct.Struct:
+        # Native byte order without padding, as #pragma pack(1) in C++
+        return struct.Struct("=" + "".join(f.format for f in self.fields))
+
+    @property
+    def type_name(self) -> str:
+        """The name of the generated type, e.g. Coefficients for barrier coefficients."""
+        return "".join(part[:1].upper() + part[1:] for part in self.name.split("_") if part)
+
+class Schema:
+    """A parsed schema."""
+
+    def __init__(self, barriers: List[BarrierSchema]):
+        self.barriers = barriers
+        self.structs = [barrier.struct for barrier in barriers]
+
+    @classmethod
+    def parse(cls, text: str) -> "Schema":
+        """Parse the text of a schema.
+
+        Raises:
+            SchemaError: If the schema is malformed
+        """
+        barriers: List[BarrierSchema] = []
+        for number, line in enumerate(text.splitlines(), 1):
+            line = line.split("#", 1)[0].strip()
+            if not line:
+                continue
+            match = re.fullmatch(rf"barrier\s+({IDENTIFIER})", line)
+            if match:
+                if any(barrier.name == match.group(1) for barrier in barriers):
+                    raise SchemaError(f"line {number}: barrier {match.group(1)} is declared twice")
+                barrier = BarrierSchema(match.group(1), len(barriers))
+                if not re.fullmatch(IDENTIFIER, barrier.type_name) or keyword.iskeyword(barrier.type_name):
+                    raise SchemaError(f"line {number}: barrier {barrier.name} gives no valid type name "
+                                      f"'{barrier.type_name}'")
+                other = next((b for b in barriers if b.type_name == barrier.type_name), None)
+                if other:
+                    raise SchemaError(f"line {number}: barriers {other.name} and {barrier.name} "
+                                      f"both give type {barrier.type_name}")
+                barriers.append(barrier)
+                continue
+            match = re.fullmatch(rf"(\w+)(?:\[(\d+)\])?\s+({IDENTIFIER})", line)
+            if not match:
+                raise SchemaError(f"line {number}: expected 'barrier NAME' or 'TYPE NAME', got '{line}'")
+            dtype, count, name = match.group(1), int(match.group(2) or 0), match.group(3)
+            if not barriers:
+                raise SchemaError(f"line {number}: variable {name} is outside of a barrier")
+            if dtype not in FIELD_TYPES:
+                raise SchemaError(f"line {number}: unknown type {dtype}; use one of {', '.join(FIELD_TYPES)}")
+            if match.group(2) is not None and count == 0:
+                raise SchemaError(f"line {number}: array {name} is empty")
+            if keyword.iskeyword(name) or name in RESERVED_NAMES or (name.startswith("__") and name.endswith("__")):
+                raise SchemaError(f"line {number}: variable name {name} is reserved in the generated Python module")
+            if name in CPP_KEYWORDS:
+                raise SchemaError(f"line {number}: variable name {name} is a C++ keyword")
+            if any(f.name == name for f in barriers[-1].fields):
+                raise SchemaError(f"line {number}: variable {name} is declared twice")
+            barriers[-1].fields.append(SchemaField(name, dtype, count))
+        return cls(barriers)
+
+    @classmethod
+    def load(cls, path: str) -> "Schema":
+        """Parse a schema file."""
+        with open(path) as f:
+            try:
+                return cls.parse(f.read())
+            except SchemaError as e:
+                raise SchemaError(f"{path}, {e}") from None
+
+    @property
+    def hash(self) -> str:
+        """The hash of the record layouts, independent of comments and formatting."""
+        canonical = "".join(
+            f"barrier {barrier.name}\n" + "".join(f"{f.dtype}[{f.count}] {f.name}\n" for f in barrier.fields)
+            for barrier in self.barriers)
+        return hashlib.sha256(canonical.encode('utf-8')).hexdigest()[:16]
+
+    def decode(self, index: int, payload: memoryview) -> Tuple[str, Dict[str, Any]]:
+        """Decode a record into the barrier ID and variables of a checkpoint.
+
+        Arrays become lists, as sent by add_list() or add_double_vector().
+
+        Raises:
+            ValueError: If the record does not match the schema
+        """
+        if not 0 <= index < len(self.barriers):
+            raise ValueError(f"record of barrier #{index}, but the schema has {len(self.barriers)} barriers")
+        barrier = self.barriers[index]
+        record = self.structs[index]
+        if len(payload) != record.size:
+            raise ValueError(f"record of barrier '{barrier.name}' has {len(payload)} bytes instead of {record.size}")
+        values = record.unpack(payload)
+        variables = {}
+        position = 0
+        for f in barrier.fields:
+            if f.count:
+                variables[f.name] = list(values[position:position + f.count])
+                position += f.count
+            else:
+                variables[f.name] = values[position]
+                position += 1
+        return barrier.name, variables
+
+def generate_cpp(schema: Schema, namespace: str, source: str) -> str:
+    """Generate the C++ header of a schema.
+
+    Args:
+        schema: The schema
+        namespace: The namespace of the generated code
+        source: The name of the schema file, for the header comment
+    """
+    guard = f"CODETANGO_SCHEMA_{namespace.upper()}_H"
+    lines = [
+        f"// Generated by codetango schema from {source}; do not edit",
+        f"#ifndef {guard}",
+        f"#define {guard}",
+        "",
+        "#include <codetango.h>",
+        "#include <cstdint>",
+        "",
+        f"namespace {namespace} {{",
+        "",
+        "// Checked by the utility when the program connects",
+        f"const char* const SCHEMA_HASH = \"{schema.hash}\";",
+        "",
+        "#pragma pack(push, 1)",
+    ]
+    for barrier in schema.barriers:
+        lines += ["", "/**", f" * Checkpoint of barrier '{barrier.name}'", " */", f"struct {barrier.type_name} {{"]
+        for f in barrier.fields:
+            lines.append(f"    {FIELD_TYPES[f.dtype][1]} {f.name}{f'[{f.count}]' if f.count else ''};")
+        lines.append("};")
+    lines += ["", "#pragma pack(pop)"]
+    for barrier in schema.barriers:
+        lines += [
+            "",
+            f"static_assert(sizeof({barrier.type_name}) == {barrier.struct.size}, "
+            f"\"{barrier.type_name} does not match the schema layout\");",
+            "",
+            "/**",
+            f" * Wait at barrier '{barrier.name}' with a checkpoint",
+            " * ",
+            " * @param barrier The barrier, constructed with SCHEMA_HASH",
+            " * @param record The values of the variables",
+            " * @return true if the barrier was successfully synchronized",
+            " */",
+            f"inline bool wait(codetango::Barrier& barrier, const {barrier.type_name}& record) {{",
+            f"    return barrier.wait_record({barrier.index}, \"{barrier.name}\", &record, sizeof(record));",
+            "}",
+        ]
+    lines += ["", f"}} // namespace {namespace}", "", f"#endif // {guard}", ""]
+    return "\n".join(lines)
+
+def generate_python(schema: Schema, source: str) -> str:
+    """Generate the Python module of a schema.
+
+    Args:
+        schema: The schema
+        source: The name of the schema file, for the module docstring
+    """
+    lines = [
+        f'"""Generated by codetango schema from {source}; do not edit."""',
+        "",
+        "import struct",
+        "",
+        "# Checked by the utility when the program connects",
+        f'SCHEMA_HASH = "{schema.hash}"',
+    ]
+    for barrier in schema.barriers:
+        names = [f.name for f in barrier.fields]
+        arguments = ", ".join(f"*self.{f.name}" if f.count else f"self.{f.name}" for f in barrier.fields)
+        defaults = ", ".join(
+            f"{f.name}={'()' if f.count else 'False' if f.dtype == 'bool' else '0.0' if f.dtype.startswith('float') else '0'}"
+            for f in barrier.fields)
+        lines += [
+            "",
+            f"class {barrier.type_name}:",
+            f'    """Checkpoint of barrier \'{barrier.name}\'."""',
+            f"    BARRIER = {barrier.index}",
+            f'    NAME = "{barrier.name}"',
+            f'    FORMAT = struct.Struct("{barrier.struct.format}")',
+            f"    __slots__ = {tuple(names)!r}",
+            "",
+            f"    def __init__(self{', ' + defaults if defaults else ''}):",
+        ]
+        lines += [f"        self.{name} = {name}" for name in names] or ["        pass"]
+        lines += [
+            "",
+            "    def pack(self) -> bytes:",
+            f"        return self.FORMAT.pack({arguments})",
+        ]
+    lines += [
+        "",
+        "def wait(barrier, record) -> bool:",
+        '    """Wait at the barrier of a checkpoint; the barrier is constructed with SCHEMA_HASH."""',
+        "    return barrier.wait_record(record.BARRIER, record.NAME, record.pack())",
+        "",
+    ]
+    return "\n".join(lines)
+
+def main(argv: List[str]) -> None:
+    """Entry point of "codetango schema"."""
+    parser = argparse.ArgumentParser(
+        prog="codetango schema",
+        description="Generate packed checkpoint serializers for C++ and Python from a schema"
+    )
+    parser.add_argument("schema", help="The schema file")
+    parser.add_argument("--cpp", metavar="HEADER", help="Write the C++ header to this path")
+    parser.add_argument("--python", metavar="MODULE", help="Write the Python module to this path")
+    parser.add_argument("--namespace", help="C++ namespace of the generated code (default: the schema file name)")
+    args = parser.parse_args(argv)
+
+    try:
+        schema = Schema.load(args.schema)
+    except (OSError, SchemaError) as e:
+        print(f"Error: {e}")
+        sys.exit(1)
+
+    source = os.path.basename(args.schema)
+    namespace = args.namespace or re.sub(r"\W", "_", os.path.splitext(source)[0])
+    if args.cpp and (not re.fullmatch(IDENTIFIER, namespace) or namespace in CPP_KEYWORDS):
+        print(f"Error: '{namespace}' is not a valid C++ namespace; use --namespace")
+        sys.exit(1)
+    if args.cpp:
+        with open(args.cpp, "w") as f:
+            f.write(generate_cpp(schema, namespace, source))
+    if args.python:
+        with open(args.python, "w") as f:
+            f.write(generate_python(schema, source))
+    print(f"Schema {schema.hash}: {len(schema.barriers)} barriers, "
+          f"{sum(len(barrier.fields) for barrier in schema.barriers)} variables")
@@ -0,0 +1,472 @@
+"""
+CodeTango shadow traffic
+
+This module replays a recorded request log to two versions of a service at a
+controlled rate, compares their responses, matches the checkpoints they emit
+while handling each request, and reports the latency of both versions per
+request and per segment between checkpoints.
+"""
+
+import argparse
+import csv
+import ipaddress
+import json
+import os
+import shlex
+import socket
+import sys
+import threading
+import time
+from concurrent.futures import ThreadPoolExecutor
+from dataclasses import dataclass, field
+from typing import Any, Dict, List, Optional, Tuple
+
+from . import CodeTango, Checkpoint, MessageReader, encode_message
+
+# Programs of a shadow run, in report order
+PROGRAMS = ("program1", "program2")
+
+# State of a listening socket in /proc/net/tcp, and flag of one in /proc/net/unix
+TCP_LISTEN = "0A"
+UNIX_ACCEPTCON = 0x10000
+
+@dataclass
+class ShadowRequest:
+    """A request of the log and what both servers made of it."""
+    request_id: str
+    payload: bytes
+    # Per program: send time, latency in seconds, response and error
+    sent: Dict[str, float] = field(default_factory=dict)
+    latency: Dict[str, float] = field(default_factory=dict)
+    response: Dict[str, bytes] = field(default_factory=dict)
+    error: Dict[str, str] = field(default_factory=dict)
+    # Per program: arrival time of each checkpoint of the request, by name
+    checkpoints: Dict[str, List[Tuple[str, float]]] = field(default_factory=dict)
+
+def read_request_log(path: str) -> List[ShadowRequest]:
+    """Read a request log.
+
+    Each line is a JSON object with the request "payload" as a string and an
+    optional "id"; without an id, the line number is used.
+
+    Args:
+        path: The path of the log
+
+    Returns:
+        The requests, in log order
+    """
+    requests = []
+    with open(path) as f:
+        for number, line in enumerate(f, 1):
+            if not line.strip():
+                continue
+            entry = json.loads(line)
+            request_id = str(entry.get("id", number))
+            requests.append(ShadowRequest(request_id, entry["payload"].encode('utf-8')))
+    return requests
+
+def parse_address(address: str) -> Tuple[int, Any]:
+    """Parse a server address: HOST:PORT for TCP, or the path of a Unix socket.
+
+    Returns:
+        The socket family and address
+    """
+    host, _, port = address.rpartition(":")
+    if host and port.isdigit():
+        return socket.AF_INET, (host, int(port))
+    return socket.AF_UNIX, address
+
+def listening(pid: int, family: int, address: Any) -> bool:
+    """Check whether a socket listens at an address, without connecting to it.
+
+    The listening sockets of the network namespace of the process are read
+    from /proc, so the servers see no connection before the first request.
+
+    Args:
+        pid: A process in the network namespace of the server
+        family: The socket family, as returned by parse_address()
+        address: The address, as returned by parse_address()
+    """
+    try:
+        if family == socket.AF_UNIX:
+            with open(f"/proc/{pid}/net/unix") as f:
+                next(f)
+                for line in f:
+                    fields = line.split()
+                    if (len(fields) >= 8 and int(fields[3], 16) & UNIX_ACCEPTCON
+                            and (fields[7] == address or os.path.abspath(fields[7]) == os.path.abspath(address))):
+                        return True
+            return False
+
+        host, port = address
+        hosts = {ipaddress.ip_address(info[4][0].split("%")[0])
+                 for info in socket.getaddrinfo(host, port, type=socket.SOCK_STREAM)}
+        for table in ("tcp", "tcp6"):
+            with open(f"/proc/{pid}/net/{table}") as f:
+                next(f)
+                for line in f:
+                    fields = line.split()
+                    local, state = fields[1], fields[3]
+                    if state != TCP_LISTEN:
+                        continue
+                    hex_host, hex_port = local.split(":")
+                    if int(hex_port, 16) != port:
+                        continue
+                    # Addresses are printed as 32-bit words in host byte order
+                    packed = b"".join(bytes.fromhex(hex_host[i:i + 8])[::-1] for i in range(0, len(hex_host), 8))
+                    bound = ipaddress.ip_address(packed)
+                    if bound.is_unspecified or bound in hosts or getattr(bound, "ipv4_mapped", None) in hosts:
+                        return True
+    except (OSError, ValueError, StopIteration):
+        pass
+    return False
+
+def percentile(values: List[float], fraction: float) -> float:
+    """Get a percentile of a list of values, by the nearest rank."""
+    ordered = sorted(values)
+    return ordered[min(int(fraction * len(ordered)), len(ordered) - 1)]
+
+class ShadowTraffic(CodeTango):
+    """Replays a request log to two servers and compares how they handle it.
+
+    Unlike a program pair, the servers do not wait for each other at
+    checkpoints: each checkpoint is acknowledged on arrival and compared once
+    the other server has reached the checkpoint of the same ID, in any order.
+    Servers name their checkpoints "<request id>:<name>", taking the request
+    id from the request, and may open one Barrier per handler thread.
+    """
+
+    def __init__(self, program1_cmd: List[str], program2_cmd: List[str],
+                 server1: str, server2: str, requests: List[ShadowRequest],
+                 rate: float = 10.0, concurrency: int = 4, timeout: int = 60,
+                 verbose: bool = False, latency_csv: Optional[str] = None):
+        """Initialize the shadow run.
+
+        Args:
+            program1_cmd: Command to launch the first server
+            program2_cmd: Command to launch the second server
+            server1: Address the first server listens at
+            server2: Address the second server listens at
+            requests: The requests to replay
+            rate: Requests sent per second
+            concurrency: Requests in flight per server at most
+            timeout: Timeout in seconds for server startup and each request
+            verbose: Whether to print verbose output
+            latency_csv: Path of a CSV file to write the latency of each request to
+        """
+        super().__init__(program1_cmd, program2_cmd, timeout=timeout, verbose=verbose)
+        self.addresses = {"program1": parse_address(server1), "program2": parse_address(server2)}
+        self.requests = requests
+        self.requests_by_id = {request.request_id: request for request in requests}
+        self.rate = rate
+        self.concurrency = concurrency
+        self.latency_csv = latency_csv
+
+        # Checkpoint connections, opened by the servers as they need them
+        self.connections: List[socket.socket] = []
+        self.matched = 0
+        self.differing = 0
+
+        # Servers may open a connection per handler thread
+        self.server.listen(128)
+
+    def accept_connections(self) -> None:
+        """Accept checkpoint connections from the servers for the whole run."""
+        thread = threading.Thread(target=self.accept_loop, daemon=True)
+        thread.start()
+
+    def accept_loop(self) -> None:
+        """Accept checkpoint connections until the socket is closed."""
+        self.server.settimeout(None)
+        while True:
+            try:
+                conn, _ = self.server.accept()
+            except OSError:
+                return
+            self.connections.append(conn)
+            threading.Thread(target=self.handle_connection, args=(conn,), daemon=True).start()
+
+    def handle_connection(self, conn: socket.socket) -> None:
+        """Handle the checkpoints sent over one connection of a server.
+
+        Args:
+            conn: The socket connection
+        """
+        reader = MessageReader(conn)
+        try:
+            received = reader.read_message()
+            if not received or received[0].get("program_id") not in PROGRAMS:
+                conn.close()
+                return
+            program_id = received[0]["program_id"]
+
+            while True:
+                received = reader.read_message()
+                if not received:
+                    return
+                message, payload = received
+                # Only plain checkpoints are compared in shadow mode
+                if "barrier_id" not in message:
+                    continue
+                self.receive_checkpoint(program_id, message, payload)
+                conn.sendall(encode_message({"status": "success", "message": "Checkpoint recorded"}))
+        except (OSError, json.JSONDecodeError) as e:
+            if self.verbose:
+                print(f"Checkpoint connection closed: {e}")
+
+    def receive_checkpoint(self, program_id: str, message: Dict[str, Any], payload: memoryview) -> None:
+        """Record a checkpoint and compare it once both servers reached it.
+
+        Args:
+            program_id: The ID of the server
+            message: The checkpoint message
+            payload: Its binary payload
+        """
+        arrival = time.monotonic()
+        barrier_id = message["barrier_id"]
+        checkpoint = Checkpoint.from_message(message, payload)
+
+        with self.lock:
+            request_id, _, name = barrier_id.rpartition(":")
+            request = self.requests_by_id.get(request_id)
+            if request is not None:
+                request.checkpoints.setdefault(program_id, []).append((name, arrival))
+
+            pending = self.barriers.setdefault(barrier_id, {})
+            if program_id in pending:
+                print(f"Warning: {program_id} reached checkpoint '{barrier_id}' twice")
+            pending[program_id] = checkpoint
+            if len(pending) == 2:
+                if self.compare_variables(barrier_id):
+                    self.matched += 1
+                else:
+                    self.differing += 1
+                del self.barriers[barrier_id]
+
+    def wait_for_servers(self) -> None:
+        """Wait until both servers listen, without sending them a connection.
+
+        Raises:
+            RuntimeError: If a server exits or does not listen within the timeout
+        """
+        deadline = time.monotonic() + self.timeout
+        for program_id in PROGRAMS:
+            family, address = self.addresses[program_id]
+            process = self.programs[program_id].process
+            while not listening(process.pid, family, address):
+                if process.poll() is not None:
+                    raise RuntimeError(f"{program_id} exited before accepting connections")
+                if time.monotonic() > deadline:
+                    raise RuntimeError(f"{program_id} does not listen at {address}")
+                time.sleep(0.05)
+
+    def send_request(self, program_id: str, request: ShadowRequest) -> None:
+        """Send a request to a server and read the whole response.
+
+        The request is written and the sending side shut down; the response
+        is everything the server sends until it closes the connection.
+
+        Args:
+            program_id: The ID of the server
+            request: The request
+        """
+        family, address = self.addresses[program_id]
+        start = time.monotonic()
+        request.sent[program_id] = start
+        try:
+            with socket.socket(family, socket.SOCK_STREAM) as s:
+                s.settimeout(self.timeout)
+                s.connect(address)
+                s.sendall(request.payload)
+                s.shutdown(socket.SHUT_WR)
+                chunks = []
+                while True:
+                    data = s.recv(65536)
+                    if not data:
+                        break
+                    chunks.append(data)
+            request.latency[program_id] = time.monotonic() - start
+            request.response[program_id] = b"".join(chunks)
+        except OSError as e:
+            request.error[program_id] = str(e)
+
+    def replay(self) -> None:
+        """Send the requests to both servers at the configured rate.
+
+        Each server has its own pool of workers, so a slow server does not
+        delay the requests sent to the other one; when a server already has
+        the maximum number of requests in flight, sending pauses.
+        """
+        pools = {program_id: ThreadPoolExecutor(max_workers=self.concurrency) for program_id in PROGRAMS}
+        slots = {program_id: threading.Semaphore(self.concurrency) for program_id in PROGRAMS}
+
+        def send(program_id: str, request: ShadowRequest) -> None:
+            try:
+                self.send_request(program_id, request)
+            finally:
+                slots[program_id].release()
+
+        start = time.monotonic()
+        for index, request in enumerate(self.requests):
+            delay = start + index / self.rate - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+            for program_id in PROGRAMS:
+                slots[program_id].acquire()
+                pools[program_id].submit(send, program_id, request)
+            if self.verbose:
+                print(f"Sent request {request.request_id}")
+
+        for pool in pools.values():
+            pool.shutdown(wait=True)
+
+    def settle(self) -> None:
+        """Wait briefly for checkpoints sent after the last responses."""
+        deadline = time.monotonic() + 1.0
+        while time.monotonic() < deadline:
+            with self.lock:
+                if not self.barriers:
+                    return
+            time.sleep(0.05)
+
+    def segment_latencies(self, request: ShadowRequest, program_id: str) -> List[Tuple[str, float]]:
+        """Get the time a server spent in each segment of a request.
+
+        The first segment starts when the request is sent, and the last one,
+        "response", ends when the whole response is received.
+
+        Returns:
+            (segment name, seconds) in order
+        """
+        if program_id not in request.latency:
+            return []
+        segments = []
+        previous = request.sent[program_id]
+        for name, arrival in sorted(request.checkpoints.get(program_id, []), key=lambda c: c[1]):
+            segments.append((name, arrival - previous))
+            previous = arrival
+        segments.append(("response", request.sent[program_id] + request.latency[program_id] - previous))
+        return segments
+
+    def report(self) -> bool:
+        """Print the comparison and latency report.
+
+        Returns:
+            bool: True if all responses and checkpoints match
+        """
+        identical = sum(1 for r in self.requests
+                        if not r.error and r.response.get("program1") == r.response.get("program2"))
+        failed = [r for r in self.requests if r.error]
+        differ = [r for r in self.requests if not r.error and r.response.get("program1") != r.response.get("program2")]
+
+        print(f"\nShadow traffic: {len(self.requests)} requests at {self.rate:g}/s, "
+              f"concurrency {self.concurrency}")
+        print(f"Responses: {identical} identical, {len(differ)} differ, {len(failed)} failed")
+        for request in differ[:10]:
+            print(f"  - Request {request.request_id}:\n"
+                  f"      program1: {request.response['program1'][:80]!r}\n"
+                  f"      program2: {request.response['program2'][:80]!r}")
+        for request in failed[:10]:
+            for program_id, error in sorted(request.error.items()):
+                print(f"  - Request {request.request_id} failed on {program_id}: {error}")
+
+        unmatched = sorted(self.barriers)
+        print(f"Checkpoints: {self.matched} match, {self.differing} differ, {len(unmatched)} unmatched")
+        for barrier_id in unmatched[:10]:
+            print(f"  - '{barrier_id}' was only reached by {', '.join(sorted(self.barriers[barrier_id]))}")
+
+        # Latency by segment name, over all requests
+        latencies: Dict[str, Dict[str, List[float]]] = {}
+        for request in self.requests:
+            for program_id in PROGRAMS:
+                if program_id in request.latency:
+                    latencies.setdefault("request", {}).setdefault(program_id, []).append(
+                        request.latency[program_id])
+                for name, seconds in self.segment_latencies(request, program_id):
+                    latencies.setdefault(name, {}).setdefault(program_id, []).append(seconds)
+
+        if latencies:
+            print(f"\n{'Latency (ms):':<24}" + "".join(
+                f"{program_id + ' ' + column:>16}" for program_id in PROGRAMS for column in ("p50", "p95", "max")))
+            for name in ["request"] + [n for n in latencies if n not in ("request", "response")] + ["response"]:
+                if name not in latencies:
+                    continue
+                label = name if name == "request" else "-> " + name
+                cells = []
+                for program_id in PROGRAMS:
+                    values = latencies[name].get(program_id)
+                    for fraction in (0.5, 0.95, 1.0):
+                        cells.append(f"{percentile(values, fraction) * 1e3:.2f}" if values else "-")
+                print(f"  {label:<22}" + "".join(f"{cell:>16}" for cell in cells))
+
+        if self.latency_csv:
+            with open(self.latency_csv, "w", newline="") as f:
+                writer = csv.writer(f)
+                writer.writerow(["request_id", "program1_ms", "program2_ms", "response_match"])
+                for request in self.requests:
+                    writer.writerow([
+                        request.request_id,
+                        *(f"{request.latency[p] * 1e3:.3f}" if p in request.latency else "" for p in PROGRAMS),
+                        int(not request.error and request.response.get("program1") == request.response.get("program2")),
+                    ])
+
+        return not differ and not failed and not unmatched and self.differing == 0
+
+    def run(self) -> bool:
+        """Run the shadow traffic.
+
+        Returns:
+            bool: True if both servers handled all requests alike
+        """
+        try:
+            self.launch_programs()
+            self.accept_connections()
+            self.wait_for_servers()
+            self.replay()
+            self.settle()
+            return self.report()
+        except RuntimeError as e:
+            print(f"Error: {e}")
+            return False
+        except KeyboardInterrupt:
+            print("\nInterrupted by user")
+            return False
+        finally:
+            for conn in self.connections:
+                try:
+                    conn.close()
+                except OSError:
+                    pass
+            self.cleanup()
+
+def main(argv: List[str]) -> None:
+    """Entry point of "codetango shadow"."""
+    parser = argparse.ArgumentParser(
+        prog="codetango shadow",
+        description="Replay a request log to two versions of a service and compare how they handle it"
+    )
+    parser.add_argument("--program1", required=True, help="Command to start the first server, e.g. './server-old --port 9001'")
+    parser.add_argument("--program2", required=True, help="Command to start the second server")
+    parser.add_argument("--server1", required=True, help="Address of the first server: HOST:PORT or a Unix socket path")
+    parser.add_argument("--server2", required=True, help="Address of the second server")
+    parser.add_argument("--log", required=True, help="Request log: one JSON object per line with \"payload\" and optional \"id\"")
+    parser.add_argument("--rate", type=float, default=10.0, help="Requests per second (default: 10)")
+    parser.add_argument("--concurrency", type=int, default=4, help="Requests in flight per server at most (default: 4)")
+    parser.add_argument("--timeout", type=int, default=60, help="Timeout in seconds for server startup and each request (default: 60)")
+    parser.add_argument("--latency-csv", metavar="FILE", help="Write the latency of each request to a CSV file")
+    parser.add_argument("--verbose", "-v", action="store_true", help="Print verbose output")
+    args = parser.parse_args(argv)
+
+    shadow = ShadowTraffic(
+        program1_cmd=shlex.split(args.program1),
+        program2_cmd=shlex.split(args.program2),
+        server1=args.server1,
+        server2=args.server2,
+        requests=read_request_log(args.log),
+        rate=args.rate,
+        concurrency=args.concurrency,
+        timeout=args.timeout,
+        verbose=args.verbose,
+        latency_csv=args.latency_csv
+    )
+    sys.exit(0 if shadow.run() else 1)
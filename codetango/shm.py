@@ -0,0 +1,329 @@
+"""
+CodeTango shared-memory checkpoint stream
+
+This module publishes the compared checkpoints of a run to a ring buffer in
+shared memory, for analysis and visualization tools attached to a running
+session, and reads it back. The utility is the only writer and never waits
+for the readers: a reader that falls behind by more than the ring size
+loses the oldest records and counts them as dropped.
+
+Layout of /dev/shm/<name>, in native byte order:
+    header, RING_HEADER_SIZE bytes:
+        magic, capacity, head, tail, records, closed (8 bytes each)
+    data, capacity bytes: records at positions modulo capacity
+
+head is the position after the last published record, and tail the
+position of the oldest record that has not been overwritten. Positions
+only grow. A reader copies a record, then checks that tail has not passed
+it meanwhile; the writer moves tail before it overwrites anything.
+
+A record is a 16-byte frame (size of the whole record, kind, sequence
+number) followed by its body:
+    occurrence (8), matched (4), array count (4), barrier ID bytes (4),
+    metadata bytes (4), barrier ID, metadata JSON, array descriptors,
+    array data
+The metadata holds the scalar variables of each program; raw regions and
+numeric lists are arrays. An array descriptor is offset and size of its
+data in the body (8 each), dtype (1), program number (1), name bytes (2),
+4 reserved bytes, then the name. Strings and arrays are padded to 8 bytes.
+"""
+
+import argparse
+import json
+import mmap
+import os
+import struct
+import sys
+import threading
+import time
+from collections import deque
+from typing import Any, Deque, Dict, List, Optional, Tuple
+
+RING_MAGIC = b"CTRING1\0"
+RING_HEADER_SIZE = 4096
+
+# Header fields, as indices of 8-byte words
+RING_CAPACITY = 1
+RING_HEAD = 2
+RING_TAIL = 3
+RING_RECORDS = 4
+RING_CLOSED = 5
+
+# Record frame: size, kind, sequence number; records are aligned to its size
+RECORD_FRAME = struct.Struct("=IIQ")
+RECORD_CHECKPOINT = 1
+RECORD_PADDING = 2
+
+RECORD_HEADER = struct.Struct("=QIIII")
+ARRAY_DESCRIPTOR = struct.Struct("=QQBBHI")
+
+# Array element types by code
+ARRAY_DTYPES = {0: "uint8", 1: "int64", 2: "float64"}
+ARRAY_FORMATS = {"uint8": "B", "int64": "q", "float64": "d"}
+
+def aligned(size: int, alignment: int = 8) -> int:
+    """Round size up to a multiple of alignment."""
+    return size + -size % alignment
+
+def padded(data: bytes) -> bytes:
+    """Pad data with zeros to a multiple of 8 bytes."""
+    return data + bytes(aligned(len(data)) - len(data))
+
+def encode_checkpoint(barrier_id: str, occurrence: int, matched: bool,
+                      values: Dict[str, Dict[str, Any]]) -> bytes:
+    """Encode the body of a checkpoint record.
+
+    Args:
+        barrier_id: The ID of the barrier
+        occurrence: The number of times the barrier was released before
+        matched: Whether the programs matched there
+        values: The values of each program by name, see CodeTango.checkpoint_values()
+    """
+    variables: Dict[str, Dict[str, Any]] = {}
+    arrays: List[Tuple[int, int, str, bytes]] = []
+    for program_id in sorted(values):
+        number = int(program_id[-1]) if program_id[-1:].isdigit() else 0
+        scalars = variables.setdefault(program_id, {})
+        for name, value in values[program_id].items():
+            if isinstance(value, (bytes, bytearray, memoryview)):
+                arrays.append((0, number, name, bytes(value)))
+            elif (isinstance(value, list) and value
+                  and all(isinstance(item, (int, float)) and not isinstance(item, bool) for item in value)):
+                if all(isinstance(item, int) and -2**63 <= item < 2**63 for item in value):
+                    arrays.append((1, number, name, struct.pack(f"={len(value)}q", *value)))
+                else:
+                    arrays.append((2, number, name, struct.pack(f"={len(value)}d", *value)))
+            else:
+                scalars[name] = value
+
+    barrier = barrier_id.encode('utf-8')
+    metadata = json.dumps(variables).encode('utf-8')
+    parts = [RECORD_HEADER.pack(occurrence, int(matched), len(arrays), len(barrier), len(metadata)),
+             padded(barrier), padded(metadata)]
+    offset = sum(len(part) for part in parts)
+    offset += sum(ARRAY_DESCRIPTOR.size + aligned(len(name.encode('utf-8'))) for _, _, name, _ in arrays)
+    for dtype, number, name, data in arrays:
+        encoded = name.encode('utf-8')
+        parts.append(ARRAY_DESCRIPTOR.pack(offset, len(data), dtype, number, len(encoded), 0) + padded(encoded))
+        offset += aligned(len(data))
+    parts.extend(padded(data) for _, _, _, data in arrays)
+    return b"".join(parts)
+
+class SharedCheckpoint:
+    """A checkpoint read from the ring; the arrays are views of its own copy of the record."""
+
+    def __init__(self, sequence: int, body: bytes):
+        self.sequence = sequence
+        occurrence, matched, count, barrier_bytes, metadata_bytes = RECORD_HEADER.unpack_from(body)
+        self.occurrence = occurrence
+        self.matched = bool(matched)
+        position = RECORD_HEADER.size
+        self.barrier_id = body[position:position + barrier_bytes].decode('utf-8')
+        position += aligned(barrier_bytes)
+        # Variables by program
+        self.variables: Dict[str, Dict[str, Any]] = json.loads(body[position:position + metadata_bytes])
+        position += aligned(metadata_bytes)
+
+        # Arrays by program, typed memoryviews
+        self.arrays: Dict[str, Dict[str, memoryview]] = {}
+        view = memoryview(body)
+        for _ in range(count):
+            offset, size, dtype, number, name_bytes, _ = ARRAY_DESCRIPTOR.unpack_from(body, position)
+            position += ARRAY_DESCRIPTOR.size
+            name = body[position:position + name_bytes].decode('utf-8')
+            position += aligned(name_bytes)
+            fmt = ARRAY_FORMATS[ARRAY_DTYPES[dtype]]
+            self.arrays.setdefault(f"program{number}", {})[name] = view[offset:offset + size].cast(fmt)
+
+class SharedMemoryPublisher:
+    """Publishes the checkpoints compared by the utility to a ring in shared memory.
+
+    A checkpoint sink of CodeTango: add() is called at each released barrier.
+    """
+
+    def __init__(self, name: str, capacity: int):
+        """Create the ring.
+
+        Args:
+            name: The name of the shared memory object, /dev/shm/<name>
+            capacity: The size of the ring in bytes, rounded up to whole pages
+        """
+        self.path = os.path.join("/dev/shm", name)
+        self.capacity = max(capacity + -capacity % mmap.PAGESIZE, mmap.PAGESIZE)
+        fd = os.open(self.path, os.O_RDWR | os.O_CREAT | os.O_TRUNC, 0o644)
+        try:
+            os.ftruncate(fd, RING_HEADER_SIZE + self.capacity)
+            self.map = mmap.mmap(fd, RING_HEADER_SIZE + self.capacity)
+        finally:
+            os.close(fd)
+        self.header = memoryview(self.map)[:RING_HEADER_SIZE].cast('Q')
+        self.data = memoryview(self.map)[RING_HEADER_SIZE:]
+        self.header[RING_CAPACITY] = self.capacity
+        self.map[:8] = RING_MAGIC
+
+        # Positions of the records in the ring, oldest first
+        self.starts: Deque[int] = deque()
+        self.head = 0
+        self.sequence = 0
+        self.occurrences: Dict[str, int] = {}
+        self.skipped = 0
+
+        # Python has no memory fences; taking a lock is a full barrier
+        self.fence = threading.Lock()
+
+    def write(self, kind: int, body: bytes, size: int = 0) -> None:
+        """Append a record, overwriting the oldest ones as needed.
+
+        Only checkpoints take a sequence number, so that readers count the
+        records they missed from the gaps.
+
+        Args:
+            kind: RECORD_CHECKPOINT or RECORD_PADDING
+            body: The body of the record
+            size: The size of the record if larger than its body, e.g. for padding
+        """
+        size = max(size, RECORD_FRAME.size + aligned(len(body), RECORD_FRAME.size))
+        if size > self.capacity:
+            self.skipped += 1
+            return
+        offset = self.head % self.capacity
+        if offset + size > self.capacity:
+            # Records do not wrap around: the rest of the ring is skipped by readers
+            self.write(RECORD_PADDING, b"", self.capacity - offset)
+            offset = 0
+
+        # Readers must see the new tail before any overwritten byte
+        start = self.head
+        limit = start + size - self.capacity
+        while self.starts and self.starts[0] < limit:
+            self.starts.popleft()
+        self.header[RING_TAIL] = self.starts[0] if self.starts else start
+        with self.fence:
+            pass
+
+        self.data[offset:offset + RECORD_FRAME.size] = RECORD_FRAME.pack(size, kind, self.sequence)
+        self.data[offset + RECORD_FRAME.size:offset + RECORD_FRAME.size + len(body)] = body
+        self.starts.append(start)
+        self.head = start + size
+        self.sequence += kind == RECORD_CHECKPOINT
+        with self.fence:
+            pass
+        self.header[RING_HEAD] = self.head
+        self.header[RING_RECORDS] = self.sequence
+
+    def add(self, barrier_id: str, matched: bool, values: Dict[str, Dict[str, Any]]) -> None:
+        """Publish the checkpoints of both programs at a barrier."""
+        occurrence = self.occurrences.get(barrier_id, 0)
+        self.occurrences[barrier_id] = occurrence + 1
+        self.write(RECORD_CHECKPOINT, encode_checkpoint(barrier_id, occurrence, matched, values))
+
+    def close(self) -> None:
+        """Mark the stream as finished and remove its name; attached readers keep their mapping."""
+        self.header[RING_CLOSED] = 1
+        if self.skipped:
+            print(f"Warning: {self.skipped} checkpoints exceeded the shared-memory ring and were not published")
+        self.header.release()
+        self.data.release()
+        self.map.close()
+        try:
+            os.unlink(self.path)
+        except OSError:
+            pass
+
+class Subscriber:
+    """Reads the checkpoints published to a ring from the moment it attaches."""
+
+    def __init__(self, name: str):
+        """Attach to a ring.
+
+        Args:
+            name: The name of the shared memory object, /dev/shm/<name>
+
+        Raises:
+            OSError: If the ring does not exist
+            ValueError: If it is not a CodeTango ring
+        """
+        with open(os.path.join("/dev/shm", name), "rb") as f:
+            self.map = mmap.mmap(f.fileno(), 0, prot=mmap.PROT_READ)
+        if self.map[:8] != RING_MAGIC:
+            raise ValueError(f"/dev/shm/{name} is not a CodeTango checkpoint ring")
+        self.header = memoryview(self.map)[:RING_HEADER_SIZE].cast('Q')
+        self.data = memoryview(self.map)[RING_HEADER_SIZE:]
+        self.capacity = self.header[RING_CAPACITY]
+        self.position = self.header[RING_HEAD]
+        self.sequence = self.header[RING_RECORDS]
+        self.dropped = 0
+        self.fence = threading.Lock()
+
+    @property
+    def closed(self) -> bool:
+        """Whether the utility finished and every record was read."""
+        return bool(self.header[RING_CLOSED]) and self.position >= self.header[RING_HEAD]
+
+    def next(self) -> Optional[SharedCheckpoint]:
+        """Read the next checkpoint, or None if there is none yet."""
+        while self.position < self.header[RING_HEAD]:
+            tail = self.header[RING_TAIL]
+            if self.position < tail:
+                self.position = tail
+                continue
+            offset = self.position % self.capacity
+            size, kind, sequence = RECORD_FRAME.unpack_from(self.data, offset)
+            if size < RECORD_FRAME.size or size % RECORD_FRAME.size or offset + size > self.capacity:
+                # Overwritten while it was read, or else lost track: start over at the newest record
+                tail = self.header[RING_TAIL]
+                self.position = tail if tail > self.position else self.header[RING_HEAD]
+                continue
+            body = bytes(self.data[offset + RECORD_FRAME.size:offset + size])
+            with self.fence:
+                pass
+            if self.header[RING_TAIL] > self.position:
+                continue
+            self.position += size
+            if kind != RECORD_CHECKPOINT:
+                continue
+            self.dropped += sequence - self.sequence if sequence > self.sequence else 0
+            self.sequence = sequence + 1
+            return SharedCheckpoint(sequence, body)
+        return None
+
+def main(argv: List[str]) -> None:
+    """Entry point of "codetango subscribe"."""
+    parser = argparse.ArgumentParser(
+        prog="codetango subscribe",
+        description="Print the checkpoints a running utility publishes with --shm"
+    )
+    parser.add_argument("name", help="The name given to --shm")
+    parser.add_argument("--variables", action="store_true", help="Print the variables of both programs")
+    args = parser.parse_args(argv)
+
+    # The ring may be started after the subscriber
+    subscriber = None
+    try:
+        while subscriber is None:
+            try:
+                subscriber = Subscriber(args.name)
+            except FileNotFoundError:
+                time.sleep(0.01)
+            except (OSError, ValueError) as e:
+                print(f"Error: {e}")
+                sys.exit(1)
+    except KeyboardInterrupt:
+        return
+    try:
+        while not subscriber.closed:
+            checkpoint = subscriber.next()
+            if checkpoint is None:
+                time.sleep(0.01)
+                continue
+            arrays = ", ".join(f"{program_id}.{name}[{len(view)}]"
+                               for program_id, views in sorted(checkpoint.arrays.items())
+                               for name, view in views.items())
+            print(f"#{checkpoint.sequence} barrier '{checkpoint.barrier_id}' ({checkpoint.occurrence}): "
+                  f"{'match' if checkpoint.matched else 'DIFFER'}{'; ' + arrays if arrays else ''}")
+            if args.variables:
+                for program_id, variables in sorted(checkpoint.variables.items()):
+                    print(f"  {program_id}: {json.dumps(variables)}")
+    except KeyboardInterrupt:
+        pass
+    print(f"{subscriber.dropped} checkpoints dropped")
@@ -0,0 +1,124 @@
+"""
+CodeTango stall detection
+
+This module learns how long each program usually takes from one barrier to
+the next, flags a program once it runs for a multiple of that without
+reaching a barrier, and samples /proc/<pid>/stat to tell a program that is
+still computing from one that is blocked.
+"""
+
+import os
+import time
+from dataclasses import dataclass
+from typing import Dict, Optional, Tuple
+
+# Segments run before their learned duration replaces the global timeout
+STALL_MIN_SAMPLES = 3
+
+# Weight of the latest duration in the running estimate of a segment
+STALL_SMOOTHING = 0.2
+
+# No segment is flagged before this, so that scheduling jitter on short segments is not a stall
+STALL_MIN_SECONDS = 1.0
+
+# A stalled program using at least this share of a core is busy rather than blocked
+STALL_BUSY_SHARE = 0.5
+
+# Process states of /proc/<pid>/stat
+PROCESS_STATES = {
+    "R": "running",
+    "S": "sleeping",
+    "D": "in uninterruptible sleep, usually I/O",
+    "T": "stopped",
+    "t": "stopped by a debugger",
+    "Z": "a zombie",
+    "X": "dead",
+    "I": "idle",
+}
+
+# A segment of a program: (program ID, barrier it starts at, or None at the start)
+SegmentKey = Tuple[str, Optional[str]]
+
+class SegmentTimes:
+    """Running estimates of the duration of each segment.
+
+    The estimate of a segment is an exponentially weighted mean of its
+    durations, so it follows a program whose steps grow slowly. A segment is
+    stalled after factor times its estimate, or after the longest duration
+    seen so far if that is longer, and after the global timeout until it ran
+    STALL_MIN_SAMPLES times.
+    """
+
+    def __init__(self, factor: float, fallback: float):
+        """Initialize the estimates.
+
+        Args:
+            factor: Multiple of the usual duration after which a segment is stalled
+            fallback: Seconds after which a segment without enough samples is stalled
+        """
+        self.factor = factor
+        self.fallback = fallback
+        # Samples, mean and longest duration of each segment
+        self.segments: Dict[SegmentKey, Tuple[int, float, float]] = {}
+
+    def add(self, key: SegmentKey, seconds: float) -> None:
+        """Add the duration of a completed segment."""
+        count, mean, longest = self.segments.get(key, (0, seconds, 0.0))
+        mean += STALL_SMOOTHING * (seconds - mean) if count else 0.0
+        self.segments[key] = (count + 1, mean, max(longest, seconds))
+
+    def typical(self, key: SegmentKey) -> Optional[float]:
+        """Get the usual duration of a segment, or None if it has not completed enough times."""
+        count, mean, _ = self.segments.get(key, (0, 0.0, 0.0))
+        return mean if count >= STALL_MIN_SAMPLES else None
+
+    def limit(self, key: SegmentKey) -> float:
+        """Get the seconds after which a segment is stalled."""
+        typical = self.typical(key)
+        if typical is None:
+            return self.fallback
+        return max(self.factor * typical, self.segments[key][2], STALL_MIN_SECONDS)
+
+@dataclass
+class ProcessSample:
+    """The state and CPU time of a process at some moment."""
+    # One-letter state, see PROCESS_STATES
+    state: str
+    # User and system time of all threads, in clock ticks
+    cpu_ticks: int
+    # time.monotonic() of the sample
+    time: float
+
+def sample_process(pid: int) -> Optional[ProcessSample]:
+    """Read the state and CPU time of a process, or None if it is gone."""
+    try:
+        with open(f"/proc/{pid}/stat") as f:
+            stat = f.read()
+    except OSError:
+        return None
+    # The command name may contain spaces and parentheses; the fields follow its last ")"
+    fields = stat.rpartition(")")[2].split()
+    return ProcessSample(state=fields[0], cpu_ticks=int(fields[11]) + int(fields[12]), time=time.monotonic())
+
+def describe_activity(pid: int, before: Optional[ProcessSample], after: Optional[ProcessSample]) -> str:
+    """Describe what a process did between two samples, e.g. "busy computing (100% CPU)".
+
+    A process using CPU is busy computing, whatever the state of its main
+    thread; otherwise it is blocked, and its state and the kernel function it
+    waits in (when readable) tell on what.
+    """
+    if after is None:
+        return "exited"
+    if before is None or after.time <= before.time:
+        return PROCESS_STATES.get(after.state, after.state)
+    share = (after.cpu_ticks - before.cpu_ticks) / os.sysconf("SC_CLK_TCK") / (after.time - before.time)
+    if share >= STALL_BUSY_SHARE:
+        return f"busy computing ({share:.0%} CPU)"
+
+    try:
+        with open(f"/proc/{pid}/wchan") as f:
+            wchan = f.read().strip()
+    except OSError:
+        wchan = ""
+    where = f" in {wchan}" if wchan and wchan != "0" else ""
+    return f"blocked, {PROCESS_STATES.get(after.state, after.state)}{where} ({share:.0%} CPU)"
@@ -0,0 +1,336 @@
+"""
+CodeTango columnar trace store
+
+This module records the numeric values of a run column by column, one
+column per barrier, variable and program, and answers queries on them
+without reading the rest of the trace. A column is a sequence of blocks of
+at most STORE_BLOCK_ROWS rows: the occurrences of the barrier the rows are
+from (the number of times it was reached before), then the values. The
+index of the blocks, with the occurrence range and the minimum and maximum
+value of each, is written at the end of the file, and the file is
+memory-mapped for reading: an occurrence range is found by bisection and a
+predicate skips the blocks whose minimum and maximum rule it out.
+
+Layout of a store file, in native byte order:
+    STORE_MAGIC, 8 reserved bytes
+    blocks: occurrences (int64), then values (int64 or float64)
+    index: JSON, see TraceStore.close()
+    offset of the index (8 bytes), STORE_MAGIC
+"""
+
+import argparse
+import array
+import json
+import mmap
+import operator
+import re
+import struct
+import sys
+from bisect import bisect_left, bisect_right
+from typing import Any, Callable, Dict, Iterator, List, Optional, Tuple
+
+STORE_MAGIC = b"CTSTORE1"
+
+# Rows of a block, and values buffered in all columns before every column is written out
+STORE_BLOCK_ROWS = 4096
+STORE_BUFFER_VALUES = 4 * 2**20
+
+# A column: (barrier ID, variable, program ID)
+ColumnKey = Tuple[str, str, str]
+
+# A block in the index: offset, rows, value format ("q" or "d"), first and last
+# occurrence, minimum and maximum value (None if all are NaN)
+Block = Tuple[int, int, str, int, int, Optional[float], Optional[float]]
+
+class ColumnBuffer:
+    """The rows of a column not written yet, and the blocks written so far."""
+
+    def __init__(self):
+        self.occurrences: List[int] = []
+        self.values: List[Any] = []
+        self.blocks: List[Block] = []
+
+class TraceStore:
+    """Writes the numeric values of the checkpoints of a run to a store file.
+
+    A checkpoint sink of CodeTango: add() is called at each released barrier.
+    Values that are not numbers, such as strings, lists and regions, are not stored.
+    """
+
+    def __init__(self, path: str):
+        """Create the store file.
+
+        Args:
+            path: The path of the file
+        """
+        self.path = path
+        self.file = open(path, "wb")
+        self.file.write(STORE_MAGIC + bytes(8))
+        self.columns: Dict[ColumnKey, ColumnBuffer] = {}
+        self.occurrences: Dict[str, int] = {}
+        self.buffered = 0
+
+    def add(self, barrier_id: str, matched: bool, values: Dict[str, Dict[str, Any]]) -> None:
+        """Add the checkpoints of both programs at a barrier.
+
+        Args:
+            barrier_id: The ID of the barrier
+            matched: Whether the checkpoints matched
+            values: The values of each program by name
+        """
+        occurrence = self.occurrences.get(barrier_id, 0)
+        self.occurrences[barrier_id] = occurrence + 1
+        for program_id, program_values in values.items():
+            for name, value in program_values.items():
+                if isinstance(value, bool):
+                    value = int(value)
+                elif not isinstance(value, (int, float)):
+                    continue
+                key = (barrier_id, name, program_id)
+                column = self.columns.get(key)
+                if column is None:
+                    column = self.columns[key] = ColumnBuffer()
+                column.occurrences.append(occurrence)
+                column.values.append(value)
+                if len(column.values) >= STORE_BLOCK_ROWS:
+                    self.buffered -= len(column.values) - 1
+                    self.write_block(column)
+                else:
+                    self.buffered += 1
+
+        # Wide checkpoints fill many columns slowly; their partial blocks are written early
+        if self.buffered >= STORE_BUFFER_VALUES:
+            for column in self.columns.values():
+                self.write_block(column)
+            self.buffered = 0
+
+    def write_block(self, column: ColumnBuffer) -> None:
+        """Write the buffered rows of a column as a block."""
+        if not column.values:
+            return
+        values = column.values
+        fmt = "q" if all(isinstance(value, int) and -2**63 <= value < 2**63 for value in values) else "d"
+        numbers = [value for value in values if value == value]
+        column.blocks.append((self.file.tell(), len(values), fmt, column.occurrences[0],
+                              column.occurrences[-1], min(numbers, default=None), max(numbers, default=None)))
+        self.file.write(array.array("q", column.occurrences).tobytes())
+        self.file.write(array.array(fmt, values).tobytes())
+        column.occurrences = []
+        column.values = []
+
+    def close(self) -> None:
+        """Write the remaining rows and the index.
+
+        The index is a JSON list of the columns: barrier, variable, program
+        and blocks, as in Block.
+        """
+        for column in self.columns.values():
+            self.write_block(column)
+        index = [{"barrier": barrier_id, "variable": name, "program": program_id, "blocks": column.blocks}
+                 for (barrier_id, name, program_id), column in self.columns.items()]
+        offset = self.file.tell()
+        self.file.write(json.dumps(index).encode('utf-8'))
+        self.file.write(struct.pack("=Q", offset) + STORE_MAGIC)
+        self.file.close()
+
+class Predicate:
+    """A comparison of the values of a variable with a number, e.g. "residual > 1e-3"."""
+
+    OPERATORS = {"<": operator.lt, "<=": operator.le, ">": operator.gt, ">=": operator.ge,
+                 "==": operator.eq, "!=": operator.ne}
+
+    def __init__(self, text: str):
+        """Parse a predicate.
+
+        Raises:
+            ValueError: If it is not of the form VARIABLE OP NUMBER
+        """
+        match = re.fullmatch(r"\s*(.+?)\s*(<=|>=|==|!=|<|>)\s*(\S+)\s*", text)
+        if not match:
+            raise ValueError(f"Invalid predicate {text!r}, expected e.g. 'residual > 1e-3'")
+        self.variable, self.op = match.group(1), match.group(2)
+        self.value = float(match.group(3))
+        self.test: Callable[[Any, Any], bool] = self.OPERATORS[self.op]
+
+    def __call__(self, value: Any) -> bool:
+        return self.test(value, self.value)
+
+    def may_match(self, low: Optional[float], high: Optional[float]) -> bool:
+        """Check whether a block with these minimum and maximum can have a matching value."""
+        if low is None:
+            # Only NaN, which matches no comparison but !=
+            return self.op == "!="
+        if self.op in ("<", "<="):
+            return self.test(low, self.value)
+        if self.op in (">", ">="):
+            return self.test(high, self.value)
+        if self.op == "==":
+            return low <= self.value <= high
+        return True
+
+class TraceReader:
+    """Reads the columns of a store file, memory-mapped."""
+
+    def __init__(self, path: str):
+        """Open a store file.
+
+        Raises:
+            OSError: If the file cannot be read
+            ValueError: If it is not a complete store file
+        """
+        with open(path, "rb") as f:
+            self.map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        if len(self.map) < 32 or self.map[:8] != STORE_MAGIC or self.map[-8:] != STORE_MAGIC:
+            raise ValueError(f"{path} is not a complete CodeTango trace store")
+        offset, = struct.unpack_from("=Q", self.map, len(self.map) - 16)
+        self.view = memoryview(self.map)
+        self.columns: Dict[ColumnKey, List[Block]] = {}
+        for column in json.loads(self.map[offset:len(self.map) - 16]):
+            key = (column["barrier"], column["variable"], column["program"])
+            self.columns[key] = [tuple(block) for block in column["blocks"]]
+        # First occurrences of the blocks of each column, for bisection
+        self.firsts = {key: [block[3] for block in blocks] for key, blocks in self.columns.items()}
+
+    def block(self, block: Block) -> Tuple[memoryview, memoryview]:
+        """Get the occurrences and values of a block, without copying them."""
+        offset, rows, fmt = block[:3]
+        occurrences = self.view[offset:offset + 8 * rows].cast("q")
+        values = self.view[offset + 8 * rows:offset + 16 * rows].cast(fmt)
+        return occurrences, values
+
+    def scan(self, key: ColumnKey, first: Optional[int] = None, last: Optional[int] = None,
+             predicate: Optional[Predicate] = None) -> Iterator[Tuple[int, Any]]:
+        """Iterate over the rows of a column in an occurrence range.
+
+        Args:
+            key: The column
+            first: The first occurrence, or None for the start
+            last: The last occurrence, or None for the end
+            predicate: Only rows whose value matches, skipping blocks by their minimum and maximum
+
+        Yields:
+            The occurrence and value of each row
+        """
+        blocks = self.columns.get(key, [])
+        start = max(bisect_right(self.firsts[key], first) - 1, 0) if first is not None and blocks else 0
+        for block in blocks[start:]:
+            if last is not None and block[3] > last:
+                break
+            if predicate and not predicate.may_match(block[5], block[6]):
+                continue
+            occurrences, values = self.block(block)
+            low = bisect_left(occurrences, first) if first is not None else 0
+            high = bisect_right(occurrences, last) if last is not None else len(occurrences)
+            for i in range(low, high):
+                if predicate is None or predicate(values[i]):
+                    yield occurrences[i], values[i]
+
+    def lookup(self, key: ColumnKey, occurrence: int) -> Optional[Any]:
+        """Get the value of a column at an occurrence, or None if it has no row there."""
+        if key not in self.columns:
+            return None
+        index = bisect_right(self.firsts[key], occurrence) - 1
+        if index < 0:
+            return None
+        occurrences, values = self.block(self.columns[key][index])
+        i = bisect_left(occurrences, occurrence)
+        return values[i] if i < len(occurrences) and occurrences[i] == occurrence else None
+
+def differ(value1: Any, value2: Any) -> bool:
+    """Check whether two values differ; NaN equals NaN, and a missing value differs."""
+    if value1 is None or value2 is None:
+        return value1 is not value2
+    return value1 != value2 and not (value1 != value1 and value2 != value2)
+
+def format_value(value: Any) -> str:
+    """Format a value of a query result, "-" where a column has no row."""
+    return "-" if value is None else repr(value)
+
+def merge_rows(scans: List[Iterator[Tuple[int, Any]]]) -> Iterator[Tuple[int, List[Any]]]:
+    """Merge the scans of columns by occurrence into rows with a value, or None, from each."""
+    heads = [next(scan, None) for scan in scans]
+    while any(head is not None for head in heads):
+        occurrence = min(head[0] for head in heads if head is not None)
+        values = []
+        for i, head in enumerate(heads):
+            if head is not None and head[0] == occurrence:
+                values.append(head[1])
+                heads[i] = next(scans[i], None)
+            else:
+                values.append(None)
+        yield occurrence, values
+
+def main(argv: List[str]) -> None:
+    """Entry point of "codetango query"."""
+    parser = argparse.ArgumentParser(
+        prog="codetango query",
+        description="Query a trace recorded with --store: list its columns, or show the values of "
+                    "variables at a barrier side by side"
+    )
+    parser.add_argument("store", help="The store file")
+    parser.add_argument("--barrier", help="The barrier; without it, the columns are listed")
+    parser.add_argument("--variable", action="append", default=[],
+                        help="A variable to show; may be given several times (default: all of the barrier)")
+    parser.add_argument("--program", choices=("program1", "program2"), help="Show only this program")
+    parser.add_argument("--from", dest="first", type=int, help="The first occurrence of the barrier")
+    parser.add_argument("--to", dest="last", type=int, help="The last occurrence of the barrier")
+    parser.add_argument("--where", help="Only occurrences where a variable matches in either program, "
+                                        "e.g. 'residual > 1e-3'")
+    parser.add_argument("--diff", action="store_true", help="Only occurrences where the programs differ")
+    parser.add_argument("--limit", type=int, help="Show at most this many occurrences per variable")
+    args = parser.parse_args(argv)
+
+    try:
+        reader = TraceReader(args.store)
+        predicate = Predicate(args.where) if args.where else None
+    except (OSError, ValueError) as e:
+        print(f"Error: {e}")
+        sys.exit(1)
+
+    if args.barrier is None:
+        print(f"{'barrier':<24} {'variable':<24} {'program':<10} {'rows':>10} {'occurrences':>17} "
+              f"{'min':>12} {'max':>12}")
+        for (barrier_id, name, program_id), blocks in sorted(reader.columns.items()):
+            rows = sum(block[1] for block in blocks)
+            lows = [block[5] for block in blocks if block[5] is not None]
+            highs = [block[6] for block in blocks if block[6] is not None]
+            span = f"{blocks[0][3]}-{blocks[-1][4]}" if blocks else "-"
+            print(f"{barrier_id:<24} {name:<24} {program_id:<10} {rows:>10} {span:>17} "
+                  f"{format_value(min(lows, default=None)):>12} {format_value(max(highs, default=None)):>12}")
+        return
+
+    programs = [args.program] if args.program else ["program1", "program2"]
+    variables = args.variable or sorted({name for barrier_id, name, _ in reader.columns
+                                         if barrier_id == args.barrier})
+    if not variables:
+        print(f"Error: the store has no values at barrier '{args.barrier}'")
+        sys.exit(1)
+
+    # The predicate selects the occurrences, reading only blocks that can match
+    selected: Optional[List[int]] = None
+    if predicate:
+        selected = sorted({occurrence for program_id in programs
+                           for occurrence, _ in reader.scan((args.barrier, predicate.variable, program_id),
+                                                            args.first, args.last, predicate)})
+
+    for name in variables:
+        keys = [(args.barrier, name, program_id) for program_id in programs]
+        if selected is not None:
+            rows: Iterator[Tuple[int, List[Any]]] = (
+                (occurrence, [reader.lookup(key, occurrence) for key in keys]) for occurrence in selected)
+        else:
+            rows = merge_rows([reader.scan(key, args.first, args.last) for key in keys])
+
+        print(f"\nBarrier '{args.barrier}', variable '{name}':")
+        print((f"  {'occurrence':>10}  " + "  ".join(f"{program_id:<24}" for program_id in programs)).rstrip())
+        shown = 0
+        for occurrence, values in rows:
+            if args.diff and (len(values) < 2 or not differ(values[0], values[1])):
+                continue
+            if args.limit is not None and shown >= args.limit:
+                print("  ...")
+                break
+            print((f"  {occurrence:>10}  " + "  ".join(f"{format_value(value):<24}" for value in values)).rstrip())
+            shown += 1
+        if not shown:
+            print("  (no rows)")
@@ -3,6 +3,8 @@
 
 #include <string>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <vector>
 #include <iostream>
 #include <sstream>
@@ -10,10 +12,55 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <cstring>
+#include <cstddef>
+#include <cstdint>
 #include <stdexcept>
+#include <functional>
+#include <mutex>
+
+// A libm call recorded by the preloaded libcodetango_mathtrace
+struct codetango_math_record;
+
+// The calls of a thread, hashed by libcodetango_calltrace
+struct codetango_call_digest;
 
 namespace codetango {
 
+/**
+ * A field of a POD record, given by its offset and size in bytes
+ */
+struct RegionField {
+    size_t offset;
+    size_t size;
+};
+
+/**
+ * Describe a member of a POD struct as a RegionField
+ */
+#define CODETANGO_FIELD(type, member) \
+    codetango::RegionField{offsetof(type, member), sizeof(((type*)0)->member)}
+
+/**
+ * Build a region mask from a record layout descriptor
+ * 
+ * Bytes covered by the listed fields are compared, everything else
+ * (padding, don't-care fields) is excluded.
+ * 
+ * @param record_size The size of one record in bytes, e.g. sizeof(T)
+ * @param fields The fields of the record to compare
+ * @return A byte mask of record_size bytes
+ */
+std::vector<unsigned char> make_region_mask(size_t record_size, const std::vector<RegionField>& fields);
+
+// The source location of a wait() call, filled in by the compiler where supported
+#if defined(__GNUC__) || defined(__clang__)
+#define CODETANGO_CALLER_FILE __builtin_FILE()
+#define CODETANGO_CALLER_LINE __builtin_LINE()
+#else
+#define CODETANGO_CALLER_FILE nullptr
+#define CODETANGO_CALLER_LINE 0
+#endif
+
 /**
  * A class for synchronizing execution with another program at barrier points.
  */
@@ -23,8 +70,10 @@ public:
      * Constructor
      * 
      * @param program_id A unique identifier for this program
+     * @param schema_hash SCHEMA_HASH of the header generated by codetango schema,
+     *                    if the program sends checkpoints with wait_record()
      */
-    Barrier(const std::string& program_id);
+    Barrier(const std::string& program_id, const std::string& schema_hash = std::string());
     
     /**
      * Destructor - closes the socket connection
@@ -34,10 +83,32 @@ public:
     /**
      * Wait at a barrier until both programs reach this point
      * 
+     * A barrier disabled by the filters of the utility returns at once and
+     * discards the variables registered for it.
+     * 
      * @param barrier_id A unique identifier for this barrier point
+     * @param file The source file of the call, for coverage of batch runs
+     * @param line The source line of the call
+     * @return true if the barrier was successfully synchronized
+     */
+    bool wait(const std::string& barrier_id, const char* file = CODETANGO_CALLER_FILE,
+              int line = CODETANGO_CALLER_LINE);
+    
+    /**
+     * Wait at a barrier with a fixed-layout checkpoint record
+     * 
+     * Called by the wait() functions of a header generated by codetango
+     * schema. The record is sent as is, tagged with the index of its barrier
+     * in the schema; the utility decodes it with the same schema. Variables
+     * registered with the add_*() functions are not sent with it.
+     * 
+     * @param index The index of the barrier in the schema
+     * @param barrier_id The name of the barrier, sent only with snapshots
+     * @param record The packed record
+     * @param bytes The size of the record in bytes
      * @return true if the barrier was successfully synchronized
      */
-    bool wait(const std::string& barrier_id);
+    bool wait_record(unsigned index, const char* barrier_id, const void* record, size_t bytes);
     
     /**
      * Register an integer variable to be compared at the next barrier
@@ -87,29 +158,434 @@ public:
      */
     void add_double_vector(const std::string& name, const std::vector<double>& values);
     
+    /**
+     * Register a scalar to be compared at the next barrier, for checkpoints of many scalars
+     * 
+     * Unlike add_double(), scalars are kept in registration order rather than
+     * by name. Their names are sent once per distinct list of names, and their
+     * values as one packed array of doubles, compared bit for bit. Register
+     * them in the same order at each barrier to send the names only once.
+     * 
+     * @param name The name of the scalar
+     * @param value The value of the scalar
+     */
+    void add_scalar(const std::string& name, double value);
+    
+    /**
+     * Register a variable of a batch of independent problems, one value per lane
+     * 
+     * The utility compares lane variables lane by lane and reports which
+     * lanes differ and in what, so one vectorized program solving many
+     * problems at once is checked against a reference that solves them one
+     * at a time and registers its results per lane, in one program pair. The
+     * values are sent without copying, so they must stay valid and unchanged
+     * until the next wait().
+     * 
+     * @param name The name of the variable
+     * @param values The value of each lane
+     * @param lanes The number of lanes
+     */
+    void add_lanes(const std::string& name, const double* values, size_t lanes);
+    
+    /**
+     * Register a variable of floats per lane, see add_lanes()
+     */
+    void add_lanes(const std::string& name, const float* values, size_t lanes);
+    
+    /**
+     * Register a variable of integers per lane, see add_lanes()
+     */
+    void add_lanes(const std::string& name, const int* values, size_t lanes);
+    
+    /**
+     * Register a variable of 64-bit integers per lane, see add_lanes()
+     */
+    void add_lanes(const std::string& name, const int64_t* values, size_t lanes);
+    
+    /**
+     * Register a raw memory region to be compared byte-wise at the next barrier
+     * 
+     * The region is sent as is, without serialization, so it must stay valid
+     * and unchanged until the next wait(). The mask is applied cyclically,
+     * one mask byte per region byte, so its size is the record size of an
+     * array of POD records. Bits cleared in the mask are excluded from
+     * the comparison.
+     * 
+     * @param name The name of the region
+     * @param ptr Pointer to the first byte of the region
+     * @param bytes The size of the region in bytes
+     * @param mask Optional per-record bitmask, see make_region_mask()
+     */
+    void add_region(const std::string& name, const void* ptr, size_t bytes,
+                    const std::vector<unsigned char>& mask = std::vector<unsigned char>());
+    
+    /**
+     * Register an array with a shape, e.g. the field of a stencil code, to be compared at the next barrier
+     * 
+     * The grid is compared like a region and, like a region, must stay valid
+     * and unchanged until the next wait(). Where it differs, the utility
+     * reports the bounding box, connected regions and per-axis counts of the
+     * differing cells instead of the first differing byte.
+     * 
+     * @param name The name of the grid
+     * @param ptr Pointer to the first cell, cells in row-major order
+     * @param shape The extent of each axis, slowest first
+     * @param dtype The element type: bytes, int8..int64, uint8..uint64, float32 or float64
+     */
+    void add_grid(const std::string& name, const void* ptr, const std::vector<size_t>& shape,
+                  const std::string& dtype);
+    
+    /**
+     * Register a grid of doubles, see add_grid()
+     */
+    void add_grid(const std::string& name, const double* data, const std::vector<size_t>& shape);
+    
+    /**
+     * Register a grid of floats, see add_grid()
+     */
+    void add_grid(const std::string& name, const float* data, const std::vector<size_t>& shape);
+    
+    /**
+     * Register a region of a file to be compared at the next barrier
+     * 
+     * Only the reference is sent: the utility maps the files of both programs
+     * and compares the regions directly. Data written with write() or through
+     * a shared mapping is visible to the utility through the page cache once
+     * it is out of user-space buffers, so syncing is only needed for files
+     * that bypass the local page cache, e.g. on some network filesystems.
+     * 
+     * @param name The name of the region
+     * @param path The path of the file
+     * @param offset The offset of the region in the file, in bytes
+     * @param length The length of the region in bytes
+     * @param dtype The element type: bytes, int8..int64, uint8..uint64, float32 or float64
+     * @param sync Whether to fdatasync() the file before the barrier
+     */
+    void add_file_region(const std::string& name, const std::string& path, size_t offset, size_t length,
+                         const std::string& dtype = "bytes", bool sync = false);
+    
+    /**
+     * Register a stream of doubles to be compared at the next barrier
+     * 
+     * The generator is called repeatedly during wait(). Each call fills the
+     * chunk and returns true, or returns false at the end of the stream.
+     * Chunks are sent and compared one at a time, so the stream is never
+     * materialized as a whole.
+     * 
+     * @param name The name of the stream
+     * @param generator The chunk generator
+     */
+    void add_double_stream(const std::string& name, const std::function<bool(std::vector<double>&)>& generator);
+    
+    /**
+     * Register a stream of integers to be compared at the next barrier
+     * 
+     * @param name The name of the stream
+     * @param generator The chunk generator, see add_double_stream()
+     */
+    void add_int_stream(const std::string& name, const std::function<bool(std::vector<int>&)>& generator);
+    
+    /**
+     * Record every write to a variable, to be compared at the following barriers
+     * 
+     * A hardware data breakpoint is armed on the variable, so the writes are
+     * caught without changing the code that makes them. On each write, the new
+     * value and the address of the writing instruction are recorded; at each
+     * wait() the writes since the previous barrier are compared with those of
+     * the other program. Only writes by the calling thread are seen, and most
+     * CPUs have four breakpoints. Writes beyond CODETANGO_WATCH_LIMIT
+     * (default: 65536) between two barriers are dropped. Link the program
+     * with -rdynamic to get the names of its own functions in reports.
+     * 
+     * @param name The name of the variable
+     * @param var The variable, which must stay valid until unwatch()
+     */
+    void watch(const std::string& name, const int* var);
+    void watch(const std::string& name, const long long* var);
+    void watch(const std::string& name, const float* var);
+    void watch(const std::string& name, const double* var);
+    
+    /**
+     * Stop recording the writes to a variable
+     * 
+     * @param name The name of the variable
+     */
+    void unwatch(const std::string& name);
+    
+    /**
+     * Compare the libm calls of the calling thread, under a key
+     * 
+     * With codetango --mathtrace, the calls of the thread that constructed
+     * the Barrier are compared as thread 0. Other threads are compared once
+     * they call this, and are paired across the programs by their keys, so
+     * give each the same key in both, e.g. the index of a worker. Calls made
+     * before are not recorded.
+     * 
+     * @param key The key of the thread, unique in the program and 1 or more
+     */
+    void trace_math_thread(unsigned key);
+    
+    /**
+     * Whether the program was rewound to a snapshot after a divergence
+     * 
+     * With codetango --snapshots, the programs fork a snapshot at matching
+     * barriers, and at the first difference both programs are replaced by
+     * their last snapshots, which run again from there. Programs can check
+     * more often once rewound, or read the variables set by --rewind-env.
+     * 
+     * @return true in a program resumed from a snapshot
+     */
+    bool rewound() const;
+    
 private:
+    // A raw memory region to be compared at the next barrier
+    struct Region {
+        const unsigned char* ptr;
+        size_t bytes;
+        std::vector<unsigned char> mask;
+        // Extent of each axis and element type of a grid, empty for a plain region
+        std::vector<size_t> shape;
+        std::string dtype;
+    };
+    
+
     // Program ID for this instance
     std::string program_id_;
     
+    // Hash of the schema of the records sent with wait_record(), if any
+    std::string schema_hash_;
+    
     // Socket connection
     int socket_fd_;
     bool connected_;
     
+    // Whether this program runs again from a snapshot
+    bool rewound_;
+    
+    // Snapshots forked by this program that may still be waiting
+    std::vector<pid_t> snapshots_;
+    
     // Variables to be compared at the next barrier
     std::map<std::string, std::pair<std::string, std::string>> variables_;
     
+    // Memory regions to be compared at the next barrier
+    std::map<std::string, Region> regions_;
+    
+    // A region of a file to be compared at the next barrier
+    struct FileRegion {
+        std::string path;
+        size_t offset;
+        size_t length;
+        std::string dtype;
+    };
+    
+    // File regions to be compared at the next barrier
+    std::map<std::string, FileRegion> files_;
+    
+    // A stream to be compared at the next barrier: the generator points
+    // data at the next chunk and returns its size, or returns false at the end
+    struct Stream {
+        std::string dtype;
+        std::function<bool(const void*& data, size_t& bytes)> next;
+    };
+    
+    // Streams to be compared at the next barrier
+    std::map<std::string, Stream> streams_;
+    
+    // A write to a watched variable: its index, the writing instruction and
+    // the new value, zero-extended
+    struct WatchRecord {
+        uint64_t occurrence;
+        uint64_t ip;
+        uint64_t value;
+    };
+    
+    // A watched variable: its breakpoint slot and element type
+    struct Watch {
+        int slot;
+        std::string dtype;
+    };
+    
+    // Watched variables, and their writes in the segment ending at the current barrier
+    std::map<std::string, Watch> watches_;
+    std::map<std::string, std::pair<std::vector<WatchRecord>, uint64_t>> watch_records_;
+    
+    // Scalars to be compared at the next barrier: their names separated by
+    // NUL in registration order, the FNV-1a hash of the names, and the values
+    std::string scalar_names_;
+    uint64_t scalar_hash_;
+    std::vector<double> scalar_values_;
+    
+    // A variable with one value per lane, sent without copying
+    struct Lanes {
+        const void* ptr;
+        size_t count;
+        std::string dtype;
+        size_t size;
+    };
+    
+    // Lane variables to be compared at the next barrier
+    std::map<std::string, Lanes> lanes_;
+    
+    // Hashes of the name tables of scalars already sent
+    std::set<uint64_t> scalar_tables_;
+    
+    // Bytes received from the utility but not yet consumed
+    std::string recv_buffer_;
+    
+    // Whether I/O and syscall counters are sent with each barrier
+    bool accounting_;
+    
+    // Counters at the end of the previous barrier
+    std::map<std::string, long long> accounting_base_;
+    
+    // Include and exclude patterns of barrier IDs or variable names, resolved
+    // into an enable table as the names are first seen
+    struct Filter {
+        std::vector<std::string> include;
+        std::vector<std::string> exclude;
+        std::unordered_map<std::string, bool> enabled;
+        
+        bool enables(const std::string& name);
+    };
+    
+    // Whether any filter is set; without one, no name is looked up
+    bool filtered_;
+    Filter barrier_filter_;
+    Filter variable_filter_;
+    
+    // Serializes messages of wait() and of libm trace flushes from other threads
+    std::recursive_mutex send_mutex_;
+    
+    // Functions of libcodetango_mathtrace, if it is preloaded
+    void (*mathtrace_flush_)();
+    void (*mathtrace_detach_)();
+    void (*mathtrace_set_thread_)(unsigned);
+    
+    // The function table of libcodetango_mathtrace as JSON, until it is sent
+    std::string mathtrace_functions_;
+    
+    // Functions of libcodetango_calltrace, if the program is linked with it
+    void (*calltrace_digests_)(void (*)(void*, const codetango_call_digest*), void*);
+    size_t (*calltrace_ring_)(unsigned, size_t, void (*)(void*, int, const char*), void*);
+    
+    // Call sequence digests of the segment ending at the current barrier:
+    // thread -> (digest, events)
+    std::map<unsigned, std::pair<unsigned long long, unsigned long long>> calltrace_;
+    
     /**
      * Connect to the CodeTango control utility
+     * 
+     * @param fields More fields of the initialization message, as JSON starting with a comma
+     */
+    void connect(const std::string& fields = std::string());
+    
+    /**
+     * Discard the variables registered for the current barrier
+     */
+    void clear_checkpoint();
+    
+    /**
+     * Replace the filters with those sent by the utility
+     * 
+     * @param json A JSON object of patterns separated by newlines: include_barriers,
+     *             exclude_barriers, include_variables and exclude_variables
+     * @param pos The position of its opening brace
      */
-    void connect();
+    void set_filters(const std::string& json, size_t pos);
+    
+    /**
+     * Fork a snapshot of the program, which the utility can resume after a divergence
+     * 
+     * @param snapshot The number of the snapshot
+     * @param barrier_id The ID of the barrier the snapshot is taken at
+     */
+    void take_snapshot(int snapshot, const std::string& barrier_id);
+    
+    /**
+     * Start recording libm calls, if libcodetango_mathtrace is preloaded
+     */
+    void attach_mathtrace();
+    
+    /**
+     * Send the libm calls recorded by a thread, called by libcodetango_mathtrace
+     * 
+     * @param ctx The Barrier
+     * @param thread The index of the thread
+     * @param records The recorded calls
+     * @param count The number of records
+     * @return true if the records were sent
+     */
+    static bool mathtrace_sink(void* ctx, unsigned thread, const codetango_math_record* records, size_t count);
+    
+    /**
+     * Arm a hardware data breakpoint on a variable
+     * 
+     * @param name The name of the variable
+     * @param ptr The address of the variable
+     * @param bytes The size of the variable: 1, 2, 4 or 8
+     * @param dtype The element type of the variable
+     */
+    void watch_variable(const std::string& name, const void* ptr, size_t bytes, const std::string& dtype);
+    
+    /**
+     * Take the writes recorded since the previous barrier out of the rings
+     */
+    void drain_watches();
+    
+    /**
+     * Drop the writes recorded since the previous barrier, at a disabled barrier
+     */
+    void discard_watches();
+    
+    /**
+     * Collect the call sequence digests of the segment ending at a barrier
+     */
+    void read_calltrace();
+    
+    /**
+     * Send the most recent calls of each thread, when the utility asks for them
+     * 
+     * @return true if the calls were sent
+     */
+    bool send_calltrace_ring();
     
     /**
      * Create a JSON message for a barrier
      * 
      * @param barrier_id The ID of the barrier
+     * @param accounting Counter deltas of the segment ending at this barrier
+     * @param site The source location of the wait() call as file:line, or empty
+     * @param scalar_names Whether the names of the scalars are sent with their values
      * @return A JSON string representing the barrier message
      */
-    std::string make_barrier_json(const std::string& barrier_id);
+    std::string make_barrier_json(const std::string& barrier_id,
+                                  const std::map<std::string, long long>& accounting,
+                                  const std::string& site, bool scalar_names);
+    
+    /**
+     * Send a message followed by its binary payload
+     * 
+     * @param header The JSON header, without the trailing newline
+     * @param payload The buffers to send after the header
+     * @return true if everything was sent
+     */
+    bool send_message(const std::string& header, const std::vector<std::pair<const void*, size_t>>& payload);
+    
+    /**
+     * Receive one newline-terminated message from the utility
+     * 
+     * @param line Receives the message without the trailing newline
+     * @return true if a message was received
+     */
+    bool recv_message(std::string& line);
+    
+    /**
+     * Send the chunks of the registered streams, in the order of their names
+     * 
+     * @return true if everything was sent
+     */
+    bool send_streams();
     
     /**
      * Escape a string for JSON
@@ -0,0 +1,106 @@
+#ifndef CODETANGO_SUBSCRIBER_H
+#define CODETANGO_SUBSCRIBER_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace codetango {
+
+/**
+ * An array of a checkpoint read from the shared-memory ring
+ */
+struct SharedArray {
+    // "program1" or "program2"
+    std::string program;
+    std::string name;
+    // "uint8" for raw regions, "int64" or "float64" for numeric lists
+    std::string dtype;
+    // The elements, valid until the next call of Subscriber::next()
+    const void* data;
+    size_t bytes;
+
+    /**
+     * View the elements as an array of T, which must match dtype
+     */
+    template <typename T>
+    const T* as() const { return static_cast<const T*>(data); }
+
+    /**
+     * Get the number of elements
+     */
+    size_t size() const { return dtype == "uint8" ? bytes : bytes / 8; }
+};
+
+/**
+ * A checkpoint of both programs at a barrier, as published by the utility
+ */
+struct SharedCheckpoint {
+    uint64_t sequence;
+    std::string barrier_id;
+    // The number of times the barrier was released before
+    uint64_t occurrence;
+    bool matched;
+    // JSON object of the scalar variables of each program
+    std::string metadata;
+    std::vector<SharedArray> arrays;
+};
+
+/**
+ * A reader of the checkpoints the utility publishes with --shm NAME
+ *
+ * The utility never waits for its readers: a reader that falls behind by
+ * more than the size of the ring loses the oldest records, and counts them
+ * in dropped(). Reading starts at the moment the subscriber attaches.
+ */
+class Subscriber {
+public:
+    /**
+     * Attach to the ring /dev/shm/<name>
+     *
+     * @param name The name given to --shm
+     * @throws std::runtime_error If the ring does not exist or is not a CodeTango ring
+     */
+    explicit Subscriber(const std::string& name);
+
+    ~Subscriber();
+
+    /**
+     * Read the next checkpoint without waiting
+     *
+     * @param checkpoint Filled with the checkpoint; its arrays point into the subscriber
+     * @return Whether a checkpoint was read
+     */
+    bool next(SharedCheckpoint& checkpoint);
+
+    /**
+     * Check whether the utility finished and every checkpoint was read
+     */
+    bool closed() const;
+
+    /**
+     * Get the number of checkpoints overwritten before they could be read
+     */
+    uint64_t dropped() const { return dropped_; }
+
+private:
+    Subscriber(const Subscriber&);
+    Subscriber& operator=(const Subscriber&);
+
+    const unsigned char* map_;
+    size_t map_size_;
+    const uint64_t* header_;
+    const unsigned char* data_;
+    uint64_t capacity_;
+    // Position of the next record, expected sequence number of the next checkpoint
+    uint64_t position_;
+    uint64_t sequence_;
+    uint64_t dropped_;
+    // A copy of the last record, which the arrays of the checkpoint point into
+    std::vector<uint64_t> record_;
+};
+
+} // namespace codetango
+
+#endif // CODETANGO_SUBSCRIBER_H
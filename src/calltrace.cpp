@@ -0,0 +1,247 @@
+#include "calltrace.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <dlfcn.h>
+
+/*
+ * Call tracing runtime for -finstrument-functions
+ *
+ * Linked into a program compiled with -finstrument-functions, it hashes the
+ * sequence of function entries and exits of each thread into a rolling
+ * digest, and keeps the most recent CODETANGO_CALLTRACE_RING events
+ * (default: 256) in a ring per thread. Functions are identified by their
+ * symbol names, so two different builds can be compared; link the program
+ * with -rdynamic so that dladdr() finds the names of its own functions.
+ */
+
+#define NO_INSTRUMENT __attribute__((no_instrument_function))
+
+namespace {
+
+// Multiplier of the polynomial rolling hash
+const uint64_t PRIME = 0x100000001b3ULL;
+
+// Mixed into the hash of a function exit, to tell it from an entry
+const uint64_t EXIT_SALT = 0x9e3779b97f4a7c15ULL;
+
+// Size of the per-thread cache of function hashes
+const size_t CACHE_SIZE = 256;
+
+/**
+ * A function entry or exit
+ */
+struct Event {
+    void* function;
+    int exit;
+};
+
+/**
+ * The call trace of one thread
+ *
+ * The digest is H(n) = H(n-1) * PRIME + hash(event n). The digest of the
+ * events since a snapshot follows from the snapshot alone, so the owning
+ * thread never has to reset anything. The sequence counter lets other
+ * threads read a consistent (digest, events) pair.
+ */
+struct ThreadTrace {
+    unsigned index;
+    std::atomic<uint32_t> sequence;
+    std::atomic<uint64_t> digest;
+    std::atomic<uint64_t> events;
+
+    // Digest and events at the previous snapshot
+    uint64_t base_digest;
+    uint64_t base_events;
+
+    std::vector<Event> ring;
+
+    void* cache_functions[CACHE_SIZE];
+    uint64_t cache_hashes[CACHE_SIZE];
+};
+
+std::mutex registry_mutex;
+std::vector<ThreadTrace*> registry;
+
+thread_local ThreadTrace* current = nullptr;
+thread_local bool busy = false;
+
+NO_INSTRUMENT uint64_t hash_string(const char* str, uint64_t hash = 0xcbf29ce484222325ULL) {
+    for (; *str; ++str) {
+        hash = (hash ^ (unsigned char)*str) * PRIME;
+    }
+    return hash;
+}
+
+/**
+ * Hash a function by its symbol name, or by module and offset without one
+ */
+NO_INSTRUMENT uint64_t hash_function(void* function) {
+    Dl_info info;
+    if (!dladdr(function, &info)) {
+        return (uint64_t)(uintptr_t)function;
+    }
+    if (info.dli_sname) {
+        return hash_string(info.dli_sname);
+    }
+    const char* module = info.dli_fname ? strrchr(info.dli_fname, '/') : nullptr;
+    uint64_t hash = hash_string(module ? module + 1 : (info.dli_fname ? info.dli_fname : ""));
+    return (hash ^ ((uintptr_t)function - (uintptr_t)info.dli_fbase)) * PRIME;
+}
+
+/**
+ * Get the demangled name of a function
+ */
+NO_INSTRUMENT std::string function_name(void* function) {
+    Dl_info info;
+    if (!dladdr(function, &info)) {
+        char address[32];
+        snprintf(address, sizeof(address), "%p", function);
+        return address;
+    }
+    if (!info.dli_sname) {
+        char location[32];
+        snprintf(location, sizeof(location), "+0x%lx", (unsigned long)((uintptr_t)function - (uintptr_t)info.dli_fbase));
+        const char* module = info.dli_fname ? strrchr(info.dli_fname, '/') : nullptr;
+        return std::string(module ? module + 1 : "?") + location;
+    }
+    int status;
+    char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    std::string name = status == 0 ? demangled : info.dli_sname;
+    free(demangled);
+    return name;
+}
+
+NO_INSTRUMENT uint64_t power(uint64_t base, uint64_t exponent) {
+    uint64_t result = 1;
+    for (; exponent; exponent >>= 1) {
+        if (exponent & 1) result *= base;
+        base *= base;
+    }
+    return result;
+}
+
+NO_INSTRUMENT ThreadTrace* register_thread() {
+    ThreadTrace* trace = new ThreadTrace();
+    trace->sequence.store(0);
+    trace->digest.store(0);
+    trace->events.store(0);
+    trace->base_digest = 0;
+    trace->base_events = 0;
+
+    const char* env = getenv("CODETANGO_CALLTRACE_RING");
+    trace->ring.resize(env && atol(env) > 0 ? atol(env) : 256);
+    memset(trace->cache_functions, 0, sizeof(trace->cache_functions));
+
+    std::lock_guard<std::mutex> guard(registry_mutex);
+    trace->index = registry.size();
+    registry.push_back(trace);
+    return trace;
+}
+
+NO_INSTRUMENT void on_event(void* function, int exit) {
+    if (busy) return;
+    busy = true;
+
+    ThreadTrace* trace = current ? current : (current = register_thread());
+
+    size_t slot = ((uintptr_t)function >> 4) % CACHE_SIZE;
+    uint64_t hash;
+    if (trace->cache_functions[slot] == function) {
+        hash = trace->cache_hashes[slot];
+    } else {
+        hash = hash_function(function);
+        trace->cache_functions[slot] = function;
+        trace->cache_hashes[slot] = hash;
+    }
+    if (exit) hash ^= EXIT_SALT;
+
+    uint32_t sequence = trace->sequence.load(std::memory_order_relaxed);
+    trace->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    uint64_t events = trace->events.load(std::memory_order_relaxed);
+    trace->ring[events % trace->ring.size()] = {function, exit};
+    trace->digest.store(trace->digest.load(std::memory_order_relaxed) * PRIME + hash, std::memory_order_relaxed);
+    trace->events.store(events + 1, std::memory_order_relaxed);
+
+    trace->sequence.store(sequence + 2, std::memory_order_release);
+    busy = false;
+}
+
+} // namespace
+
+extern "C" NO_INSTRUMENT void __cyg_profile_func_enter(void* function, void* /*call_site*/) {
+    on_event(function, 0);
+}
+
+extern "C" NO_INSTRUMENT void __cyg_profile_func_exit(void* function, void* /*call_site*/) {
+    on_event(function, 1);
+}
+
+/**
+ * Pass the digests of the calls made by each thread since the previous call
+ *
+ * @param sink Receives the digest of each thread
+ * @param ctx Passed to the sink
+ */
+extern "C" NO_INSTRUMENT void codetango_calltrace_digests(codetango_calltrace_digest_sink sink, void* ctx) {
+    std::vector<ThreadTrace*> traces;
+    {
+        std::lock_guard<std::mutex> guard(registry_mutex);
+        traces = registry;
+    }
+
+    for (ThreadTrace* trace : traces) {
+        uint32_t before, after;
+        uint64_t digest, events;
+        do {
+            before = trace->sequence.load(std::memory_order_acquire);
+            digest = trace->digest.load(std::memory_order_relaxed);
+            events = trace->events.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = trace->sequence.load(std::memory_order_relaxed);
+        } while ((before & 1) || before != after);
+
+        codetango_call_digest segment;
+        segment.thread = trace->index;
+        segment.events = events - trace->base_events;
+        segment.digest = digest - trace->base_digest * power(PRIME, segment.events);
+        trace->base_digest = digest;
+        trace->base_events = events;
+        sink(ctx, &segment);
+    }
+}
+
+/**
+ * Pass the most recent events of a thread
+ *
+ * @param thread The index of the thread
+ * @param count The maximum number of events
+ * @param sink Receives the events
+ * @param ctx Passed to the sink
+ * @return The number of events passed
+ */
+extern "C" NO_INSTRUMENT size_t codetango_calltrace_ring(unsigned thread, size_t count,
+                                                         codetango_calltrace_event_sink sink, void* ctx) {
+    ThreadTrace* trace;
+    {
+        std::lock_guard<std::mutex> guard(registry_mutex);
+        if (thread >= registry.size()) return 0;
+        trace = registry[thread];
+    }
+
+    uint64_t events = trace->events.load(std::memory_order_acquire);
+    size_t n = std::min<uint64_t>(std::min<uint64_t>(count, trace->ring.size()), events);
+    for (uint64_t i = events - n; i < events; ++i) {
+        const Event& event = trace->ring[i % trace->ring.size()];
+        sink(ctx, event.exit, function_name(event.function).c_str());
+    }
+    return n;
+}
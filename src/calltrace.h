@@ -0,0 +1,60 @@
+#ifndef CODETANGO_CALLTRACE_H
+#define CODETANGO_CALLTRACE_H
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Interface between libcodetango and the call tracing runtime
+ * libcodetango_calltrace.so, which is linked into programs compiled with
+ * -finstrument-functions. libcodetango finds these functions with dlsym(),
+ * so programs run unchanged without the runtime.
+ */
+
+extern "C" {
+
+/**
+ * The calls of a thread since the previous codetango_calltrace_digests()
+ */
+struct codetango_call_digest {
+    unsigned thread;   // The index of the thread, in the order of its first call
+    uint64_t digest;   // Digest of the sequence of function entries and exits
+    uint64_t events;   // The number of entries and exits
+};
+
+/**
+ * Receives the digest of a thread
+ */
+typedef void (*codetango_calltrace_digest_sink)(void* ctx, const codetango_call_digest* digest);
+
+/**
+ * Receives an event of the ring of a thread, oldest first
+ * 
+ * @param ctx The context given to codetango_calltrace_ring()
+ * @param exit Whether the event is a function exit rather than an entry
+ * @param function The demangled name of the function
+ */
+typedef void (*codetango_calltrace_event_sink)(void* ctx, int exit, const char* function);
+
+/**
+ * Pass the digests of the calls made by each thread since the previous call
+ * 
+ * @param sink Receives the digest of each thread
+ * @param ctx Passed to the sink
+ */
+void codetango_calltrace_digests(codetango_calltrace_digest_sink sink, void* ctx);
+
+/**
+ * Pass the most recent events of a thread
+ * 
+ * @param thread The index of the thread
+ * @param count The maximum number of events
+ * @param sink Receives the events
+ * @param ctx Passed to the sink
+ * @return The number of events passed
+ */
+size_t codetango_calltrace_ring(unsigned thread, size_t count, codetango_calltrace_event_sink sink, void* ctx);
+
+}
+
+#endif // CODETANGO_CALLTRACE_H
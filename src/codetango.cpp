@@ -1,31 +1,349 @@
 #include "codetango.h"
+#include "mathtrace.h"
+#include "calltrace.h"
+#include "probes.h"
 #include <string>
 #include <map>
 #include <vector>
 #include <iostream>
 #include <sstream>
+#include <fstream>
 #include <iomanip>
+#include <algorithm>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+#include <linux/hw_breakpoint.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <cxxabi.h>
+#include <atomic>
+#include <climits>
+#include <cstdlib>
 #include <cstring>
 #include <stdexcept>
 
 using namespace codetango;
 
+/**
+ * Apply a per-record mask to a region
+ * 
+ * The mask is tiled to a whole number of records first, so that the inner
+ * loop is a plain byte-wise AND that the compiler can vectorize.
+ * 
+ * @param out The masked copy, of the region size
+ * @param in The region
+ * @param bytes The size of the region in bytes
+ * @param mask The per-record mask
+ */
+static void apply_region_mask(unsigned char* out, const unsigned char* in, size_t bytes,
+                              const std::vector<unsigned char>& mask) {
+    const size_t records_per_tile = (4096 + mask.size() - 1) / mask.size();
+    std::vector<unsigned char> tile(records_per_tile * mask.size());
+    for (size_t i = 0; i < tile.size(); ++i) {
+        tile[i] = mask[i % mask.size()];
+    }
+    
+    for (size_t offset = 0; offset < bytes; offset += tile.size()) {
+        size_t n = std::min(tile.size(), bytes - offset);
+        const unsigned char* src = in + offset;
+        unsigned char* dst = out + offset;
+        const unsigned char* m = tile.data();
+        for (size_t i = 0; i < n; ++i) {
+            dst[i] = src[i] & m[i];
+        }
+    }
+}
+
+/**
+ * Read the I/O and syscall counters of this process
+ * 
+ * @param counters Receives the counters of /proc/self/io and getrusage()
+ */
+static void read_accounting(std::map<std::string, long long>& counters) {
+    // Unreadable in some containers, in which case only getrusage() counts
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    long long value;
+    while (io >> key >> value) {
+        if (!key.empty() && key.back() == ':') key.pop_back();
+        if (key != "cancelled_write_bytes") counters[key] = value;
+    }
+    
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        counters["voluntary_ctxt_switches"] = usage.ru_nvcsw;
+        counters["involuntary_ctxt_switches"] = usage.ru_nivcsw;
+        counters["minor_page_faults"] = usage.ru_minflt;
+        counters["major_page_faults"] = usage.ru_majflt;
+    }
+}
+
+// FNV-1a parameters, for hashing the name tables of scalars
+static const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+static const uint64_t FNV_PRIME = 1099511628211ULL;
+
+/**
+ * Read a JSON object whose values are strings, e.g. {"a":"1","b":"2"}
+ * 
+ * @param json The JSON text
+ * @param pos The position of the opening brace
+ * @return The members of the object
+ */
+static std::map<std::string, std::string> parse_string_object(const std::string& json, size_t pos) {
+    std::map<std::string, std::string> members;
+    std::string strings[2];
+    int index = 0;
+    for (size_t i = pos + 1; i < json.size() && json[i] != '}'; ++i) {
+        if (json[i] != '"') continue;
+        std::string& str = strings[index];
+        str.clear();
+        for (++i; i < json.size() && json[i] != '"'; ++i) {
+            if (json[i] != '\\' || i + 1 == json.size()) {
+                str += json[i];
+                continue;
+            }
+            char c = json[++i];
+            if (c == 'u' && i + 4 < json.size()) {
+                // Non-ASCII characters arrive as \uXXXX; encode them as UTF-8
+                unsigned code = strtoul(json.substr(i + 1, 4).c_str(), nullptr, 16);
+                i += 4;
+                if (code < 0x80) {
+                    str += static_cast<char>(code);
+                } else if (code < 0x800) {
+                    str += static_cast<char>(0xC0 | code >> 6);
+                    str += static_cast<char>(0x80 | (code & 0x3F));
+                } else {
+                    str += static_cast<char>(0xE0 | code >> 12);
+                    str += static_cast<char>(0x80 | (code >> 6 & 0x3F));
+                    str += static_cast<char>(0x80 | (code & 0x3F));
+                }
+            } else {
+                str += c == 'n' ? '\n' : c == 't' ? '\t' : c == 'r' ? '\r' : c;
+            }
+        }
+        if (index == 1) {
+            members[strings[0]] = strings[1];
+        }
+        index = 1 - index;
+    }
+    return members;
+}
+
+// Names kept in an enable table before it starts over, for names made up at run time
+static const size_t FILTER_TABLE_LIMIT = 65536;
+
+/**
+ * Check whether a name is enabled: it matches an include pattern, or there
+ * are none, and no exclude pattern
+ * 
+ * The patterns are matched once per name, and the result kept in the table.
+ * 
+ * @param name The barrier ID or variable name
+ * @return Whether the name is enabled
+ */
+bool Barrier::Filter::enables(const std::string& name) {
+    auto known = enabled.find(name);
+    if (known != enabled.end()) {
+        return known->second;
+    }
+    bool enable = include.empty();
+    for (const auto& pattern : include) {
+        if (fnmatch(pattern.c_str(), name.c_str(), 0) == 0) {
+            enable = true;
+            break;
+        }
+    }
+    for (const auto& pattern : exclude) {
+        if (enable && fnmatch(pattern.c_str(), name.c_str(), 0) == 0) {
+            enable = false;
+        }
+    }
+    if (enabled.size() >= FILTER_TABLE_LIMIT) {
+        enabled.clear();
+    }
+    enabled[name] = enable;
+    return enable;
+}
+
+/**
+ * Split patterns separated by newlines
+ */
+static std::vector<std::string> split_patterns(const std::string& patterns) {
+    std::vector<std::string> result;
+    std::stringstream ss(patterns);
+    std::string pattern;
+    while (std::getline(ss, pattern)) {
+        if (!pattern.empty()) {
+            result.push_back(pattern);
+        }
+    }
+    return result;
+}
+
+namespace {
+
+/**
+ * The ring of writes to a watched variable
+ * 
+ * The signal handler of the breakpoint is the only producer and wait() the
+ * only consumer, so the ring is lock-free: each side only advances its own
+ * index. The slots are static because the handler cannot reach a Barrier.
+ */
+struct WatchSlot {
+    std::atomic<int> fd;
+    const void* address;
+    size_t bytes;
+    uint64_t occurrences;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> dropped;
+    std::vector<unsigned char> records;
+    size_t capacity;
+};
+
+// One slot per hardware breakpoint; x86 and most ARM cores have four
+const int WATCH_SLOTS = 4;
+WatchSlot watch_slots[WATCH_SLOTS];
+
+// Size of a record in the ring: occurrence, instruction pointer, value
+const size_t WATCH_RECORD_SIZE = 3 * sizeof(uint64_t);
+
+/**
+ * Record a write to a watched variable, called on each breakpoint hit
+ */
+void watch_signal_handler(int, siginfo_t* info, void* context) {
+    for (WatchSlot& slot : watch_slots) {
+        if (slot.fd.load(std::memory_order_acquire) != info->si_fd) continue;
+        
+        uint64_t occurrence = slot.occurrences++;
+        uint64_t head = slot.head.load(std::memory_order_relaxed);
+        if (head - slot.tail.load(std::memory_order_acquire) >= slot.capacity) {
+            slot.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        
+        // The breakpoint fires after the write, at the next instruction
+        uint64_t record[3] = {occurrence, 0, 0};
+#if defined(__x86_64__)
+        record[1] = static_cast<ucontext_t*>(context)->uc_mcontext.gregs[REG_RIP];
+#elif defined(__aarch64__)
+        record[1] = static_cast<ucontext_t*>(context)->uc_mcontext.pc;
+#endif
+        memcpy(&record[2], slot.address, slot.bytes);
+        memcpy(&slot.records[(head % slot.capacity) * WATCH_RECORD_SIZE], record, WATCH_RECORD_SIZE);
+        slot.head.store(head + 1, std::memory_order_release);
+        return;
+    }
+}
+
+/**
+ * Describe a code address as function+offset, or module+offset without a symbol
+ */
+std::string describe_address(uint64_t address) {
+    Dl_info info;
+    if (!dladdr(reinterpret_cast<void*>(address), &info)) {
+        std::stringstream ss;
+        ss << "0x" << std::hex << address;
+        return ss.str();
+    }
+    
+    std::stringstream ss;
+    if (info.dli_sname) {
+        int status;
+        char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+        ss << (status == 0 ? demangled : info.dli_sname);
+        free(demangled);
+        ss << "+0x" << std::hex << (address - reinterpret_cast<uint64_t>(info.dli_saddr));
+    } else {
+        const char* module = info.dli_fname ? strrchr(info.dli_fname, '/') : nullptr;
+        ss << (module ? module + 1 : "?");
+        ss << "+0x" << std::hex << (address - reinterpret_cast<uint64_t>(info.dli_fbase));
+    }
+    return ss.str();
+}
+
+} // namespace
+
+/**
+ * Build a region mask from a record layout descriptor
+ * 
+ * @param record_size The size of one record in bytes, e.g. sizeof(T)
+ * @param fields The fields of the record to compare
+ * @return A byte mask of record_size bytes
+ */
+std::vector<unsigned char> codetango::make_region_mask(size_t record_size, const std::vector<RegionField>& fields) {
+    std::vector<unsigned char> mask(record_size, 0);
+    for (const auto& field : fields) {
+        if (field.offset + field.size > record_size) {
+            throw std::invalid_argument("Region field exceeds the record size");
+        }
+        memset(mask.data() + field.offset, 0xff, field.size);
+    }
+    return mask;
+}
+
 /**
  * Constructor
  * 
  * @param program_id A unique identifier for this program
+ * @param schema_hash SCHEMA_HASH of the header generated by codetango schema, or empty
  */
-Barrier::Barrier(const std::string& program_id) : program_id_(program_id), connected_(false) {
+Barrier::Barrier(const std::string& program_id, const std::string& schema_hash) :
+    program_id_(program_id), schema_hash_(schema_hash), connected_(false), rewound_(false),
+    scalar_hash_(FNV_OFFSET), filtered_(false), mathtrace_flush_(nullptr), mathtrace_detach_(nullptr),
+    mathtrace_set_thread_(nullptr) {
+    const char* accounting = getenv("CODETANGO_ACCOUNTING");
+    accounting_ = accounting && strcmp(accounting, "1") == 0;
+    
+    // Barriers and variables enabled by the utility when it launched the program
+    const char* filters = getenv("CODETANGO_FILTERS");
+    if (filters) {
+        std::string json(filters);
+        size_t brace = json.find('{');
+        if (brace != std::string::npos) {
+            set_filters(json, brace);
+        }
+    }
+    
     connect();
+    attach_mathtrace();
+    
+    // Programs not linked with libcodetango_calltrace run unchanged
+    calltrace_digests_ = reinterpret_cast<decltype(calltrace_digests_)>(
+        dlsym(RTLD_DEFAULT, "codetango_calltrace_digests"));
+    calltrace_ring_ = reinterpret_cast<decltype(calltrace_ring_)>(
+        dlsym(RTLD_DEFAULT, "codetango_calltrace_ring"));
+    if (calltrace_digests_) {
+        // Calls made before the connection are not compared
+        read_calltrace();
+    }
+    
+    if (accounting_) {
+        read_accounting(accounting_base_);
+    }
 }
 
 /**
  * Destructor - closes the socket connection
  */
 Barrier::~Barrier() {
+    while (!watches_.empty()) {
+        unwatch(watches_.begin()->first);
+    }
+    if (mathtrace_detach_) {
+        mathtrace_detach_();
+    }
     if (connected_) {
         close(socket_fd_);
     }
@@ -35,42 +353,206 @@ Barrier::~Barrier() {
  * Wait at a barrier until both programs reach this point
  * 
  * @param barrier_id A unique identifier for this barrier point
+ * @param file The source file of the call, for coverage of batch runs
+ * @param line The source line of the call
  * @return true if the barrier was successfully synchronized
  */
-bool Barrier::wait(const std::string& barrier_id) {
+bool Barrier::wait(const std::string& barrier_id, const char* file, int line) {
     if (!connected_) {
         throw std::runtime_error("Not connected to CodeTango utility");
     }
+    if (filtered_ && !barrier_filter_.enables(barrier_id)) {
+        clear_checkpoint();
+        discard_watches();
+        return true;
+    }
+    uint64_t start = probe_clock();
+    
+    // Resource usage of the segment since the previous barrier
+    std::map<std::string, long long> accounting;
+    if (accounting_) {
+        read_accounting(accounting);
+        for (auto& counter : accounting) {
+            counter.second -= accounting_base_[counter.first];
+        }
+    }
+    
+    // Calls made in the segment since the previous barrier
+    if (calltrace_digests_) {
+        read_calltrace();
+    }
+    
+    // Writes to the watched variables, sent after the regions
+    CODETANGO_PROBE1(serialize_begin, barrier_id.c_str());
+    drain_watches();
+    
+    // The names of the scalars are sent only the first time this list of names is used
+    bool scalar_names = !scalar_values_.empty() && scalar_tables_.insert(scalar_hash_).second;
     
     // Prepare the JSON message
-    std::string json = make_barrier_json(barrier_id);
+    std::string site = file ? std::string(file) + ":" + std::to_string(line) : std::string();
+    std::string json = make_barrier_json(barrier_id, accounting, site, scalar_names);
     
-    // Send the barrier message
-    if (send(socket_fd_, json.c_str(), json.size(), 0) == -1) {
-        std::cerr << "Error sending barrier message: " << strerror(errno) << std::endl;
-        return false;
+    // Regions are sent as they are, unless they need masking
+    std::vector<std::vector<unsigned char>> masked;
+    std::vector<std::pair<const void*, size_t>> payload;
+    for (const auto& region : regions_) {
+        const Region& r = region.second;
+        if (r.mask.empty()) {
+            payload.push_back({r.ptr, r.bytes});
+        } else {
+            masked.emplace_back(r.bytes);
+            apply_region_mask(masked.back().data(), r.ptr, r.bytes, r.mask);
+            payload.push_back({masked.back().data(), r.bytes});
+        }
+    }
+    for (const auto& watch : watch_records_) {
+        const std::vector<WatchRecord>& records = watch.second.first;
+        payload.push_back({records.data(), records.size() * sizeof(WatchRecord)});
+    }
+    if (scalar_names) {
+        payload.push_back({scalar_names_.data(), scalar_names_.size()});
+    }
+    if (!scalar_values_.empty()) {
+        payload.push_back({scalar_values_.data(), scalar_values_.size() * sizeof(double)});
+    }
+    for (const auto& lanes : lanes_) {
+        payload.push_back({lanes.second.ptr, lanes.second.count * lanes.second.size});
+    }
+    size_t payload_bytes = 0;
+    for (const auto& part : payload) {
+        payload_bytes += part.second;
+    }
+    CODETANGO_PROBE3(serialize_end, barrier_id.c_str(), json.size(), payload_bytes);
+    
+    // Send the libm calls recorded before the barrier, then the barrier message
+    uint64_t sending = probe_clock();
+    {
+        std::lock_guard<std::recursive_mutex> guard(send_mutex_);
+        if (mathtrace_flush_) {
+            mathtrace_flush_();
+        }
+        if (!send_message(json, payload) || !send_streams()) {
+            std::cerr << "Error sending barrier message: " << strerror(errno) << std::endl;
+            return false;
+        }
     }
+    uint64_t sent = probe_clock();
+    CODETANGO_PROBE3(send, barrier_id.c_str(), json.size() + payload_bytes, sent - sending);
     
     // Wait for the response
-    char buffer[4096];
-    ssize_t received = recv(socket_fd_, buffer, sizeof(buffer) - 1, 0);
-    if (received <= 0) {
+    std::string response;
+    if (!recv_message(response)) {
         std::cerr << "Error receiving barrier response: " 
-                 << (received == 0 ? "Connection closed" : strerror(errno)) << std::endl;
+                 << (errno == 0 ? "Connection closed" : strerror(errno)) << std::endl;
         return false;
     }
     
-    // Null-terminate the buffer
-    buffer[received] = '\0';
+    // On a call sequence mismatch, the utility asks for the recent calls
+    // before it sends the result
+    if (response.find("\"send_calltrace\":true") != std::string::npos) {
+        if (!send_calltrace_ring() || !recv_message(response)) {
+            std::cerr << "Error exchanging call trace: "
+                     << (errno == 0 ? "Connection closed" : strerror(errno)) << std::endl;
+            return false;
+        }
+    }
+    
+    CODETANGO_PROBE3(receive, barrier_id.c_str(), response.size(), probe_clock() - sent);
     
     // Parse the response
     // For simplicity, we'll just check if it contains "success"
-    std::string response(buffer);
     bool success = response.find("\"status\":\"success\"") != std::string::npos;
     
     // Clear the variables after the barrier
+    clear_checkpoint();
+    
+    // Filters changed while the programs run apply from the next barrier on
+    size_t filters = response.find("\"filters\":{");
+    if (filters != std::string::npos) {
+        set_filters(response, filters + 10);
+    }
+    
+    // At every few matching barriers, the utility asks for a snapshot
+    size_t snapshot = response.find("\"snapshot\":");
+    if (success && snapshot != std::string::npos) {
+        take_snapshot(atoi(response.c_str() + snapshot + 11), barrier_id);
+    }
+    
+    // The next segment starts now, excluding the time spent at the barrier
+    if (accounting_) {
+        read_accounting(accounting_base_);
+    }
+    
+    CODETANGO_PROBE3(release, barrier_id.c_str(), success, probe_clock() - start);
+    return success;
+}
+
+/**
+ * Discard the variables registered for the current barrier
+ */
+void Barrier::clear_checkpoint() {
     variables_.clear();
+    regions_.clear();
+    files_.clear();
+    streams_.clear();
+    watch_records_.clear();
+    scalar_names_.clear();
+    scalar_values_.clear();
+    scalar_hash_ = FNV_OFFSET;
+    lanes_.clear();
+}
+
+/**
+ * Wait at a barrier with a fixed-layout checkpoint record
+ * 
+ * @param index The index of the barrier in the schema
+ * @param barrier_id The name of the barrier, sent only with snapshots
+ * @param record The packed record
+ * @param bytes The size of the record in bytes
+ * @return true if the barrier was successfully synchronized
+ */
+bool Barrier::wait_record(unsigned index, const char* barrier_id, const void* record, size_t bytes) {
+    if (!connected_) {
+        throw std::runtime_error("Not connected to CodeTango utility");
+    }
+    if (filtered_ && !barrier_filter_.enables(barrier_id)) {
+        return true;
+    }
+    
+    uint64_t start = probe_clock();
+    std::string header = "{\"record\":" + std::to_string(index) + ",\"binary\":" + std::to_string(bytes) + "}";
+    {
+        std::lock_guard<std::recursive_mutex> guard(send_mutex_);
+        if (mathtrace_flush_) {
+            mathtrace_flush_();
+        }
+        if (!send_message(header, {{record, bytes}})) {
+            std::cerr << "Error sending barrier record: " << strerror(errno) << std::endl;
+            return false;
+        }
+    }
+    uint64_t sent = probe_clock();
+    CODETANGO_PROBE3(send, barrier_id, header.size() + bytes, sent - start);
+    
+    std::string response;
+    if (!recv_message(response)) {
+        std::cerr << "Error receiving barrier response: "
+                 << (errno == 0 ? "Connection closed" : strerror(errno)) << std::endl;
+        return false;
+    }
+    CODETANGO_PROBE3(receive, barrier_id, response.size(), probe_clock() - sent);
+    bool success = response.find("\"status\":\"success\"") != std::string::npos;
+    size_t filters = response.find("\"filters\":{");
+    if (filters != std::string::npos) {
+        set_filters(response, filters + 10);
+    }
     
+    size_t snapshot = response.find("\"snapshot\":");
+    if (success && snapshot != std::string::npos) {
+        take_snapshot(atoi(response.c_str() + snapshot + 11), barrier_id);
+    }
+    CODETANGO_PROBE3(release, barrier_id, success, probe_clock() - start);
     return success;
 }
 
@@ -81,6 +563,8 @@ bool Barrier::wait(const std::string& barrier_id) {
  * @param value The value of the variable
  */
 void Barrier::add_int(const std::string& name, int value) {
+    if (filtered_ && !variable_filter_.enables(name)) return;
+    CODETANGO_PROBE3(add, name.c_str(), "int", sizeof(value));
     std::stringstream ss;
     ss << value;
     variables_[name] = {"int", ss.str()};
@@ -93,6 +577,8 @@ void Barrier::add_int(const std::string& name, int value) {
  * @param value The value of the variable
  */
 void Barrier::add_double(const std::string& name, double value) {
+    if (filtered_ && !variable_filter_.enables(name)) return;
+    CODETANGO_PROBE3(add, name.c_str(), "double", sizeof(value));
     std::stringstream ss;
     ss << value;
     variables_[name] = {"double", ss.str()};
@@ -105,6 +591,8 @@ void Barrier::add_double(const std::string& name, double value) {
  * @param value The value of the variable
  */
 void Barrier::add_string(const std::string& name, const std::string& value) {
+    if (filtered_ && !variable_filter_.enables(name)) return;
+    CODETANGO_PROBE3(add, name.c_str(), "string", value.size());
     variables_[name] = {"string", value};
 }
 
@@ -115,6 +603,8 @@ void Barrier::add_string(const std::string& name, const std::string& value) {
  * @param value The value of the variable
  */
 void Barrier::add_bool(const std::string& name, bool value) {
+    if (filtered_ && !variable_filter_.enables(name)) return;
+    CODETANGO_PROBE3(add, name.c_str(), "bool", sizeof(value));
     variables_[name] = {"bool", value ? "true" : "false"};
 }
 
@@ -125,6 +615,8 @@ void Barrier::add_bool(const std::string& name, bool value) {
  * @param values The vector of values
  */
 void Barrier::add_int_vector(const std::string& name, const std::vector<int>& values) {
+    if (filtered_ && !variable_filter_.enables(name)) return;
+    CODETANGO_PROBE3(add, name.c_str(), "int_vector", values.size() * sizeof(int));
     std::stringstream ss;
     ss << "[";
     for (size_t i = 0; i < values.size(); ++i) {
@@ -142,6 +634,8 @@ void Barrier::add_int_vector(const std::string& name, const std::vector<int>& va
  * @param values The vector of values
  */
 void Barrier::add_double_vector(const std::string& name, const std::vector<double>& values) {
+    if (filtered_ && !variable_filter_.enables(name)) return;
+    CODETANGO_PROBE3(add, name.c_str(), "double_vector", values.size() * sizeof(double));
     std::stringstream ss;
     ss << "[";
     for (size_t i = 0; i < values.size(); ++i) {
@@ -152,10 +646,423 @@ void Barrier::add_double_vector(const std::string& name, const std::vector<doubl
     variables_[name] = {"double_vector", ss.str()};
 }
 
+/**
+ * Register a scalar to be compared at the next barrier, for checkpoints of many scalars
+ * 
+ * @param name The name of the scalar
+ * @param value The value of the scalar
+ */
+void Barrier::add_scalar(const std::string& name, double value) {
+    if (filtered_ && !variable_filter_.enables(name)) return;
+    CODETANGO_PROBE3(add, name.c_str(), "scalar", sizeof(value));
+    // The separator is hashed too, so that the list of names is hashed unambiguously
+    for (size_t i = 0; i <= name.size(); ++i) {
+        scalar_hash_ = (scalar_hash_ ^ static_cast<unsigned char>(name.c_str()[i])) * FNV_PRIME;
+    }
+    scalar_names_.append(name.c_str(), name.size() + 1);
+    scalar_values_.push_back(value);
+}
+
+/**
+ * Register a variable of a batch of independent problems, one value per lane
+ * 
+ * @param name The name of the variable
+ * @param values The value of each lane
+ * @param lanes The number of lanes
+ */
+void Barrier::add_lanes(const std::string& name, const double* values, size_t lanes) {
+    if (filtered_ && !variable_filter_.enables(name)) return;
+    CODETANGO_PROBE3(add, name.c_str(), "lanes", lanes * sizeof(*values));
+    lanes_[name] = {values, lanes, "float64", sizeof(*values)};
+}
+
+void Barrier::add_lanes(const std::string& name, const float* values, size_t lanes) {
+    if (filtered_ && !variable_filter_.enables(name)) return;
+    CODETANGO_PROBE3(add, name.c_str(), "lanes", lanes * sizeof(*values));
+    lanes_[name] = {values, lanes, "float32", sizeof(*values)};
+}
+
+void Barrier::add_lanes(const std::string& name, const int* values, size_t lanes) {
+    if (filtered_ && !variable_filter_.enables(name)) return;
+    CODETANGO_PROBE3(add, name.c_str(), "lanes", lanes * sizeof(*values));
+    lanes_[name] = {values, lanes, "int32", sizeof(*values)};
+}
+
+void Barrier::add_lanes(const std::string& name, const int64_t* values, size_t lanes) {
+    if (filtered_ && !variable_filter_.enables(name)) return;
+    CODETANGO_PROBE3(add, name.c_str(), "lanes", lanes * sizeof(*values));
+    lanes_[name] = {values, lanes, "int64", sizeof(*values)};
+}
+
+/**
+ * Register a raw memory region to be compared byte-wise at the next barrier
+ * 
+ * @param name The name of the region
+ * @param ptr Pointer to the first byte of the region
+ * @param bytes The size of the region in bytes
+ * @param mask Optional per-record bitmask, see make_region_mask()
+ */
+void Barrier::add_region(const std::string& name, const void* ptr, size_t bytes,
+                         const std::vector<unsigned char>& mask) {
+    if (filtered_ && !variable_filter_.enables(name)) return;
+    CODETANGO_PROBE3(add, name.c_str(), "region", bytes);
+    if (!mask.empty() && bytes % mask.size() != 0) {
+        throw std::invalid_argument("Region size is not a multiple of the mask size");
+    }
+    regions_[name] = {static_cast<const unsigned char*>(ptr), bytes, mask, {}, {}};
+}
+
+/**
+ * Get the size of an element type
+ * 
+ * @param dtype The element type: bytes, int8..int64, uint8..uint64, float32 or float64
+ * @return The size in bytes, or 0 if the type is unknown
+ */
+static size_t dtype_size(const std::string& dtype) {
+    if (dtype == "bytes" || dtype == "int8" || dtype == "uint8") return 1;
+    if (dtype == "int16" || dtype == "uint16") return 2;
+    if (dtype == "int32" || dtype == "uint32" || dtype == "float32") return 4;
+    if (dtype == "int64" || dtype == "uint64" || dtype == "float64") return 8;
+    return 0;
+}
+
+/**
+ * Register an array with a shape to be compared at the next barrier
+ * 
+ * @param name The name of the grid
+ * @param ptr Pointer to the first cell, cells in row-major order
+ * @param shape The extent of each axis, slowest first
+ * @param dtype The element type
+ */
+void Barrier::add_grid(const std::string& name, const void* ptr, const std::vector<size_t>& shape,
+                       const std::string& dtype) {
+    if (filtered_ && !variable_filter_.enables(name)) return;
+    size_t size = dtype_size(dtype);
+    if (size == 0 || shape.empty()) {
+        throw std::invalid_argument("Grid " + name + " needs a shape and a known dtype");
+    }
+    size_t cells = 1;
+    for (size_t extent : shape) {
+        cells *= extent;
+    }
+    add_region(name, ptr, cells * size);
+    Region& region = regions_[name];
+    region.shape = shape;
+    region.dtype = dtype;
+}
+
+void Barrier::add_grid(const std::string& name, const double* data, const std::vector<size_t>& shape) {
+    add_grid(name, data, shape, "float64");
+}
+
+void Barrier::add_grid(const std::string& name, const float* data, const std::vector<size_t>& shape) {
+    add_grid(name, data, shape, "float32");
+}
+
+/**
+ * Register a region of a file to be compared at the next barrier
+ * 
+ * @param name The name of the region
+ * @param path The path of the file
+ * @param offset The offset of the region in the file, in bytes
+ * @param length The length of the region in bytes
+ * @param dtype The element type: bytes, int8..int64, uint8..uint64, float32 or float64
+ * @param sync Whether to fdatasync() the file before the barrier
+ */
+void Barrier::add_file_region(const std::string& name, const std::string& path, size_t offset, size_t length,
+                              const std::string& dtype, bool sync) {
+    if (filtered_ && !variable_filter_.enables(name)) return;
+    CODETANGO_PROBE3(add, name.c_str(), "file_region", length);
+    // The utility may run in another directory
+    char resolved[PATH_MAX];
+    if (!realpath(path.c_str(), resolved)) {
+        throw std::runtime_error("Failed to resolve " + path + ": " + strerror(errno));
+    }
+    
+    int fd = open(resolved, O_RDONLY);
+    if (fd == -1) {
+        throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < offset + length) {
+        close(fd);
+        throw std::runtime_error("File region exceeds the size of " + path);
+    }
+    if (sync && fdatasync(fd) == -1) {
+        close(fd);
+        throw std::runtime_error("Failed to sync " + path + ": " + strerror(errno));
+    }
+    close(fd);
+    
+    files_[name] = {resolved, offset, length, dtype};
+}
+
+/**
+ * Register a stream of doubles to be compared at the next barrier
+ * 
+ * @param name The name of the stream
+ * @param generator The chunk generator
+ */
+void Barrier::add_double_stream(const std::string& name, const std::function<bool(std::vector<double>&)>& generator) {
+    if (filtered_ && !variable_filter_.enables(name)) return;
+    CODETANGO_PROBE3(add, name.c_str(), "double_stream", 0);
+    std::vector<double> chunk;
+    streams_[name] = {"float64", [generator, chunk](const void*& data, size_t& bytes) mutable {
+        chunk.clear();
+        if (!generator(chunk)) return false;
+        data = chunk.data();
+        bytes = chunk.size() * sizeof(double);
+        return true;
+    }};
+}
+
+/**
+ * Register a stream of integers to be compared at the next barrier
+ * 
+ * @param name The name of the stream
+ * @param generator The chunk generator, see add_double_stream()
+ */
+void Barrier::add_int_stream(const std::string& name, const std::function<bool(std::vector<int>&)>& generator) {
+    if (filtered_ && !variable_filter_.enables(name)) return;
+    CODETANGO_PROBE3(add, name.c_str(), "int_stream", 0);
+    std::vector<int> chunk;
+    streams_[name] = {"int32", [generator, chunk](const void*& data, size_t& bytes) mutable {
+        chunk.clear();
+        if (!generator(chunk)) return false;
+        data = chunk.data();
+        bytes = chunk.size() * sizeof(int);
+        return true;
+    }};
+}
+
+/**
+ * Record every write to a variable, to be compared at the following barriers
+ * 
+ * @param name The name of the variable
+ * @param var The variable, which must stay valid until unwatch()
+ */
+void Barrier::watch(const std::string& name, const int* var) {
+    watch_variable(name, var, sizeof(*var), "int32");
+}
+
+void Barrier::watch(const std::string& name, const long long* var) {
+    watch_variable(name, var, sizeof(*var), "int64");
+}
+
+void Barrier::watch(const std::string& name, const float* var) {
+    watch_variable(name, var, sizeof(*var), "float32");
+}
+
+void Barrier::watch(const std::string& name, const double* var) {
+    watch_variable(name, var, sizeof(*var), "float64");
+}
+
+/**
+ * Arm a hardware data breakpoint on a variable
+ * 
+ * The breakpoint counts writes and signals this thread on each of them;
+ * the handler records the value right after the write.
+ * 
+ * @param name The name of the variable
+ * @param ptr The address of the variable
+ * @param bytes The size of the variable: 1, 2, 4 or 8
+ * @param dtype The element type of the variable
+ */
+void Barrier::watch_variable(const std::string& name, const void* ptr, size_t bytes, const std::string& dtype) {
+    if (reinterpret_cast<uintptr_t>(ptr) % bytes != 0) {
+        throw std::invalid_argument("Watched variable " + name + " is not aligned");
+    }
+    unwatch(name);
+    
+    int slot = 0;
+    while (slot < WATCH_SLOTS && watch_slots[slot].fd.load() > 0) ++slot;
+    if (slot == WATCH_SLOTS) {
+        throw std::runtime_error("Cannot watch " + name + ": all hardware breakpoints are in use");
+    }
+    
+    // The handler is shared by all watches and installed once
+    static int signal_number = SIGRTMIN + 1;
+    static bool handler_installed = false;
+    if (!handler_installed) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = watch_signal_handler;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(signal_number, &action, nullptr) == -1) {
+            throw std::runtime_error(std::string("Failed to install the watch signal handler: ") + strerror(errno));
+        }
+        handler_installed = true;
+    }
+    
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_BREAKPOINT;
+    attr.bp_type = HW_BREAKPOINT_W;
+    attr.bp_addr = reinterpret_cast<uintptr_t>(ptr);
+    attr.bp_len = bytes;
+    attr.sample_period = 1;
+    attr.wakeup_events = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.disabled = 1;
+    
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd == -1) {
+        throw std::runtime_error("Cannot watch " + name + ": " + strerror(errno));
+    }
+    
+    const char* env = getenv("CODETANGO_WATCH_LIMIT");
+    WatchSlot& s = watch_slots[slot];
+    s.address = ptr;
+    s.bytes = bytes;
+    s.occurrences = 0;
+    s.head.store(0);
+    s.tail.store(0);
+    s.dropped.store(0);
+    s.capacity = env && atol(env) > 0 ? atol(env) : 65536;
+    s.records.assign(s.capacity * WATCH_RECORD_SIZE, 0);
+    s.fd.store(fd, std::memory_order_release);
+    
+    // Each write signals the calling thread
+    struct f_owner_ex owner;
+    owner.type = F_OWNER_TID;
+    owner.pid = syscall(SYS_gettid);
+    if (fcntl(fd, F_SETFL, O_ASYNC) == -1 || fcntl(fd, F_SETSIG, signal_number) == -1 ||
+        fcntl(fd, F_SETOWN_EX, &owner) == -1 || ioctl(fd, PERF_EVENT_IOC_ENABLE, 0) == -1) {
+        int error = errno;
+        s.fd.store(0);
+        close(fd);
+        throw std::runtime_error("Cannot watch " + name + ": " + strerror(error));
+    }
+    
+    watches_[name] = {slot, dtype};
+}
+
+/**
+ * Stop recording the writes to a variable
+ * 
+ * @param name The name of the variable
+ */
+void Barrier::unwatch(const std::string& name) {
+    auto watch = watches_.find(name);
+    if (watch == watches_.end()) return;
+    
+    WatchSlot& slot = watch_slots[watch->second.slot];
+    int fd = slot.fd.exchange(0);
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    close(fd);
+    slot.records.clear();
+    watches_.erase(watch);
+}
+
+/**
+ * Take the writes recorded since the previous barrier out of the rings
+ */
+void Barrier::drain_watches() {
+    for (const auto& watch : watches_) {
+        WatchSlot& slot = watch_slots[watch.second.slot];
+        uint64_t head = slot.head.load(std::memory_order_acquire);
+        uint64_t tail = slot.tail.load(std::memory_order_relaxed);
+        
+        std::vector<WatchRecord>& records = watch_records_[watch.first].first;
+        records.resize(head - tail);
+        for (uint64_t i = tail; i < head; ++i) {
+            memcpy(&records[i - tail], &slot.records[(i % slot.capacity) * WATCH_RECORD_SIZE], WATCH_RECORD_SIZE);
+        }
+        slot.tail.store(head, std::memory_order_release);
+        watch_records_[watch.first].second = slot.dropped.exchange(0);
+    }
+}
+
+/**
+ * Drop the writes recorded since the previous barrier, at a disabled barrier
+ */
+void Barrier::discard_watches() {
+    for (const auto& watch : watches_) {
+        WatchSlot& slot = watch_slots[watch.second.slot];
+        slot.tail.store(slot.head.load(std::memory_order_acquire), std::memory_order_release);
+        slot.dropped.store(0, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Fork a snapshot of the program, which the utility can resume after a divergence
+ * 
+ * The program returns at once. The snapshot opens a connection of its own
+ * and waits on it: it exits when the utility closes the connection, or
+ * returns from here in place of the program when the utility resumes it,
+ * with the environment the utility sends. Only the calling thread is copied.
+ * 
+ * @param snapshot The number of the snapshot
+ * @param barrier_id The ID of the barrier the snapshot is taken at
+ */
+void Barrier::take_snapshot(int snapshot, const std::string& barrier_id) {
+    // Snapshots the utility discarded have exited
+    snapshots_.erase(std::remove_if(snapshots_.begin(), snapshots_.end(),
+                                    [](pid_t pid) { return waitpid(pid, nullptr, WNOHANG) != 0; }),
+                     snapshots_.end());
+    
+    // Output buffered so far belongs to the program only
+    std::cout.flush();
+    fflush(nullptr);
+    
+    pid_t pid = fork();
+    if (pid != 0) {
+        if (pid > 0) snapshots_.push_back(pid);
+        return;
+    }
+    
+    // The connection of the program is shared with the snapshot: leave it alone
+    close(socket_fd_);
+    connected_ = false;
+    recv_buffer_.clear();
+    std::string message;
+    try {
+        connect(",\"snapshot\":" + std::to_string(snapshot) + ",\"barrier_id\":\"" +
+                escape_json_string(barrier_id) + "\",\"pid\":" + std::to_string(getpid()));
+    } catch (const std::exception&) {
+        _exit(0);
+    }
+    if (!recv_message(message) || message.find("\"resume\":true") == std::string::npos) {
+        _exit(0);
+    }
+    
+    size_t env = message.find("\"env\":{");
+    if (env != std::string::npos) {
+        for (const auto& var : parse_string_object(message, env + 6)) {
+            setenv(var.first.c_str(), var.second.c_str(), 1);
+        }
+    }
+    rewound_ = true;
+    snapshots_.clear();
+    
+    // Breakpoints signal the thread that armed them: arm them again for this one
+    std::map<std::string, Watch> watches;
+    watches.swap(watches_);
+    for (const auto& watch : watches) {
+        WatchSlot& slot = watch_slots[watch.second.slot];
+        const void* address = slot.address;
+        size_t bytes = slot.bytes;
+        close(slot.fd.exchange(0));
+        watch_variable(watch.first, address, bytes, watch.second.dtype);
+    }
+}
+
+/**
+ * Whether the program runs again from a snapshot, after a divergence
+ */
+bool Barrier::rewound() const {
+    return rewound_;
+}
+
 /**
  * Connect to the CodeTango control utility
+ * 
+ * @param fields More fields of the initialization message, as JSON starting with a comma
  */
-void Barrier::connect() {
+void Barrier::connect(const std::string& fields) {
     // Get the socket path from the environment
     const char* socket_path = getenv("CODETANGO_SOCKET");
     if (!socket_path) {
@@ -180,8 +1087,12 @@ void Barrier::connect() {
     }
     
     // Send the initialization message
-    std::string init_json = "{\"program_id\":\"" + program_id_ + "\"}";
-    if (send(socket_fd_, init_json.c_str(), init_json.size(), 0) == -1) {
+    std::string init_json = "{\"program_id\":\"" + program_id_ + "\"";
+    if (!schema_hash_.empty()) {
+        init_json += ",\"schema\":\"" + escape_json_string(schema_hash_) + "\"";
+    }
+    init_json += fields + "}";
+    if (!send_message(init_json, {})) {
         close(socket_fd_);
         throw std::runtime_error(std::string("Failed to send init message: ") + strerror(errno));
     }
@@ -189,16 +1100,162 @@ void Barrier::connect() {
     connected_ = true;
 }
 
+/**
+ * Replace the filters with those sent by the utility
+ * 
+ * @param json A JSON object of patterns separated by newlines: include_barriers,
+ *             exclude_barriers, include_variables and exclude_variables
+ * @param pos The position of its opening brace
+ */
+void Barrier::set_filters(const std::string& json, size_t pos) {
+    std::map<std::string, std::string> patterns = parse_string_object(json, pos);
+    barrier_filter_ = Filter();
+    barrier_filter_.include = split_patterns(patterns["include_barriers"]);
+    barrier_filter_.exclude = split_patterns(patterns["exclude_barriers"]);
+    variable_filter_ = Filter();
+    variable_filter_.include = split_patterns(patterns["include_variables"]);
+    variable_filter_.exclude = split_patterns(patterns["exclude_variables"]);
+    filtered_ = !barrier_filter_.include.empty() || !barrier_filter_.exclude.empty() ||
+                !variable_filter_.include.empty() || !variable_filter_.exclude.empty();
+}
+
+/**
+ * Start recording libm calls, if libcodetango_mathtrace is preloaded
+ */
+void Barrier::attach_mathtrace() {
+    typedef const codetango_math_function* (*attach_t)(codetango_mathtrace_sink, void*, size_t*);
+    attach_t attach = reinterpret_cast<attach_t>(dlsym(RTLD_DEFAULT, "codetango_mathtrace_attach"));
+    if (!attach) return;
+    
+    mathtrace_flush_ = reinterpret_cast<void (*)()>(dlsym(RTLD_DEFAULT, "codetango_mathtrace_flush"));
+    mathtrace_detach_ = reinterpret_cast<void (*)()>(dlsym(RTLD_DEFAULT, "codetango_mathtrace_detach"));
+    mathtrace_set_thread_ = reinterpret_cast<void (*)(unsigned)>(dlsym(RTLD_DEFAULT, "codetango_mathtrace_set_thread"));
+    if (!mathtrace_flush_ || !mathtrace_detach_ || !mathtrace_set_thread_) {
+        mathtrace_flush_ = nullptr;
+        mathtrace_detach_ = nullptr;
+        mathtrace_set_thread_ = nullptr;
+        return;
+    }
+    
+    size_t count;
+    const codetango_math_function* functions = attach(&Barrier::mathtrace_sink, this, &count);
+    std::stringstream ss;
+    ss << "[";
+    for (size_t i = 0; i < count; ++i) {
+        if (i > 0) ss << ",";
+        ss << "[\"" << functions[i].name << "\"," << functions[i].arity << "]";
+    }
+    ss << "]";
+    mathtrace_functions_ = ss.str();
+}
+
+/**
+ * Compare the libm calls of the calling thread, under a key
+ * 
+ * @param key The key of the thread, unique in the program and 1 or more
+ */
+void Barrier::trace_math_thread(unsigned key) {
+    if (key == 0) {
+        throw std::invalid_argument("Thread key 0 is the thread that constructed the Barrier");
+    }
+    if (mathtrace_set_thread_) {
+        mathtrace_set_thread_(key);
+    }
+}
+
+/**
+ * Send the libm calls recorded by a thread, called by libcodetango_mathtrace
+ * 
+ * @param ctx The Barrier
+ * @param thread The index of the thread
+ * @param records The recorded calls
+ * @param count The number of records
+ * @return true if the records were sent
+ */
+bool Barrier::mathtrace_sink(void* ctx, unsigned thread, const codetango_math_record* records, size_t count) {
+    Barrier* barrier = static_cast<Barrier*>(ctx);
+    std::lock_guard<std::recursive_mutex> guard(barrier->send_mutex_);
+    if (!barrier->connected_) return false;
+    
+    size_t bytes = count * sizeof(codetango_math_record);
+    std::stringstream ss;
+    ss << "{\"mathtrace\":" << thread << ",\"binary\":" << bytes;
+    if (!barrier->mathtrace_functions_.empty()) {
+        ss << ",\"functions\":" << barrier->mathtrace_functions_;
+        barrier->mathtrace_functions_.clear();
+    }
+    ss << "}";
+    
+    // Records that cannot be sent are dropped, the barrier will report the error
+    barrier->send_message(ss.str(), {{records, bytes}});
+    return true;
+}
+
+/**
+ * Collect the call sequence digests of the segment ending at a barrier
+ */
+void Barrier::read_calltrace() {
+    calltrace_.clear();
+    calltrace_digests_([](void* ctx, const codetango_call_digest* digest) {
+        auto& calltrace = *static_cast<std::map<unsigned, std::pair<unsigned long long, unsigned long long>>*>(ctx);
+        calltrace[digest->thread] = {digest->digest, digest->events};
+    }, &calltrace_);
+}
+
+/**
+ * Send the most recent calls of each thread, when the utility asks for them
+ * 
+ * The rings cover at most the calls of the segment ending at the barrier,
+ * so that both programs send the same window when the segment fits.
+ * 
+ * @return true if the calls were sent
+ */
+bool Barrier::send_calltrace_ring() {
+    std::stringstream ss;
+    ss << "{\"calltrace_ring\":{";
+    bool first = true;
+    for (const auto& thread : calltrace_) {
+        if (!calltrace_ring_) break;
+        if (!first) ss << ",";
+        first = false;
+        
+        // Events as [exit, function]
+        struct Ring {
+            Barrier* barrier;
+            std::string events;
+        } ring = {this, ""};
+        size_t count = calltrace_ring_(thread.first, thread.second.second, [](void* ctx, int exit, const char* function) {
+            Ring& ring = *static_cast<Ring*>(ctx);
+            if (!ring.events.empty()) ring.events += ",";
+            ring.events += "[" + std::to_string(exit) + ",\"" + ring.barrier->escape_json_string(function) + "\"]";
+        }, &ring);
+        ss << "\"" << thread.first << "\":{\"events\":" << thread.second.second
+           << ",\"count\":" << count << ",\"ring\":[" << ring.events << "]}";
+    }
+    ss << "}}";
+    
+    std::lock_guard<std::recursive_mutex> guard(send_mutex_);
+    return send_message(ss.str(), {});
+}
+
 /**
  * Create a JSON message for a barrier
  * 
  * @param barrier_id The ID of the barrier
+ * @param accounting Counter deltas of the segment ending at this barrier
+ * @param site The source location of the wait() call as file:line, or empty
+ * @param scalar_names Whether the names of the scalars are sent with their values
  * @return A JSON string representing the barrier message
  */
-std::string Barrier::make_barrier_json(const std::string& barrier_id) {
+std::string Barrier::make_barrier_json(const std::string& barrier_id,
+                                       const std::map<std::string, long long>& accounting,
+                                       const std::string& site, bool scalar_names) {
     std::stringstream ss;
     ss << "{";
     ss << "\"barrier_id\":\"" << barrier_id << "\",";
+    if (!site.empty()) {
+        ss << "\"site\":\"" << escape_json_string(site) << "\",";
+    }
     ss << "\"variables\":{";
     
     bool first = true;
@@ -219,10 +1276,244 @@ std::string Barrier::make_barrier_json(const std::string& barrier_id) {
         ss << "\"" << escaped_name << "\":" << value;
     }
     
-    ss << "}}";
+    ss << "}";
+    
+    // File regions are sent by reference
+    if (!files_.empty()) {
+        ss << ",\"files\":{";
+        first = true;
+        for (const auto& file : files_) {
+            if (!first) ss << ",";
+            first = false;
+            
+            const FileRegion& f = file.second;
+            ss << "\"" << escape_json_string(file.first) << "\":{";
+            ss << "\"path\":\"" << escape_json_string(f.path) << "\",";
+            ss << "\"offset\":" << f.offset << ",\"length\":" << f.length << ",";
+            ss << "\"dtype\":\"" << escape_json_string(f.dtype) << "\"}";
+        }
+        ss << "}";
+    }
+    
+    // Regions follow the header as binary payload, in the same order
+    size_t offset = 0;
+    if (!regions_.empty()) {
+        static const char hex[] = "0123456789abcdef";
+        ss << ",\"regions\":{";
+        first = true;
+        for (const auto& region : regions_) {
+            if (!first) ss << ",";
+            first = false;
+            
+            const Region& r = region.second;
+            ss << "\"" << escape_json_string(region.first) << "\":{";
+            ss << "\"offset\":" << offset << ",\"length\":" << r.bytes;
+            if (!r.mask.empty()) {
+                std::string mask;
+                for (unsigned char c : r.mask) {
+                    mask += hex[c >> 4];
+                    mask += hex[c & 0xf];
+                }
+                ss << ",\"mask\":\"" << mask << "\"";
+            }
+            if (!r.shape.empty()) {
+                ss << ",\"shape\":[";
+                for (size_t i = 0; i < r.shape.size(); ++i) {
+                    ss << (i ? "," : "") << r.shape[i];
+                }
+                ss << "],\"dtype\":\"" << escape_json_string(r.dtype) << "\"";
+            }
+            ss << "}";
+            offset += r.bytes;
+        }
+        ss << "}";
+    }
+    
+    // Writes to watched variables follow the regions, with the functions
+    // that made them
+    if (!watch_records_.empty()) {
+        ss << ",\"watches\":{";
+        first = true;
+        for (const auto& watch : watch_records_) {
+            if (!first) ss << ",";
+            first = false;
+            
+            const std::vector<WatchRecord>& records = watch.second.first;
+            ss << "\"" << escape_json_string(watch.first) << "\":{";
+            ss << "\"dtype\":\"" << watches_[watch.first].dtype << "\",";
+            ss << "\"offset\":" << offset << ",\"count\":" << records.size() << ",";
+            ss << "\"dropped\":" << watch.second.second << ",\"sites\":{";
+            std::map<uint64_t, std::string> sites;
+            for (const WatchRecord& record : records) {
+                if (sites.count(record.ip)) continue;
+                sites[record.ip] = describe_address(record.ip);
+                if (sites.size() > 1) ss << ",";
+                ss << "\"" << record.ip << "\":\"" << escape_json_string(sites[record.ip]) << "\"";
+            }
+            ss << "}}";
+            offset += records.size() * sizeof(WatchRecord);
+        }
+        ss << "}";
+    }
+    
+    // Scalars follow the watches: the name table if it is new, then the values
+    if (!scalar_values_.empty()) {
+        ss << ",\"scalars\":{\"table\":\"" << std::hex << std::setw(16) << std::setfill('0') << scalar_hash_
+           << std::dec << std::setfill(' ') << "\",\"count\":" << scalar_values_.size()
+           << ",\"offset\":" << offset;
+        if (scalar_names) {
+            ss << ",\"names\":" << scalar_names_.size();
+            offset += scalar_names_.size();
+        }
+        ss << "}";
+        offset += scalar_values_.size() * sizeof(double);
+    }
+    
+    // Lane variables follow the scalars
+    if (!lanes_.empty()) {
+        ss << ",\"lanes\":{";
+        first = true;
+        for (const auto& lanes : lanes_) {
+            if (!first) ss << ",";
+            first = false;
+            
+            const Lanes& l = lanes.second;
+            ss << "\"" << escape_json_string(lanes.first) << "\":{";
+            ss << "\"offset\":" << offset << ",\"count\":" << l.count << ",\"dtype\":\"" << l.dtype << "\"}";
+            offset += l.count * l.size;
+        }
+        ss << "}";
+    }
+    
+    if (offset > 0) {
+        ss << ",\"binary\":" << offset;
+    }
+    
+    if (!accounting.empty()) {
+        ss << ",\"accounting\":{";
+        first = true;
+        for (const auto& counter : accounting) {
+            if (!first) ss << ",";
+            first = false;
+            ss << "\"" << counter.first << "\":" << counter.second;
+        }
+        ss << "}";
+    }
+    
+    // Call sequence digests: [thread, digest, events]
+    if (!calltrace_.empty()) {
+        ss << ",\"calltrace\":[";
+        first = true;
+        for (const auto& thread : calltrace_) {
+            if (!first) ss << ",";
+            first = false;
+            ss << "[" << thread.first << ",\"" << std::hex << std::setw(16) << std::setfill('0')
+               << thread.second.first << std::dec << std::setfill(' ') << "\"," << thread.second.second << "]";
+        }
+        ss << "]";
+    }
+    
+    // Streams follow the message as chunk messages
+    if (!streams_.empty()) {
+        ss << ",\"streams\":{";
+        first = true;
+        for (const auto& stream : streams_) {
+            if (!first) ss << ",";
+            first = false;
+            ss << "\"" << escape_json_string(stream.first) << "\":{\"dtype\":\"" << stream.second.dtype << "\"}";
+        }
+        ss << "}";
+    }
+    
+    ss << "}";
     return ss.str();
 }
 
+/**
+ * Send a message followed by its binary payload
+ * 
+ * @param header The JSON header, without the trailing newline
+ * @param payload The buffers to send after the header
+ * @return true if everything was sent
+ */
+bool Barrier::send_message(const std::string& header, const std::vector<std::pair<const void*, size_t>>& payload) {
+    static const char newline = '\n';
+    std::vector<struct iovec> iov;
+    iov.push_back({const_cast<char*>(header.data()), header.size()});
+    iov.push_back({const_cast<char*>(&newline), 1});
+    for (const auto& buffer : payload) {
+        if (buffer.second > 0) {
+            iov.push_back({const_cast<void*>(buffer.first), buffer.second});
+        }
+    }
+    
+    // Keep writing until the socket has taken everything
+    size_t index = 0;
+    while (index < iov.size()) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov[index];
+        msg.msg_iovlen = std::min(iov.size() - index, (size_t)IOV_MAX);
+        ssize_t sent = sendmsg(socket_fd_, &msg, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        while (sent > 0) {
+            size_t n = std::min((size_t)sent, iov[index].iov_len);
+            iov[index].iov_base = static_cast<char*>(iov[index].iov_base) + n;
+            iov[index].iov_len -= n;
+            sent -= n;
+            if (iov[index].iov_len == 0) index++;
+        }
+    }
+    return true;
+}
+
+/**
+ * Send the chunks of the registered streams, in the order of their names
+ * 
+ * @return true if everything was sent
+ */
+bool Barrier::send_streams() {
+    for (auto& stream : streams_) {
+        std::string name = escape_json_string(stream.first);
+        const void* data;
+        size_t bytes;
+        while (stream.second.next(data, bytes)) {
+            if (bytes == 0) continue;
+            std::stringstream ss;
+            ss << "{\"stream\":\"" << name << "\",\"binary\":" << bytes << "}";
+            if (!send_message(ss.str(), {{data, bytes}})) return false;
+        }
+        if (!send_message("{\"stream\":\"" + name + "\",\"end\":true}", {})) return false;
+    }
+    return true;
+}
+
+/**
+ * Receive one newline-terminated message from the utility
+ * 
+ * @param line Receives the message without the trailing newline
+ * @return true if a message was received
+ */
+bool Barrier::recv_message(std::string& line) {
+    size_t end;
+    while ((end = recv_buffer_.find('\n')) == std::string::npos) {
+        char buffer[4096];
+        ssize_t received = recv(socket_fd_, buffer, sizeof(buffer), 0);
+        if (received == -1 && errno == EINTR) continue;
+        if (received <= 0) {
+            if (received == 0) errno = 0;
+            return false;
+        }
+        recv_buffer_.append(buffer, received);
+    }
+    line = recv_buffer_.substr(0, end);
+    recv_buffer_.erase(0, end + 1);
+    return true;
+}
+
 /**
  * Escape a string for JSON
  * 
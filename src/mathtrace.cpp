@@ -0,0 +1,313 @@
+#include "mathtrace.h"
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <sched.h>
+
+/*
+ * libm tracing library
+ *
+ * Preloaded into a program, it interposes the libm entry points and records
+ * the arguments and result of each call into a buffer per thread. Only the
+ * thread that attached and the threads given a key are recorded. The
+ * buffers are drained by libcodetango at each barrier, or when they reach
+ * CODETANGO_MATHTRACE_LIMIT records (default: 65536).
+ */
+
+// Functions taking one double
+#define CODETANGO_MATH_UNARY(X) \
+    X(exp) X(exp2) X(expm1) X(log) X(log2) X(log10) X(log1p) \
+    X(sin) X(cos) X(tan) X(asin) X(acos) X(atan) \
+    X(sinh) X(cosh) X(tanh) X(asinh) X(acosh) X(atanh) \
+    X(sqrt) X(cbrt) X(erf) X(erfc) X(tgamma) X(lgamma)
+
+// Functions taking two doubles
+#define CODETANGO_MATH_BINARY(X) \
+    X(pow) X(atan2) X(hypot) X(fmod)
+
+// Functions taking one float
+#define CODETANGO_MATH_UNARY_FLOAT(X) \
+    X(expf) X(logf) X(sinf) X(cosf) X(tanf) X(sqrtf)
+
+// Functions taking two floats
+#define CODETANGO_MATH_BINARY_FLOAT(X) \
+    X(powf) X(atan2f)
+
+#define CODETANGO_MATH_ENUM(name) FUNCTION_##name,
+
+enum {
+    CODETANGO_MATH_UNARY(CODETANGO_MATH_ENUM)
+    CODETANGO_MATH_BINARY(CODETANGO_MATH_ENUM)
+    CODETANGO_MATH_UNARY_FLOAT(CODETANGO_MATH_ENUM)
+    CODETANGO_MATH_BINARY_FLOAT(CODETANGO_MATH_ENUM)
+    FUNCTION_COUNT
+};
+
+#define CODETANGO_MATH_NAME_UNARY(name) {#name, 1},
+#define CODETANGO_MATH_NAME_BINARY(name) {#name, 2},
+
+static const codetango_math_function functions[FUNCTION_COUNT] = {
+    CODETANGO_MATH_UNARY(CODETANGO_MATH_NAME_UNARY)
+    CODETANGO_MATH_BINARY(CODETANGO_MATH_NAME_BINARY)
+    CODETANGO_MATH_UNARY_FLOAT(CODETANGO_MATH_NAME_UNARY)
+    CODETANGO_MATH_BINARY_FLOAT(CODETANGO_MATH_NAME_BINARY)
+};
+
+namespace {
+
+/**
+ * The recorded calls of one thread
+ */
+struct ThreadBuffer {
+    unsigned index;
+    std::atomic<bool> locked;
+    std::atomic<bool> finished;
+    codetango_math_record* records;
+    size_t count;
+    size_t capacity;
+
+    void lock() {
+        while (locked.exchange(true, std::memory_order_acquire)) {
+            sched_yield();
+        }
+    }
+
+    void unlock() {
+        locked.store(false, std::memory_order_release);
+    }
+};
+
+/**
+ * Marks the buffer of a thread as finished when the thread exits
+ */
+struct ThreadBufferOwner {
+    ThreadBuffer* buffer = nullptr;
+
+    ~ThreadBufferOwner() {
+        if (buffer) buffer->finished.store(true);
+    }
+};
+
+std::atomic<bool> attached(false);
+codetango_mathtrace_sink sink = nullptr;
+void* sink_ctx = nullptr;
+size_t limit = 65536;
+
+// Buffers of all threads that recorded calls since they were last drained
+std::mutex registry_mutex;
+std::vector<ThreadBuffer*> registry;
+
+thread_local ThreadBufferOwner owner;
+
+// Key of the thread, set when the thread attaches or is given one
+thread_local bool keyed = false;
+thread_local unsigned thread_key = 0;
+
+// Set while the thread records or drains, so that libm calls made by the
+// sink or the allocator are not recorded
+thread_local bool busy = false;
+
+ThreadBuffer* register_thread() {
+    ThreadBuffer* buffer = new ThreadBuffer();
+    buffer->locked.store(false);
+    buffer->finished.store(false);
+    buffer->records = nullptr;
+    buffer->count = 0;
+    buffer->capacity = 0;
+
+    std::lock_guard<std::mutex> guard(registry_mutex);
+    buffer->index = thread_key;
+    registry.push_back(buffer);
+    owner.buffer = buffer;
+    return buffer;
+}
+
+/**
+ * Pass the records of a thread to the sink
+ *
+ * The records are swapped out under the buffer lock and passed to the
+ * sink without it, so the thread keeps recording while they are sent.
+ */
+void flush_buffer(ThreadBuffer* buffer) {
+    buffer->lock();
+    codetango_math_record* records = buffer->records;
+    size_t count = buffer->count;
+    size_t capacity = buffer->capacity;
+    buffer->records = nullptr;
+    buffer->count = 0;
+    buffer->capacity = 0;
+    buffer->unlock();
+
+    if (count == 0 || (sink && sink(sink_ctx, buffer->index, records, count))) {
+        free(records);
+        return;
+    }
+
+    // The sink declined: put the records back in front of the new ones
+    buffer->lock();
+    size_t total = count + buffer->count;
+    if (total > capacity) {
+        capacity = total;
+        records = static_cast<codetango_math_record*>(realloc(records, capacity * sizeof(codetango_math_record)));
+    }
+    if (buffer->count > 0) {
+        memcpy(records + count, buffer->records, buffer->count * sizeof(codetango_math_record));
+    }
+    free(buffer->records);
+    buffer->records = records;
+    buffer->count = total;
+    buffer->capacity = capacity;
+    buffer->unlock();
+}
+
+void record(uint32_t function, double arg0, double arg1, double result) {
+    if (!attached.load(std::memory_order_relaxed) || busy) return;
+    if (!owner.buffer && !keyed) return;
+    busy = true;
+
+    ThreadBuffer* buffer = owner.buffer ? owner.buffer : register_thread();
+    buffer->lock();
+    if (buffer->count == buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 1024;
+        void* records = realloc(buffer->records, capacity * sizeof(codetango_math_record));
+        if (!records) {
+            buffer->unlock();
+            busy = false;
+            return;
+        }
+        buffer->records = static_cast<codetango_math_record*>(records);
+        buffer->capacity = capacity;
+    }
+    codetango_math_record& r = buffer->records[buffer->count++];
+    r.function = function;
+    r.reserved = 0;
+    r.args[0] = arg0;
+    r.args[1] = arg1;
+    r.result = result;
+    bool full = buffer->count >= limit;
+    buffer->unlock();
+
+    if (full) {
+        flush_buffer(buffer);
+    }
+    busy = false;
+}
+
+} // namespace
+
+#define CODETANGO_MATH_WRAP_UNARY(name, type) \
+    extern "C" type name(type x) { \
+        static type (*real)(type) = reinterpret_cast<type (*)(type)>(dlsym(RTLD_NEXT, #name)); \
+        type result = real(x); \
+        record(FUNCTION_##name, x, 0, result); \
+        return result; \
+    }
+
+#define CODETANGO_MATH_WRAP_BINARY(name, type) \
+    extern "C" type name(type x, type y) { \
+        static type (*real)(type, type) = reinterpret_cast<type (*)(type, type)>(dlsym(RTLD_NEXT, #name)); \
+        type result = real(x, y); \
+        record(FUNCTION_##name, x, y, result); \
+        return result; \
+    }
+
+#define CODETANGO_MATH_WRAP_UNARY_DOUBLE(name) CODETANGO_MATH_WRAP_UNARY(name, double)
+#define CODETANGO_MATH_WRAP_BINARY_DOUBLE(name) CODETANGO_MATH_WRAP_BINARY(name, double)
+#define CODETANGO_MATH_WRAP_UNARY_FLOAT(name) CODETANGO_MATH_WRAP_UNARY(name, float)
+#define CODETANGO_MATH_WRAP_BINARY_FLOAT(name) CODETANGO_MATH_WRAP_BINARY(name, float)
+
+CODETANGO_MATH_UNARY(CODETANGO_MATH_WRAP_UNARY_DOUBLE)
+CODETANGO_MATH_BINARY(CODETANGO_MATH_WRAP_BINARY_DOUBLE)
+CODETANGO_MATH_UNARY_FLOAT(CODETANGO_MATH_WRAP_UNARY_FLOAT)
+CODETANGO_MATH_BINARY_FLOAT(CODETANGO_MATH_WRAP_BINARY_FLOAT)
+
+/**
+ * Start recording, discarding anything recorded before
+ *
+ * @param new_sink The sink of the recorded calls
+ * @param ctx Passed to the sink
+ * @param count Receives the number of functions in the table
+ * @return The function table
+ */
+extern "C" const codetango_math_function* codetango_mathtrace_attach(codetango_mathtrace_sink new_sink, void* ctx, size_t* count) {
+    const char* env = getenv("CODETANGO_MATHTRACE_LIMIT");
+    if (env && atol(env) > 0) {
+        limit = atol(env);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(registry_mutex);
+        for (ThreadBuffer* buffer : registry) {
+            buffer->lock();
+            buffer->count = 0;
+            buffer->unlock();
+        }
+        sink = new_sink;
+        sink_ctx = ctx;
+    }
+    codetango_mathtrace_set_thread(0);
+    attached.store(true);
+
+    *count = FUNCTION_COUNT;
+    return functions;
+}
+
+/**
+ * Record the calls of the calling thread under a key
+ *
+ * @param key The key of the thread
+ */
+extern "C" void codetango_mathtrace_set_thread(unsigned key) {
+    keyed = true;
+    thread_key = key;
+    if (owner.buffer) {
+        owner.buffer->lock();
+        owner.buffer->index = key;
+        owner.buffer->unlock();
+    }
+}
+
+/**
+ * Stop recording
+ */
+extern "C" void codetango_mathtrace_detach() {
+    attached.store(false);
+    std::lock_guard<std::mutex> guard(registry_mutex);
+    sink = nullptr;
+    sink_ctx = nullptr;
+}
+
+/**
+ * Pass the calls recorded by all threads to the sink
+ */
+extern "C" void codetango_mathtrace_flush() {
+    busy = true;
+    std::vector<ThreadBuffer*> buffers;
+    {
+        std::lock_guard<std::mutex> guard(registry_mutex);
+        buffers = registry;
+    }
+
+    for (ThreadBuffer* buffer : buffers) {
+        flush_buffer(buffer);
+    }
+
+    // Buffers of exited threads are not needed once drained
+    {
+        std::lock_guard<std::mutex> guard(registry_mutex);
+        for (size_t i = 0; i < registry.size();) {
+            ThreadBuffer* buffer = registry[i];
+            if (buffer->finished.load() && buffer->count == 0) {
+                free(buffer->records);
+                delete buffer;
+                registry.erase(registry.begin() + i);
+            } else {
+                ++i;
+            }
+        }
+    }
+    busy = false;
+}
@@ -0,0 +1,87 @@
+#ifndef CODETANGO_MATHTRACE_H
+#define CODETANGO_MATHTRACE_H
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Interface between libcodetango and the libm tracing library
+ * libcodetango_mathtrace.so, which is preloaded into the programs.
+ * libcodetango finds these functions with dlsym(), so programs run
+ * unchanged without the tracing library.
+ */
+
+extern "C" {
+
+/**
+ * A recorded math call
+ */
+struct codetango_math_record {
+    uint32_t function;  // Index into the function table
+    uint32_t reserved;
+    double args[2];     // The second argument is 0 for unary functions
+    double result;
+};
+
+/**
+ * A function of the function table
+ */
+struct codetango_math_function {
+    const char* name;
+    int arity;
+};
+
+/**
+ * Receives the recorded calls of a thread
+ * 
+ * @param ctx The context given to codetango_mathtrace_attach()
+ * @param thread The key of the thread: 0 for the thread that attached, or the
+ *               key given to codetango_mathtrace_set_thread()
+ * @param records The recorded calls, in call order
+ * @param count The number of records
+ * @return true if the records were consumed, false to keep them buffered
+ */
+typedef bool (*codetango_mathtrace_sink)(void* ctx, unsigned thread,
+                                         const codetango_math_record* records, size_t count);
+
+/**
+ * Start recording, discarding anything recorded before
+ * 
+ * The calls of the calling thread are recorded as thread 0; other threads
+ * are recorded once they call codetango_mathtrace_set_thread(). The sink
+ * is called from the recording thread when its buffer is full, and from
+ * codetango_mathtrace_flush().
+ * 
+ * @param sink The sink of the recorded calls
+ * @param ctx Passed to the sink
+ * @param count Receives the number of functions in the table
+ * @return The function table
+ */
+const codetango_math_function* codetango_mathtrace_attach(codetango_mathtrace_sink sink, void* ctx, size_t* count);
+
+/**
+ * Record the calls of the calling thread under a key
+ * 
+ * Threads are paired across the programs by their keys, so each thread
+ * that is compared needs a key that is unique in its program and names
+ * the same work in both, e.g. the index of a worker. Threads are numbered
+ * by the program rather than by the order of their first call, which
+ * depends on scheduling.
+ * 
+ * @param key The key of the thread, 1 or more
+ */
+void codetango_mathtrace_set_thread(unsigned key);
+
+/**
+ * Stop recording
+ */
+void codetango_mathtrace_detach();
+
+/**
+ * Pass the calls recorded by all threads to the sink
+ */
+void codetango_mathtrace_flush();
+
+}
+
+#endif // CODETANGO_MATHTRACE_H
@@ -0,0 +1,99 @@
+#ifndef CODETANGO_PROBES_H
+#define CODETANGO_PROBES_H
+
+#include <chrono>
+#include <cstdint>
+
+/*
+ * USDT probes of libcodetango, for bpftrace, perf and other tracers
+ * reading SystemTap SDT notes. A probe is a single nop plus an ELF note
+ * describing its arguments, so it costs nothing until a tracer attaches.
+ *
+ * Built with CODETANGO_PROBES defined (the BUILD_PROBES option). The
+ * probes use <sys/sdt.h> when it is available, and otherwise emit the same
+ * notes themselves on x86-64 and AArch64 with GCC or Clang; elsewhere they
+ * compile to nothing. Listed by readelf -n libcodetango.so.
+ *
+ * Probes of provider "codetango"; strings are char*, sizes in bytes and
+ * times in nanoseconds:
+ *   add(name, kind, bytes)                 a variable is registered
+ *   serialize_begin(barrier_id)            the barrier message is built
+ *   serialize_end(barrier_id, header, payload)
+ *   send(barrier_id, bytes, latency)       the message was sent
+ *   receive(barrier_id, bytes, latency)    the result arrived after waiting latency
+ *   release(barrier_id, success, latency)  wait() returns after latency
+ */
+
+#if defined(CODETANGO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CODETANGO_HAS_PROBES 1
+#define CODETANGO_PROBE1(name, a1) DTRACE_PROBE1(codetango, name, a1)
+#define CODETANGO_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(codetango, name, a1, a2, a3)
+#endif
+#endif
+
+#if defined(CODETANGO_PROBES) && !defined(CODETANGO_HAS_PROBES) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__aarch64__))
+#define CODETANGO_HAS_PROBES 1
+
+// The note layout of <sys/sdt.h>: probe address, base address for prelinked
+// libraries, no semaphore, then provider, name and arguments as size@register
+#define CODETANGO_PROBE_NOTE(name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte 0\n" \
+    ".asciz \"codetango\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+// Arguments are passed as 64-bit registers, which the tracer reads at the nop
+#define CODETANGO_PROBE1(name, a1) \
+    __asm__ __volatile__(CODETANGO_PROBE_NOTE(name, "8@%0") \
+                         :: "r"((unsigned long long)(a1)))
+#define CODETANGO_PROBE3(name, a1, a2, a3) \
+    __asm__ __volatile__(CODETANGO_PROBE_NOTE(name, "8@%0 8@%1 8@%2") \
+                         :: "r"((unsigned long long)(a1)), "r"((unsigned long long)(a2)), \
+                            "r"((unsigned long long)(a3)))
+#endif
+
+#ifndef CODETANGO_HAS_PROBES
+#define CODETANGO_PROBE1(name, a1) do {} while (0)
+#define CODETANGO_PROBE3(name, a1, a2, a3) do {} while (0)
+#endif
+
+namespace codetango {
+
+/**
+ * Get a timestamp for the latency arguments of the probes
+ *
+ * @return Nanoseconds of a monotonic clock, or 0 if the probes are not built
+ */
+inline uint64_t probe_clock() {
+#ifdef CODETANGO_HAS_PROBES
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#else
+    return 0;
+#endif
+}
+
+} // namespace codetango
+
+#endif // CODETANGO_PROBES_H
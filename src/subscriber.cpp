@@ -0,0 +1,148 @@
+#include "codetango_subscriber.h"
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace codetango;
+
+// The layout written by codetango/shm.py
+static const char RING_MAGIC[8] = {'C', 'T', 'R', 'I', 'N', 'G', '1', '\0'};
+static const size_t RING_HEADER_SIZE = 4096;
+enum { RING_CAPACITY = 1, RING_HEAD = 2, RING_TAIL = 3, RING_RECORDS = 4, RING_CLOSED = 5 };
+
+static const uint32_t RECORD_CHECKPOINT = 1;
+static const size_t RECORD_FRAME_SIZE = 16;
+
+static const char* const ARRAY_DTYPES[] = {"uint8", "int64", "float64"};
+
+/**
+ * Load a header field published by the utility
+ */
+static uint64_t load(const uint64_t* header, int field) {
+    return __atomic_load_n(header + field, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Round a size up to a multiple of 8 bytes
+ */
+static size_t aligned(size_t size) {
+    return (size + 7) & ~size_t(7);
+}
+
+Subscriber::Subscriber(const std::string& name)
+    : map_(nullptr), map_size_(0), header_(nullptr), data_(nullptr), capacity_(0),
+      position_(0), sequence_(0), dropped_(0) {
+    std::string path = "/dev/shm/" + name;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < RING_HEADER_SIZE) {
+        close(fd);
+        throw std::runtime_error(path + " is not a CodeTango checkpoint ring");
+    }
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        throw std::runtime_error("Failed to map " + path + ": " + strerror(errno));
+    }
+    map_ = static_cast<const unsigned char*>(map);
+    map_size_ = st.st_size;
+    header_ = reinterpret_cast<const uint64_t*>(map_);
+    data_ = map_ + RING_HEADER_SIZE;
+    capacity_ = header_[RING_CAPACITY];
+    if (memcmp(map_, RING_MAGIC, sizeof(RING_MAGIC)) != 0 || RING_HEADER_SIZE + capacity_ > map_size_) {
+        munmap(map, map_size_);
+        throw std::runtime_error(path + " is not a CodeTango checkpoint ring");
+    }
+    position_ = load(header_, RING_HEAD);
+    sequence_ = load(header_, RING_RECORDS);
+}
+
+Subscriber::~Subscriber() {
+    munmap(const_cast<unsigned char*>(map_), map_size_);
+}
+
+bool Subscriber::closed() const {
+    return load(header_, RING_CLOSED) && position_ >= load(header_, RING_HEAD);
+}
+
+bool Subscriber::next(SharedCheckpoint& checkpoint) {
+    while (position_ < load(header_, RING_HEAD)) {
+        uint64_t tail = load(header_, RING_TAIL);
+        if (position_ < tail) {
+            position_ = tail;
+            continue;
+        }
+
+        // Copy the record, then check that the utility did not start overwriting it meanwhile
+        size_t offset = position_ % capacity_;
+        uint32_t size, kind;
+        uint64_t sequence;
+        memcpy(&size, data_ + offset, 4);
+        memcpy(&kind, data_ + offset + 4, 4);
+        memcpy(&sequence, data_ + offset + 8, 8);
+        if (size < RECORD_FRAME_SIZE || size % RECORD_FRAME_SIZE || offset + size > capacity_) {
+            // Overwritten while it was read, or else lost track: start over at the newest record
+            tail = load(header_, RING_TAIL);
+            position_ = tail > position_ ? tail : load(header_, RING_HEAD);
+            continue;
+        }
+        record_.resize((size - RECORD_FRAME_SIZE) / 8);
+        memcpy(record_.data(), data_ + offset + RECORD_FRAME_SIZE, size - RECORD_FRAME_SIZE);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (load(header_, RING_TAIL) > position_) {
+            continue;
+        }
+        position_ += size;
+        if (kind != RECORD_CHECKPOINT) {
+            continue;
+        }
+        dropped_ += sequence > sequence_ ? sequence - sequence_ : 0;
+        sequence_ = sequence + 1;
+
+        // occurrence, matched, array count, barrier ID bytes, metadata bytes
+        const unsigned char* body = reinterpret_cast<const unsigned char*>(record_.data());
+        uint32_t matched, count, barrier_bytes, metadata_bytes;
+        memcpy(&checkpoint.occurrence, body, 8);
+        memcpy(&matched, body + 8, 4);
+        memcpy(&count, body + 12, 4);
+        memcpy(&barrier_bytes, body + 16, 4);
+        memcpy(&metadata_bytes, body + 20, 4);
+        size_t at = 24;
+        checkpoint.sequence = sequence;
+        checkpoint.matched = matched != 0;
+        checkpoint.barrier_id.assign(reinterpret_cast<const char*>(body + at), barrier_bytes);
+        at += aligned(barrier_bytes);
+        checkpoint.metadata.assign(reinterpret_cast<const char*>(body + at), metadata_bytes);
+        at += aligned(metadata_bytes);
+
+        // Array descriptors: offset, bytes, dtype, program number, name bytes, reserved, name
+        checkpoint.arrays.resize(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            SharedArray& array = checkpoint.arrays[i];
+            uint64_t array_offset, array_bytes;
+            uint16_t name_bytes;
+            memcpy(&array_offset, body + at, 8);
+            memcpy(&array_bytes, body + at + 8, 8);
+            unsigned char dtype = body[at + 16];
+            array.program = "program" + std::to_string(body[at + 17]);
+            memcpy(&name_bytes, body + at + 18, 2);
+            at += 24;
+            array.name.assign(reinterpret_cast<const char*>(body + at), name_bytes);
+            at += aligned(name_bytes);
+            array.dtype = dtype < 3 ? ARRAY_DTYPES[dtype] : "uint8";
+            array.data = body + array_offset;
+            array.bytes = array_bytes;
+        }
+        return true;
+    }
+    return false;
+}